@@ -0,0 +1,68 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * Helpers shared by the benchmarks. Each scenario is run several
+ * times, and min, median and max duration of one operation are
+ * printed. With --csv the results are printed as CSV instead, one
+ * scenario per line, for the regression tracking.
+ */
+
+static uint64_t
+bench_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int
+bench_cmp_double(const void *a, const void *b)
+{
+	double l = *(const double *)a;
+	double r = *(const double *)b;
+	if (l < r)
+		return -1;
+	return l > r;
+}
+
+static bool bench_is_csv = false;
+
+/**
+ * Parse the command line of a benchmark. Returns -1 and prints the
+ * usage on an unknown argument.
+ */
+static int
+bench_parse_args(int argc, char **argv)
+{
+	for (int i = 1; i < argc; ++i) {
+		if (strcmp(argv[i], "--csv") == 0) {
+			bench_is_csv = true;
+			continue;
+		}
+		printf("Usage: %s [--csv]\n", argv[0]);
+		return -1;
+	}
+	return 0;
+}
+
+/** Print the durations of one operation in the runs of a scenario. */
+static void
+bench_report(const char *name, double *times, int count)
+{
+	qsort(times, count, sizeof(*times), bench_cmp_double);
+	if (bench_is_csv) {
+		printf("\"%s\",%.2lf,%.2lf,%.2lf\n", name, times[0],
+			times[count / 2], times[count - 1]);
+		return;
+	}
+	printf("%s\n", name);
+	printf("    min: %.2lf ns\n", times[0]);
+	printf("    med: %.2lf ns\n", times[count / 2]);
+	printf("    max: %.2lf ns\n", times[count - 1]);
+}
@@ -4,8 +4,41 @@
 #include "rlist.h"
 
 #include <assert.h>
+#include <new>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+
+enum {
+	CORO_BUS_CACHE_LINE_SIZE = 64,
+};
+
+/**
+ * The wait queues are protected by a spinlock. It is held only for
+ * a few list operations and the wakeups, never across a
+ * suspension.
+ */
+static inline void
+coro_bus_lock(int *lock)
+{
+	int spin_count = 0;
+	while (__atomic_exchange_n(lock, 1, __ATOMIC_ACQUIRE) != 0) {
+		while (__atomic_load_n(lock, __ATOMIC_RELAXED) != 0) {
+			/* The owner thread might be preempted. */
+			if (++spin_count % 64 == 0)
+				sched_yield();
+		}
+	}
+}
+
+static inline void
+coro_bus_unlock(int *lock)
+{
+	__atomic_store_n(lock, 0, __ATOMIC_RELEASE);
+}
 
 /**
  * One coroutine waiting to be woken up in a list of other
@@ -16,213 +49,1397 @@ struct wakeup_entry {
 	struct coro *coro;
 };
 
-/** A queue of suspended coros waiting to be woken up. */
+/**
+ * A queue of suspended coros waiting to be woken up. A waiter
+ * leaves the queue itself when it is done. So only the first one
+ * is woken up, and the others keep their order while it retries.
+ *
+ * It is not a coro_wait_queue, because a select waiter has its
+ * entries in many queues at once, while a coro links itself into
+ * one wait queue only. Besides, the waiters may be on other
+ * threads' single-thread engines, which can't be woken up through
+ * a wait queue. So waking up all of them is a coro_wakeup() each.
+ */
 struct wakeup_queue {
+	/** Protects the list from the concurrent threads. */
+	int lock;
+	/**
+	 * Size of the list. Is read without the lock to skip the
+	 * empty queues.
+	 */
+	size_t count;
 	struct rlist coros;
 };
 
-#if 0 /* Uncomment this if want to use */
+static void
+wakeup_queue_create(struct wakeup_queue *queue)
+{
+	queue->lock = 0;
+	queue->count = 0;
+	rlist_create(&queue->coros);
+}
 
-/** Suspend the current coroutine until it is woken up. */
+/**
+ * Put the current coroutine to the end of the queue. After that
+ * the waiter must check its condition again before suspending, so
+ * the fence. It pairs with the one in the wakers: either they see
+ * the waiter, or the waiter sees what they did.
+ */
 static void
-wakeup_queue_suspend_this(struct wakeup_queue *queue)
+wakeup_queue_add(struct wakeup_queue *queue, struct wakeup_entry *entry)
 {
-	struct wakeup_entry entry;
-	entry.coro = coro_this();
-	rlist_add_tail_entry(&queue->coros, &entry, base);
-	coro_suspend();
-	rlist_del_entry(&entry, base);
+	entry->coro = coro_this();
+	coro_bus_lock(&queue->lock);
+	rlist_add_tail_entry(&queue->coros, entry, base);
+	__atomic_store_n(&queue->count, queue->count + 1, __ATOMIC_RELAXED);
+	coro_bus_unlock(&queue->lock);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
 }
 
-/** Wakeup the first coroutine in the queue. */
+static void
+wakeup_queue_del(struct wakeup_queue *queue, struct wakeup_entry *entry)
+{
+	coro_bus_lock(&queue->lock);
+	rlist_del_entry(entry, base);
+	__atomic_store_n(&queue->count, queue->count - 1, __ATOMIC_RELAXED);
+	coro_bus_unlock(&queue->lock);
+}
+
+/**
+ * Wakeup the first coro in the queue. It is done under the lock,
+ * so the waiter can't leave and finish meanwhile.
+ */
 static void
 wakeup_queue_wakeup_first(struct wakeup_queue *queue)
 {
-	if (rlist_empty(&queue->coros))
+	if (__atomic_load_n(&queue->count, __ATOMIC_RELAXED) == 0)
 		return;
-	struct wakeup_entry *entry = rlist_first_entry(&queue->coros,
-		struct wakeup_entry, base);
-	coro_wakeup(entry->coro);
+	coro_bus_lock(&queue->lock);
+	if (!rlist_empty(&queue->coros)) {
+		struct wakeup_entry *entry = rlist_first_entry(&queue->coros,
+			struct wakeup_entry, base);
+		coro_wakeup(entry->coro);
+	}
+	coro_bus_unlock(&queue->lock);
 }
 
-#endif
+static void
+wakeup_queue_wakeup_all(struct wakeup_queue *queue)
+{
+	coro_bus_lock(&queue->lock);
+	struct wakeup_entry *entry;
+	rlist_foreach_entry(entry, &queue->coros, base)
+		coro_wakeup(entry->coro);
+	coro_bus_unlock(&queue->lock);
+}
+
+/**
+ * A cell of a channel's ring buffer. In the MPMC mode its sequence
+ * number tells whose turn it is. When it equals the position of
+ * the cell, the cell is free for the sender of that position. When
+ * it is the position + 1, the cell has the message for the
+ * receiver. The message follows the header in the same cell.
+ */
+struct coro_bus_cell {
+	size_t seq;
+};
+
+static inline unsigned char *
+coro_bus_cell_data(struct coro_bus_cell *cell)
+{
+	return (unsigned char *)(cell + 1);
+}
+
+/**
+ * Copy a message. Unsigned and pointer are the usual sizes, and
+ * are copied inline instead of a call.
+ */
+static inline void
+coro_bus_msg_copy(void *dst, const void *src, size_t size)
+{
+	if (size == sizeof(unsigned))
+		memcpy(dst, src, sizeof(unsigned));
+	else if (size == sizeof(void *))
+		memcpy(dst, src, sizeof(void *));
+	else
+		memcpy(dst, src, size);
+}
 
+/**
+ * A channel is a ring buffer with a capacity of a power of 2, not
+ * less than the size limit. The positions of the head and the tail
+ * only grow, and the cell of a position is its remainder of the
+ * capacity. The receivers' part and the senders' part are on
+ * separate cache lines, so they don't bounce one line between the
+ * threads.
+ *
+ * Each send and receive in progress pins the channel. A closed
+ * channel is never freed, only reused for a new one when nobody
+ * pins it. So the operations find the channels without locks, see
+ * coro_bus_channel_pin().
+ */
 struct coro_bus_channel {
-	/** Channel max capacity. */
+	/** Position of the next message to receive. */
+	alignas(CORO_BUS_CACHE_LINE_SIZE) size_t head;
+	/** The tail seen by the last receive, in the SPSC mode. */
+	size_t tail_cached;
+	/** Number of the receives in progress. */
+	size_t recv_refs;
+
+	/** Position of the next message to send. */
+	alignas(CORO_BUS_CACHE_LINE_SIZE) size_t tail;
+	/** The head seen by the last send, in the SPSC mode. */
+	size_t head_cached;
+	/** Number of the sends in progress. */
+	size_t send_refs;
+
+	/** The ring of cells, cell_size bytes each. */
+	alignas(CORO_BUS_CACHE_LINE_SIZE) unsigned char *cells;
+	/** Capacity of the ring minus 1. */
+	size_t mask;
+	size_t msg_size;
+	/** The cell header and the message, aligned. */
+	size_t cell_size;
+	coro_bus_msg_destructor_f msg_destructor;
+	/**
+	 * Channel max capacity. Changes in the adaptive mode, so is
+	 * accessed atomically.
+	 */
 	size_t size_limit;
+	/** Bounds of the size limit, 0 max if it is fixed. */
+	size_t size_limit_min;
+	size_t size_limit_max;
+	bool is_spsc;
+	/** The channel is closed, its waiters must leave. */
+	bool is_closed;
 	/** Coroutines waiting until the channel is not full. */
 	struct wakeup_queue send_queue;
 	/** Coroutines waiting until the channel is not empty. */
 	struct wakeup_queue recv_queue;
-	/** Message queue. */
-	/* std::vector/queue/deque/list/...<unsigned> data; */
+	/** Link in the closed channels of the bus. */
+	struct rlist in_free;
+
+	/**
+	 * The stats, see struct coro_bus_channel_stats. The peak is
+	 * the max of the two.
+	 */
+	alignas(CORO_BUS_CACHE_LINE_SIZE) size_t peak_size;
+	/** The peak since the last shrink check of the adaptive mode. */
+	size_t window_peak_size;
+	uint64_t send_wait_ns;
+	uint64_t recv_wait_ns;
+};
+
+enum {
+	CORO_BUS_BITMAP_WORD_BITS = 64,
+	/** Enough levels for any int descriptor. */
+	CORO_BUS_BITMAP_LEVEL_MAX = 6,
+};
+
+/**
+ * Bitmap of the free descriptors, to find the lowest one without a
+ * scan. A bit of an upper level is set when the word below it has
+ * any bits set, and the top level is one word. So the lowest free
+ * descriptor is found with one find-first-set per level.
+ */
+struct coro_bus_bitmap {
+	uint64_t *levels[CORO_BUS_BITMAP_LEVEL_MAX];
+	int level_count;
+};
+
+/** Create a bitmap of @a bit_count bits, all clear. */
+static void
+coro_bus_bitmap_create(struct coro_bus_bitmap *bitmap, size_t bit_count)
+{
+	bitmap->level_count = 0;
+	while (bit_count > 0) {
+		assert(bitmap->level_count < CORO_BUS_BITMAP_LEVEL_MAX);
+		size_t word_count = (bit_count + CORO_BUS_BITMAP_WORD_BITS - 1) /
+			CORO_BUS_BITMAP_WORD_BITS;
+		uint64_t *words = new uint64_t[word_count];
+		memset(words, 0, word_count * sizeof(*words));
+		bitmap->levels[bitmap->level_count++] = words;
+		if (word_count == 1)
+			break;
+		bit_count = word_count;
+	}
+}
+
+static void
+coro_bus_bitmap_destroy(struct coro_bus_bitmap *bitmap)
+{
+	for (int i = 0; i < bitmap->level_count; ++i)
+		delete[] bitmap->levels[i];
+}
+
+static void
+coro_bus_bitmap_set(struct coro_bus_bitmap *bitmap, size_t bit)
+{
+	for (int i = 0; i < bitmap->level_count; ++i) {
+		size_t word_i = bit / CORO_BUS_BITMAP_WORD_BITS;
+		uint64_t *word = &bitmap->levels[i][word_i];
+		bool was_empty = *word == 0;
+		*word |= (uint64_t)1 << (bit % CORO_BUS_BITMAP_WORD_BITS);
+		if (!was_empty)
+			break;
+		bit = word_i;
+	}
+}
+
+static void
+coro_bus_bitmap_clear(struct coro_bus_bitmap *bitmap, size_t bit)
+{
+	for (int i = 0; i < bitmap->level_count; ++i) {
+		size_t word_i = bit / CORO_BUS_BITMAP_WORD_BITS;
+		uint64_t *word = &bitmap->levels[i][word_i];
+		*word &= ~((uint64_t)1 << (bit % CORO_BUS_BITMAP_WORD_BITS));
+		if (*word != 0)
+			break;
+		bit = word_i;
+	}
+}
+
+/** The lowest set bit, or -1 if none. */
+static int
+coro_bus_bitmap_first(const struct coro_bus_bitmap *bitmap)
+{
+	if (bitmap->level_count == 0)
+		return -1;
+	size_t bit = 0;
+	for (int i = bitmap->level_count - 1; i >= 0; --i) {
+		uint64_t word = bitmap->levels[i][bit];
+		if (word == 0)
+			return -1;
+		bit = bit * CORO_BUS_BITMAP_WORD_BITS + __builtin_ctzll(word);
+	}
+	return (int)bit;
+}
+
+/** An array of the channels replaced by a bigger one. */
+struct coro_bus_old_channels {
+	struct coro_bus_old_channels *next;
+	struct coro_bus_channel **channels;
 };
 
 struct coro_bus {
+	/**
+	 * Channels by descriptors, NULL for the free ones. The sends
+	 * and receives read it without locks, so when it grows, the
+	 * old array is kept until the bus is deleted.
+	 */
 	struct coro_bus_channel **channels;
 	int channel_count;
+	/** Size of the channels array. */
+	int channel_capacity;
+	struct coro_bus_old_channels *old_channels;
+	/** Serializes the opening and closing of the channels. */
+	pthread_mutex_t mutex;
+	/** Closed channels to be reused. */
+	struct rlist channels_free;
+	/** Free descriptors of the channels array. */
+	struct coro_bus_bitmap descriptors_free;
 };
 
-static enum coro_bus_error_code global_error = CORO_BUS_ERR_NONE;
+/**
+ * The error is coroutine-local, like errno is thread-local. The
+ * key is created on the first use. The value is the error code
+ * itself, nothing is allocated.
+ */
+static int coro_bus_errno_key = -1;
+
+static int
+coro_bus_errno_key_get(void)
+{
+	int key = __atomic_load_n(&coro_bus_errno_key, __ATOMIC_ACQUIRE);
+	if (key >= 0)
+		return key;
+	static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+	pthread_mutex_lock(&mutex);
+	key = coro_bus_errno_key;
+	if (key < 0) {
+		key = coro_key_create(NULL);
+		assert(key >= 0);
+		__atomic_store_n(&coro_bus_errno_key, key, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&mutex);
+	return key;
+}
 
 enum coro_bus_error_code
 coro_bus_errno(void)
 {
-	return global_error;
+	return (enum coro_bus_error_code)(intptr_t)coro_getspecific(
+		coro_bus_errno_key_get());
 }
 
 void
 coro_bus_errno_set(enum coro_bus_error_code err)
 {
-	global_error = err;
+	coro_setspecific(coro_bus_errno_key_get(), (void *)(intptr_t)err);
+}
+
+static struct coro_bus_channel *
+coro_bus_channel_new(void)
+{
+	struct coro_bus_channel *ch = new struct coro_bus_channel;
+	ch->head = 0;
+	ch->tail_cached = 0;
+	ch->recv_refs = 0;
+	ch->tail = 0;
+	ch->head_cached = 0;
+	ch->send_refs = 0;
+	ch->cells = NULL;
+	ch->mask = 0;
+	ch->msg_size = 0;
+	ch->cell_size = 0;
+	ch->msg_destructor = NULL;
+	ch->size_limit = 0;
+	ch->size_limit_min = 0;
+	ch->size_limit_max = 0;
+	ch->is_spsc = false;
+	ch->is_closed = false;
+	wakeup_queue_create(&ch->send_queue);
+	wakeup_queue_create(&ch->recv_queue);
+	rlist_create(&ch->in_free);
+	return ch;
+}
+
+static inline struct coro_bus_cell *
+coro_bus_channel_cell(struct coro_bus_channel *ch, size_t pos)
+{
+	return (struct coro_bus_cell *)(ch->cells +
+		(pos & ch->mask) * ch->cell_size);
+}
+
+/**
+ * Destroy the messages left in a channel which nobody pins. All
+ * the sends and receives are done, so all the positions between
+ * the head and the tail have messages.
+ */
+static void
+coro_bus_channel_drop(struct coro_bus_channel *ch)
+{
+	if (ch->msg_destructor != NULL) {
+		for (size_t pos = ch->head; pos != ch->tail; ++pos) {
+			struct coro_bus_cell *cell = coro_bus_channel_cell(ch, pos);
+			ch->msg_destructor(coro_bus_cell_data(cell));
+		}
+	}
+	ch->head = ch->tail;
+}
+
+static void
+coro_bus_channel_delete(struct coro_bus_channel *ch)
+{
+	assert(rlist_empty(&ch->send_queue.coros));
+	assert(rlist_empty(&ch->recv_queue.coros));
+	coro_bus_channel_drop(ch);
+	delete[] ch->cells;
+	delete ch;
+}
+
+/** Size of a ring cell for the messages of @a msg_size. */
+static size_t
+coro_bus_cell_size(size_t msg_size)
+{
+	size_t align = alignof(struct coro_bus_cell);
+	return (sizeof(struct coro_bus_cell) + msg_size + align - 1) &
+		~(align - 1);
+}
+
+/**
+ * Number of the ring cells for @a size_limit messages, a power of
+ * 2. In the MPMC mode a cell of one message would look the same
+ * full for one position and free for the next one, so there are
+ * at least 2. Returns 0 if the ring size in bytes doesn't fit into
+ * size_t.
+ */
+static size_t
+coro_bus_ring_capacity(size_t size_limit, size_t cell_size)
+{
+	size_t capacity = 2;
+	while (capacity < size_limit) {
+		if (capacity > SIZE_MAX / 2 / cell_size)
+			return 0;
+		capacity <<= 1;
+	}
+	if (capacity > SIZE_MAX / cell_size)
+		return 0;
+	return capacity;
+}
+
+/**
+ * Make a new or a reused channel empty and open, with the ring of
+ * @a capacity cells allocated by the caller. Nobody pins it, so
+ * the fields don't need atomics. The attributes are checked by the
+ * caller too.
+ */
+static void
+coro_bus_channel_reset(struct coro_bus_channel *ch, size_t size_limit,
+	const struct coro_bus_channel_attr *attr, unsigned char *cells,
+	size_t capacity)
+{
+	ch->size_limit_min = 0;
+	ch->size_limit_max = attr->size_limit_max;
+	if (ch->size_limit_max != 0) {
+		ch->size_limit_min = attr->size_limit_min > 0 ?
+			attr->size_limit_min : 1;
+		assert(ch->size_limit_min <= ch->size_limit_max);
+		if (size_limit < ch->size_limit_min)
+			size_limit = ch->size_limit_min;
+		else if (size_limit > ch->size_limit_max)
+			size_limit = ch->size_limit_max;
+	}
+	delete[] ch->cells;
+	ch->cells = cells;
+	ch->mask = capacity - 1;
+	ch->cell_size = coro_bus_cell_size(attr->msg_size);
+	for (size_t i = 0; i < capacity; ++i)
+		coro_bus_channel_cell(ch, i)->seq = i;
+	ch->head = 0;
+	ch->tail_cached = 0;
+	ch->tail = 0;
+	ch->head_cached = 0;
+	ch->msg_size = attr->msg_size;
+	ch->msg_destructor = attr->msg_destructor;
+	ch->size_limit = size_limit;
+	ch->is_spsc = attr->mode == CORO_BUS_CHANNEL_SPSC;
+	ch->is_closed = false;
+	ch->peak_size = 0;
+	ch->window_peak_size = 0;
+	ch->send_wait_ns = 0;
+	ch->recv_wait_ns = 0;
+}
+
+static inline size_t
+coro_bus_channel_size_limit(struct coro_bus_channel *ch)
+{
+	return __atomic_load_n(&ch->size_limit, __ATOMIC_RELAXED);
+}
+
+/** Free space for @a used messages. The limit can be below it. */
+static inline size_t
+coro_bus_space(size_t size_limit, size_t used)
+{
+	return used < size_limit ? size_limit - used : 0;
+}
+
+static inline void
+coro_bus_atomic_max(size_t *value, size_t candidate)
+{
+	size_t old = __atomic_load_n(value, __ATOMIC_RELAXED);
+	while (candidate > old && !__atomic_compare_exchange_n(value, &old,
+			candidate, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+/** Account the number of messages seen in the channel. */
+static inline void
+coro_bus_channel_sample_size(struct coro_bus_channel *ch, size_t size)
+{
+	coro_bus_atomic_max(&ch->window_peak_size, size);
+}
+
+/**
+ * A sender found the channel full. In the adaptive mode the limit
+ * is doubled, up to the max. Returns true if it grew.
+ */
+static bool
+coro_bus_channel_grow(struct coro_bus_channel *ch)
+{
+	if (ch->size_limit_max == 0)
+		return false;
+	size_t limit = coro_bus_channel_size_limit(ch);
+	while (limit < ch->size_limit_max) {
+		size_t new_limit = limit * 2;
+		if (new_limit > ch->size_limit_max)
+			new_limit = ch->size_limit_max;
+		if (__atomic_compare_exchange_n(&ch->size_limit, &limit,
+				new_limit, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			return true;
+	}
+	return false;
+}
+
+/**
+ * A receiver found the channel empty. In the adaptive mode the
+ * limit is halved, down to the min, if the channel used not more
+ * than a quarter of it since the last check.
+ */
+static void
+coro_bus_channel_shrink(struct coro_bus_channel *ch)
+{
+	if (ch->size_limit_max == 0)
+		return;
+	size_t peak = __atomic_exchange_n(&ch->window_peak_size, 0,
+		__ATOMIC_RELAXED);
+	coro_bus_atomic_max(&ch->peak_size, peak);
+	size_t limit = coro_bus_channel_size_limit(ch);
+	if (peak > limit / 4 || limit <= ch->size_limit_min)
+		return;
+	size_t new_limit = limit / 2;
+	if (new_limit < ch->size_limit_min)
+		new_limit = ch->size_limit_min;
+	/* A concurrent change wins. */
+	__atomic_compare_exchange_n(&ch->size_limit, &limit, new_limit, false,
+		__ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+
+static uint64_t
+coro_bus_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static inline size_t *
+coro_bus_channel_refs(struct coro_bus_channel *ch, bool is_send)
+{
+	return is_send ? &ch->send_refs : &ch->recv_refs;
+}
+
+static inline bool
+coro_bus_channel_is_closed(struct coro_bus_channel *ch)
+{
+	return __atomic_load_n(&ch->is_closed, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * The channel can't take more messages. The head is loaded after
+ * the tail, so a concurrent receive can make it look not full
+ * when it is, but never the other way round.
+ */
+static bool
+coro_bus_channel_is_full(struct coro_bus_channel *ch)
+{
+	size_t tail = __atomic_load_n(&ch->tail, __ATOMIC_SEQ_CST);
+	size_t head = __atomic_load_n(&ch->head, __ATOMIC_SEQ_CST);
+	return (intptr_t)(tail - head) >=
+		(intptr_t)coro_bus_channel_size_limit(ch);
+}
+
+/**
+ * The channel has no messages. The tail is loaded after the head,
+ * so a concurrent send can make it look not empty when it is, but
+ * never the other way round.
+ */
+static bool
+coro_bus_channel_is_empty(struct coro_bus_channel *ch)
+{
+	size_t head = __atomic_load_n(&ch->head, __ATOMIC_SEQ_CST);
+	size_t tail = __atomic_load_n(&ch->tail, __ATOMIC_SEQ_CST);
+	return tail == head;
+}
+
+/**
+ * Only one sender at a time, so the tail is moved with a plain
+ * store. The head is loaded only when the cached one says that the
+ * messages don't fit.
+ */
+static unsigned
+coro_bus_channel_push_spsc(struct coro_bus_channel *ch, const void *data,
+	unsigned count)
+{
+	size_t limit = coro_bus_channel_size_limit(ch);
+	size_t tail = __atomic_load_n(&ch->tail, __ATOMIC_RELAXED);
+	size_t space = coro_bus_space(limit, tail - ch->head_cached);
+	if (space < count) {
+		ch->head_cached = __atomic_load_n(&ch->head, __ATOMIC_ACQUIRE);
+		coro_bus_channel_sample_size(ch, tail - ch->head_cached);
+		space = coro_bus_space(limit, tail - ch->head_cached);
+		if (space < count)
+			count = space;
+		if (count == 0)
+			return 0;
+	}
+	const unsigned char *src = (const unsigned char *)data;
+	for (unsigned i = 0; i < count; ++i, src += ch->msg_size) {
+		struct coro_bus_cell *cell = coro_bus_channel_cell(ch, tail + i);
+		coro_bus_msg_copy(coro_bus_cell_data(cell), src, ch->msg_size);
+	}
+	__atomic_store_n(&ch->tail, tail + count, __ATOMIC_RELEASE);
+	return count;
+}
+
+static unsigned
+coro_bus_channel_pop_spsc(struct coro_bus_channel *ch, void *data,
+	unsigned capacity)
+{
+	size_t head = __atomic_load_n(&ch->head, __ATOMIC_RELAXED);
+	size_t count = ch->tail_cached - head;
+	if (count < capacity) {
+		ch->tail_cached = __atomic_load_n(&ch->tail, __ATOMIC_ACQUIRE);
+		count = ch->tail_cached - head;
+		coro_bus_channel_sample_size(ch, count);
+		if (count == 0)
+			return 0;
+	}
+	if (count > capacity)
+		count = capacity;
+	unsigned char *dst = (unsigned char *)data;
+	for (size_t i = 0; i < count; ++i, dst += ch->msg_size) {
+		struct coro_bus_cell *cell = coro_bus_channel_cell(ch, head + i);
+		coro_bus_msg_copy(dst, coro_bus_cell_data(cell), ch->msg_size);
+	}
+	__atomic_store_n(&ch->head, head + count, __ATOMIC_RELEASE);
+	return count;
+}
+
+/**
+ * The senders compete for the tail, and each claims a range of the
+ * free cells with a compare-and-swap. Then fills them and passes
+ * them to the receivers one by one via the sequence numbers.
+ */
+static unsigned
+coro_bus_channel_push_mpmc(struct coro_bus_channel *ch, const void *data,
+	unsigned count)
+{
+	size_t tail = __atomic_load_n(&ch->tail, __ATOMIC_RELAXED);
+	while (true) {
+		size_t limit = coro_bus_channel_size_limit(ch);
+		size_t head = __atomic_load_n(&ch->head, __ATOMIC_ACQUIRE);
+		intptr_t used = (intptr_t)(tail - head);
+		if (used >= (intptr_t)limit)
+			return 0;
+		/* The tail is stale if behind the head. */
+		size_t space = limit - (used > 0 ? used : 0);
+		size_t ready = 0;
+		while (ready < count && ready < space) {
+			size_t pos = tail + ready;
+			struct coro_bus_cell *cell = coro_bus_channel_cell(ch, pos);
+			if (__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) != pos)
+				break;
+			++ready;
+		}
+		if (ready == 0) {
+			struct coro_bus_cell *cell = coro_bus_channel_cell(ch, tail);
+			size_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+			/* Not received yet by a receiver of the last lap. */
+			if ((intptr_t)(seq - tail) < 0)
+				return 0;
+			tail = __atomic_load_n(&ch->tail, __ATOMIC_RELAXED);
+			continue;
+		}
+		if (!__atomic_compare_exchange_n(&ch->tail, &tail, tail + ready,
+				false, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			continue;
+		const unsigned char *src = (const unsigned char *)data;
+		for (size_t i = 0; i < ready; ++i, src += ch->msg_size) {
+			size_t pos = tail + i;
+			struct coro_bus_cell *cell = coro_bus_channel_cell(ch, pos);
+			coro_bus_msg_copy(coro_bus_cell_data(cell), src,
+				ch->msg_size);
+			__atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+		}
+		coro_bus_channel_sample_size(ch, tail + ready - head);
+		return ready;
+	}
+}
+
+static unsigned
+coro_bus_channel_pop_mpmc(struct coro_bus_channel *ch, void *data,
+	unsigned capacity)
+{
+	size_t head = __atomic_load_n(&ch->head, __ATOMIC_RELAXED);
+	while (true) {
+		size_t ready = 0;
+		while (ready < capacity) {
+			size_t pos = head + ready;
+			struct coro_bus_cell *cell = coro_bus_channel_cell(ch, pos);
+			if (__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) != pos + 1)
+				break;
+			++ready;
+		}
+		if (ready == 0) {
+			struct coro_bus_cell *cell = coro_bus_channel_cell(ch, head);
+			size_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+			/* Not sent yet. */
+			if ((intptr_t)(seq - (head + 1)) < 0)
+				return 0;
+			head = __atomic_load_n(&ch->head, __ATOMIC_RELAXED);
+			continue;
+		}
+		if (!__atomic_compare_exchange_n(&ch->head, &head, head + ready,
+				false, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			continue;
+		unsigned char *dst = (unsigned char *)data;
+		for (size_t i = 0; i < ready; ++i, dst += ch->msg_size) {
+			size_t pos = head + i;
+			struct coro_bus_cell *cell = coro_bus_channel_cell(ch, pos);
+			coro_bus_msg_copy(dst, coro_bus_cell_data(cell),
+				ch->msg_size);
+			__atomic_store_n(&cell->seq, pos + ch->mask + 1,
+				__ATOMIC_RELEASE);
+		}
+		return ready;
+	}
+}
+
+/** Send as many of the messages as fit. Returns how many. */
+static unsigned
+coro_bus_channel_push(struct coro_bus_channel *ch, const void *data,
+	unsigned count)
+{
+	if (ch->is_spsc)
+		return coro_bus_channel_push_spsc(ch, data, count);
+	return coro_bus_channel_push_mpmc(ch, data, count);
+}
+
+/** Receive as many messages as there are. Returns how many. */
+static unsigned
+coro_bus_channel_pop(struct coro_bus_channel *ch, void *data,
+	unsigned capacity)
+{
+	if (ch->is_spsc)
+		return coro_bus_channel_pop_spsc(ch, data, capacity);
+	return coro_bus_channel_pop_mpmc(ch, data, capacity);
+}
+
+/**
+ * Wake up the ones who can proceed after a send: a receiver, and
+ * the next sender if there is still space. So when the waiters
+ * can make progress, they wake each other up one by one. The
+ * fence pairs with the one in wakeup_queue_add().
+ */
+static void
+coro_bus_channel_notify_send(struct coro_bus_channel *ch)
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	wakeup_queue_wakeup_first(&ch->recv_queue);
+	if (__atomic_load_n(&ch->send_queue.count, __ATOMIC_RELAXED) > 0 &&
+	    !coro_bus_channel_is_full(ch))
+		wakeup_queue_wakeup_first(&ch->send_queue);
+}
+
+/** Same as coro_bus_channel_notify_send(), but after a receive. */
+static void
+coro_bus_channel_notify_recv(struct coro_bus_channel *ch)
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	wakeup_queue_wakeup_first(&ch->send_queue);
+	if (__atomic_load_n(&ch->recv_queue.count, __ATOMIC_RELAXED) > 0 &&
+	    !coro_bus_channel_is_empty(ch))
+		wakeup_queue_wakeup_first(&ch->recv_queue);
+}
+
+/**
+ * Pass a wakeup on to the next waiter in the queue if the channel
+ * is ready for it. A waiter which leaves the queue without doing
+ * its operation, like on a timeout, could have taken the wakeup
+ * meant for the next one.
+ */
+static void
+coro_bus_channel_pass_wakeup(struct coro_bus_channel *ch, bool is_send)
+{
+	struct wakeup_queue *queue = is_send ? &ch->send_queue :
+		&ch->recv_queue;
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&queue->count, __ATOMIC_RELAXED) == 0 ||
+	    coro_bus_channel_is_closed(ch))
+		return;
+	bool is_ready = is_send ? !coro_bus_channel_is_full(ch) :
+		!coro_bus_channel_is_empty(ch);
+	if (is_ready)
+		wakeup_queue_wakeup_first(queue);
+}
+
+/** Deadline of the waits which never time out. */
+static const uint64_t coro_bus_no_deadline = UINT64_MAX;
+/** Deadline of the operations which don't wait at all. */
+static const uint64_t coro_bus_no_wait = 0;
+
+/**
+ * Deadline of a wait for @a timeout seconds. Like in libcoro, a
+ * negative or a huge timeout means infinity.
+ */
+static uint64_t
+coro_bus_deadline(double timeout)
+{
+	if (timeout < 0 || timeout >= 1e9)
+		return coro_bus_no_deadline;
+	return coro_bus_now_ns() + (uint64_t)(timeout * 1e9);
+}
+
+/**
+ * Suspend the current coroutine until a wakeup or @a deadline.
+ * Returns false if the deadline has passed already.
+ */
+static bool
+coro_bus_suspend(const char *what, const void *object, uint64_t deadline)
+{
+	if (deadline == coro_bus_no_deadline) {
+		coro_suspend_on(what, object);
+		return true;
+	}
+	uint64_t now = coro_bus_now_ns();
+	if (now >= deadline)
+		return false;
+	coro_suspend_timeout_on((double)(deadline - now) / 1e9, what, object);
+	return true;
+}
+
+/**
+ * Wait in the send queue until the messages fit, or @a deadline.
+ * Returns how many were sent, or 0 if the channel is closed or the
+ * time is out. The waiter stays in the queue while retries, and a
+ * spurious wakeup is just one more retry. The wait isn't
+ * interrupted by coro_cancel(), the bus has no error for that.
+ */
+static unsigned
+coro_bus_channel_wait_push(struct coro_bus_channel *ch, const void *data,
+	unsigned count, uint64_t deadline)
+{
+	uint64_t start_ns = coro_bus_now_ns();
+	struct wakeup_entry entry;
+	wakeup_queue_add(&ch->send_queue, &entry);
+	bool is_cancellable = coro_set_cancellable(false);
+	unsigned sent = 0;
+	while (!coro_bus_channel_is_closed(ch)) {
+		sent = coro_bus_channel_push(ch, data, count);
+		if (sent > 0 || !coro_bus_suspend("bus send", ch, deadline))
+			break;
+	}
+	coro_set_cancellable(is_cancellable);
+	wakeup_queue_del(&ch->send_queue, &entry);
+	__atomic_add_fetch(&ch->send_wait_ns, coro_bus_now_ns() - start_ns,
+		__ATOMIC_RELAXED);
+	if (sent == 0)
+		coro_bus_channel_pass_wakeup(ch, true);
+	return sent;
+}
+
+/** Same as coro_bus_channel_wait_push(), but for a receive. */
+static unsigned
+coro_bus_channel_wait_pop(struct coro_bus_channel *ch, void *data,
+	unsigned capacity, uint64_t deadline)
+{
+	uint64_t start_ns = coro_bus_now_ns();
+	struct wakeup_entry entry;
+	wakeup_queue_add(&ch->recv_queue, &entry);
+	bool is_cancellable = coro_set_cancellable(false);
+	unsigned received = 0;
+	while (!coro_bus_channel_is_closed(ch)) {
+		received = coro_bus_channel_pop(ch, data, capacity);
+		if (received > 0 || !coro_bus_suspend("bus recv", ch, deadline))
+			break;
+	}
+	coro_set_cancellable(is_cancellable);
+	wakeup_queue_del(&ch->recv_queue, &entry);
+	__atomic_add_fetch(&ch->recv_wait_ns, coro_bus_now_ns() - start_ns,
+		__ATOMIC_RELAXED);
+	if (received == 0)
+		coro_bus_channel_pass_wakeup(ch, false);
+	return received;
+}
+
+/**
+ * Wait in the send queue until the channel is not full, or is
+ * closed. Nothing is sent, so the wakeup is passed to the next
+ * sender if there is space.
+ */
+static void
+coro_bus_channel_wait_space(struct coro_bus_channel *ch)
+{
+	uint64_t start_ns = coro_bus_now_ns();
+	struct wakeup_entry entry;
+	wakeup_queue_add(&ch->send_queue, &entry);
+	bool is_cancellable = coro_set_cancellable(false);
+	while (!coro_bus_channel_is_closed(ch) && coro_bus_channel_is_full(ch))
+		coro_suspend_on("bus send", ch);
+	coro_set_cancellable(is_cancellable);
+	wakeup_queue_del(&ch->send_queue, &entry);
+	__atomic_add_fetch(&ch->send_wait_ns, coro_bus_now_ns() - start_ns,
+		__ATOMIC_RELAXED);
+	if (coro_bus_channel_is_closed(ch))
+		return;
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (!coro_bus_channel_is_full(ch))
+		wakeup_queue_wakeup_first(&ch->send_queue);
+}
+
+////////////////////////////////////////////////////////////////////
+
+/**
+ * Find a channel by its descriptor. The count is loaded before the
+ * array, and the array is published before the count grows, so
+ * the descriptor is always within the loaded array.
+ */
+static struct coro_bus_channel *
+coro_bus_channel_find(struct coro_bus *bus, int channel)
+{
+	if (channel < 0 ||
+	    channel >= __atomic_load_n(&bus->channel_count, __ATOMIC_SEQ_CST))
+		return NULL;
+	struct coro_bus_channel **channels = __atomic_load_n(&bus->channels,
+		__ATOMIC_SEQ_CST);
+	return __atomic_load_n(&channels[channel], __ATOMIC_SEQ_CST);
+}
+
+/**
+ * Find a channel and pin it for a send or a receive. The found
+ * channel can be closed and even reused right away, so after the
+ * pin it is checked to be still there. If it is, it can't be
+ * reused until unpinned. The closing clears the descriptor before
+ * checking the pins, so either the closing sees the pin, or the
+ * check sees the channel gone.
+ */
+static struct coro_bus_channel *
+coro_bus_channel_pin(struct coro_bus *bus, int channel, bool is_send)
+{
+	struct coro_bus_channel *ch = coro_bus_channel_find(bus, channel);
+	while (ch != NULL) {
+		size_t *refs = coro_bus_channel_refs(ch, is_send);
+		__atomic_add_fetch(refs, 1, __ATOMIC_SEQ_CST);
+		struct coro_bus_channel *now = coro_bus_channel_find(bus, channel);
+		if (now == ch)
+			return ch;
+		__atomic_sub_fetch(refs, 1, __ATOMIC_RELEASE);
+		ch = now;
+	}
+	return NULL;
+}
+
+static inline void
+coro_bus_channel_unpin(struct coro_bus_channel *ch, bool is_send)
+{
+	__atomic_sub_fetch(coro_bus_channel_refs(ch, is_send), 1,
+		__ATOMIC_RELEASE);
+}
+
+/** Take a closed channel which nobody pins anymore. */
+static struct coro_bus_channel *
+coro_bus_channel_take_free(struct coro_bus *bus)
+{
+	struct coro_bus_channel *ch;
+	rlist_foreach_entry(ch, &bus->channels_free, in_free) {
+		if (__atomic_load_n(&ch->send_refs, __ATOMIC_SEQ_CST) == 0 &&
+		    __atomic_load_n(&ch->recv_refs, __ATOMIC_SEQ_CST) == 0) {
+			rlist_del_entry(ch, in_free);
+			coro_bus_channel_drop(ch);
+			return ch;
+		}
+	}
+	return NULL;
+}
+
+/** Make the channels array twice bigger. The mutex must be held. */
+static void
+coro_bus_grow(struct coro_bus *bus)
+{
+	int capacity = bus->channel_capacity == 0 ?
+		4 : bus->channel_capacity * 2;
+	struct coro_bus_channel **channels =
+		new struct coro_bus_channel *[capacity];
+	for (int i = 0; i < capacity; ++i)
+		channels[i] = i < bus->channel_count ? bus->channels[i] : NULL;
+	if (bus->channels != NULL) {
+		struct coro_bus_old_channels *old =
+			new struct coro_bus_old_channels;
+		old->channels = bus->channels;
+		old->next = bus->old_channels;
+		bus->old_channels = old;
+	}
+	__atomic_store_n(&bus->channels, channels, __ATOMIC_SEQ_CST);
+	bus->channel_capacity = capacity;
+	coro_bus_bitmap_destroy(&bus->descriptors_free);
+	coro_bus_bitmap_create(&bus->descriptors_free, capacity);
+	for (int i = 0; i < capacity; ++i) {
+		if (channels[i] == NULL)
+			coro_bus_bitmap_set(&bus->descriptors_free, i);
+	}
 }
 
 struct coro_bus *
 coro_bus_new(void)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	coro_bus_errno_set(CORO_BUS_ERR_NOT_IMPLEMENTED);
-	return NULL;
+	struct coro_bus *bus = new struct coro_bus;
+	bus->channels = NULL;
+	bus->channel_count = 0;
+	bus->channel_capacity = 0;
+	bus->old_channels = NULL;
+	pthread_mutex_init(&bus->mutex, NULL);
+	rlist_create(&bus->channels_free);
+	coro_bus_bitmap_create(&bus->descriptors_free, 0);
+	return bus;
 }
 
 void
 coro_bus_delete(struct coro_bus *bus)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	(void)bus;
+	for (int i = 0; i < bus->channel_count; ++i) {
+		if (bus->channels[i] != NULL)
+			coro_bus_channel_delete(bus->channels[i]);
+	}
+	while (!rlist_empty(&bus->channels_free)) {
+		struct coro_bus_channel *ch = rlist_shift_entry(
+			&bus->channels_free, struct coro_bus_channel, in_free);
+		coro_bus_channel_delete(ch);
+	}
+	while (bus->old_channels != NULL) {
+		struct coro_bus_old_channels *old = bus->old_channels;
+		bus->old_channels = old->next;
+		delete[] old->channels;
+		delete old;
+	}
+	delete[] bus->channels;
+	coro_bus_bitmap_destroy(&bus->descriptors_free);
+	pthread_mutex_destroy(&bus->mutex);
+	delete bus;
+}
+
+void
+coro_bus_channel_attr_create(struct coro_bus_channel_attr *attr)
+{
+	attr->mode = CORO_BUS_CHANNEL_MPMC;
+	attr->msg_size = sizeof(unsigned);
+	attr->msg_destructor = NULL;
+	attr->size_limit_min = 0;
+	attr->size_limit_max = 0;
 }
 
 int
 coro_bus_channel_open(struct coro_bus *bus, size_t size_limit)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	(void)bus;
-	(void)size_limit;
-	coro_bus_errno_set(CORO_BUS_ERR_NOT_IMPLEMENTED);
+	return coro_bus_channel_open_ex(bus, size_limit, NULL);
+}
+
+int
+coro_bus_channel_open_ex(struct coro_bus *bus, size_t size_limit,
+	const struct coro_bus_channel_attr *attr)
+{
+	struct coro_bus_channel_attr default_attr;
+	if (attr == NULL) {
+		coro_bus_channel_attr_create(&default_attr);
+		attr = &default_attr;
+	}
+	if (attr->msg_size == 0 || attr->msg_size > CORO_BUS_MSG_SIZE_MAX) {
+		coro_bus_errno_set(CORO_BUS_ERR_MSG_SIZE);
+		return -1;
+	}
+	/* In the adaptive mode the ring is for the max limit. */
+	size_t ring_limit = size_limit;
+	if (attr->size_limit_max != 0) {
+		ring_limit = attr->size_limit_max;
+		if (attr->size_limit_min > attr->size_limit_max) {
+			coro_bus_errno_set(CORO_BUS_ERR_SIZE_LIMIT);
+			return -1;
+		}
+	}
 	/*
-	 * One of the tests will force you to reuse the channel
-	 * descriptors. It means, that if your maximal channel
-	 * descriptor is N, and you have any free descriptor in
-	 * the range 0-N, then you should open the new channel on
-	 * that old descriptor.
-	 *
-	 * A more precise instruction - check if any of the
-	 * bus->channels[i] with i = 0 -> bus->channel_count is
-	 * free (== NULL). If yes - reuse the slot. Don't grow the
-	 * bus->channels array, when have space in it.
+	 * The ring can be huge, so it is allocated out of the lock,
+	 * and the failure is reported instead of an exception.
 	 */
-	return -1;
+	size_t cell_size = coro_bus_cell_size(attr->msg_size);
+	size_t capacity = coro_bus_ring_capacity(ring_limit, cell_size);
+	unsigned char *cells = NULL;
+	if (capacity > 0)
+		cells = new (std::nothrow) unsigned char[capacity * cell_size];
+	if (cells == NULL) {
+		coro_bus_errno_set(CORO_BUS_ERR_SIZE_LIMIT);
+		return -1;
+	}
+	pthread_mutex_lock(&bus->mutex);
+	/* The lowest free descriptor is reused. */
+	int channel = coro_bus_bitmap_first(&bus->descriptors_free);
+	if (channel < 0) {
+		coro_bus_grow(bus);
+		channel = coro_bus_bitmap_first(&bus->descriptors_free);
+	}
+	coro_bus_bitmap_clear(&bus->descriptors_free, channel);
+	struct coro_bus_channel *ch = coro_bus_channel_take_free(bus);
+	if (ch == NULL)
+		ch = coro_bus_channel_new();
+	coro_bus_channel_reset(ch, size_limit, attr, cells, capacity);
+	__atomic_store_n(&bus->channels[channel], ch, __ATOMIC_SEQ_CST);
+	if (channel == bus->channel_count)
+		__atomic_store_n(&bus->channel_count, channel + 1,
+			__ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&bus->mutex);
+	return channel;
 }
 
 void
 coro_bus_channel_close(struct coro_bus *bus, int channel)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	(void)bus;
-	(void)channel;
+	pthread_mutex_lock(&bus->mutex);
+	struct coro_bus_channel *ch = NULL;
+	if (channel >= 0 && channel < bus->channel_count)
+		ch = bus->channels[channel];
+	if (ch == NULL) {
+		pthread_mutex_unlock(&bus->mutex);
+		return;
+	}
+	__atomic_store_n(&bus->channels[channel], NULL, __ATOMIC_SEQ_CST);
+	coro_bus_bitmap_set(&bus->descriptors_free, channel);
+	__atomic_store_n(&ch->is_closed, true, __ATOMIC_SEQ_CST);
 	/*
-	 * Be very attentive here. What happens, if the channel is
-	 * closed while there are coroutines waiting on it? For
-	 * example, the channel was empty, and some coros were
-	 * waiting on its recv_queue.
-	 *
-	 * If you wakeup those coroutines and just delete the
-	 * channel right away, then those waiting coroutines might
-	 * on wakeup try to reference invalid memory.
-	 *
-	 * Can happen, for example, if you use an intrusive list
-	 * (rlist), delete the list itself (by deleting the
-	 * channel), and then the coroutines on wakeup would try
-	 * to remove themselves from the already destroyed list.
-	 *
-	 * Think how you could address that. Remove all the
-	 * waiters from the list before freeing it? Yield this
-	 * coroutine after waking up the waiters but before
-	 * freeing the channel, so the waiters could safely leave?
+	 * The waiters leave the queues themselves. Until then they
+	 * pin the channel, so it isn't reused under them. The
+	 * pending messages are dropped right away if nobody uses
+	 * them, otherwise when the channel is reused or deleted.
 	 */
+	wakeup_queue_wakeup_all(&ch->send_queue);
+	wakeup_queue_wakeup_all(&ch->recv_queue);
+	if (__atomic_load_n(&ch->send_refs, __ATOMIC_SEQ_CST) == 0 &&
+	    __atomic_load_n(&ch->recv_refs, __ATOMIC_SEQ_CST) == 0)
+		coro_bus_channel_drop(ch);
+	rlist_add_tail_entry(&bus->channels_free, ch, in_free);
+	pthread_mutex_unlock(&bus->mutex);
+}
+
+int
+coro_bus_channel_stats(struct coro_bus *bus, int channel,
+	struct coro_bus_channel_stats *stats)
+{
+	struct coro_bus_channel *ch = coro_bus_channel_pin(bus, channel, false);
+	if (ch == NULL) {
+		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+		return -1;
+	}
+	stats->recv_count = __atomic_load_n(&ch->head, __ATOMIC_RELAXED);
+	stats->send_count = __atomic_load_n(&ch->tail, __ATOMIC_RELAXED);
+	stats->send_wait_ns = __atomic_load_n(&ch->send_wait_ns,
+		__ATOMIC_RELAXED);
+	stats->recv_wait_ns = __atomic_load_n(&ch->recv_wait_ns,
+		__ATOMIC_RELAXED);
+	size_t peak = __atomic_load_n(&ch->peak_size, __ATOMIC_RELAXED);
+	size_t window_peak = __atomic_load_n(&ch->window_peak_size,
+		__ATOMIC_RELAXED);
+	stats->peak_size = peak > window_peak ? peak : window_peak;
+	stats->size_limit = coro_bus_channel_size_limit(ch);
+	coro_bus_channel_unpin(ch, false);
+	return 0;
+}
+
+/**
+ * Pin a channel for an operation with the messages of @a msg_size,
+ * or of any size if it is 0. NULL with the error set if can't.
+ */
+static struct coro_bus_channel *
+coro_bus_channel_pin_msg(struct coro_bus *bus, int channel, bool is_send,
+	size_t msg_size)
+{
+	struct coro_bus_channel *ch = coro_bus_channel_pin(bus, channel,
+		is_send);
+	if (ch == NULL) {
+		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+		return NULL;
+	}
+	if (msg_size != 0 && ch->msg_size != msg_size) {
+		coro_bus_channel_unpin(ch, is_send);
+		coro_bus_errno_set(CORO_BUS_ERR_MSG_SIZE);
+		return NULL;
+	}
+	return ch;
+}
+
+/**
+ * Send the messages, as many as fit. Returns how many were sent,
+ * or -1 with the error set. When nothing fits, waits for space
+ * until @a deadline. The messages are of @a msg_size, 0 means the
+ * channel's size.
+ */
+static int
+coro_bus_send_impl(struct coro_bus *bus, int channel, const void *data,
+	unsigned count, size_t msg_size, uint64_t deadline)
+{
+	struct coro_bus_channel *ch = coro_bus_channel_pin_msg(bus, channel,
+		true, msg_size);
+	if (ch == NULL)
+		return -1;
+	unsigned sent = 0;
+	if (count > 0 && !coro_bus_channel_is_closed(ch)) {
+		sent = coro_bus_channel_push(ch, data, count);
+		if (sent == 0 && coro_bus_channel_grow(ch))
+			sent = coro_bus_channel_push(ch, data, count);
+	}
+	if (sent == 0 && count > 0) {
+		if (deadline == coro_bus_no_wait) {
+			/* Unpinned, the channel can be reused right away. */
+			bool is_closed = coro_bus_channel_is_closed(ch);
+			coro_bus_channel_unpin(ch, true);
+			coro_bus_errno_set(is_closed ? CORO_BUS_ERR_NO_CHANNEL :
+				CORO_BUS_ERR_WOULD_BLOCK);
+			return -1;
+		}
+		sent = coro_bus_channel_wait_push(ch, data, count, deadline);
+		if (sent == 0) {
+			bool is_closed = coro_bus_channel_is_closed(ch);
+			coro_bus_channel_unpin(ch, true);
+			coro_bus_errno_set(is_closed ? CORO_BUS_ERR_NO_CHANNEL :
+				CORO_BUS_ERR_TIMEOUT);
+			return -1;
+		}
+	}
+	coro_bus_channel_notify_send(ch);
+	coro_bus_channel_unpin(ch, true);
+	return sent;
+}
+
+/** Same as coro_bus_send_impl(), but for receiving. */
+static int
+coro_bus_recv_impl(struct coro_bus *bus, int channel, void *data,
+	unsigned capacity, size_t msg_size, uint64_t deadline)
+{
+	struct coro_bus_channel *ch = coro_bus_channel_pin_msg(bus, channel,
+		false, msg_size);
+	if (ch == NULL)
+		return -1;
+	unsigned received = 0;
+	if (capacity > 0 && !coro_bus_channel_is_closed(ch)) {
+		received = coro_bus_channel_pop(ch, data, capacity);
+		if (received == 0)
+			coro_bus_channel_shrink(ch);
+	}
+	if (received == 0 && capacity > 0) {
+		if (deadline == coro_bus_no_wait) {
+			/* Unpinned, the channel can be reused right away. */
+			bool is_closed = coro_bus_channel_is_closed(ch);
+			coro_bus_channel_unpin(ch, false);
+			coro_bus_errno_set(is_closed ? CORO_BUS_ERR_NO_CHANNEL :
+				CORO_BUS_ERR_WOULD_BLOCK);
+			return -1;
+		}
+		received = coro_bus_channel_wait_pop(ch, data, capacity, deadline);
+		if (received == 0) {
+			bool is_closed = coro_bus_channel_is_closed(ch);
+			coro_bus_channel_unpin(ch, false);
+			coro_bus_errno_set(is_closed ? CORO_BUS_ERR_NO_CHANNEL :
+				CORO_BUS_ERR_TIMEOUT);
+			return -1;
+		}
+	}
+	coro_bus_channel_notify_recv(ch);
+	coro_bus_channel_unpin(ch, false);
+	return received;
 }
 
 int
 coro_bus_send(struct coro_bus *bus, int channel, unsigned data)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	(void)bus;
-	(void)channel;
-	(void)data;
-	/*
-	 * Try sending in a loop, until success. If error, then
-	 * check which one is that. If 'wouldblock', then suspend
-	 * this coroutine and try again when woken up.
-	 *
-	 * If see the channel has space, then wakeup the first
-	 * coro in the send-queue. That is needed so when there is
-	 * enough space for many messages, and many coroutines are
-	 * waiting, they would then wake each other up one by one
-	 * as lone as there is still space.
-	 */
-	coro_bus_errno_set(CORO_BUS_ERR_NOT_IMPLEMENTED);
-	return -1;
+	return coro_bus_send_impl(bus, channel, &data, 1, sizeof(data),
+		coro_bus_no_deadline) < 0 ? -1 : 0;
 }
 
 int
 coro_bus_try_send(struct coro_bus *bus, int channel, unsigned data)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	(void)bus;
-	(void)channel;
-	(void)data;
-	/*
-	 * Append data if has space. Otherwise 'wouldblock' error.
-	 * Wakeup the first coro in the recv-queue! To let it know
-	 * there is data.
-	 */
-	coro_bus_errno_set(CORO_BUS_ERR_NOT_IMPLEMENTED);
-	return -1;
+	return coro_bus_send_impl(bus, channel, &data, 1, sizeof(data),
+		coro_bus_no_wait) < 0 ? -1 : 0;
 }
 
 int
 coro_bus_recv(struct coro_bus *bus, int channel, unsigned *data)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	(void)bus;
-	(void)channel;
-	(void)data;
-	coro_bus_errno_set(CORO_BUS_ERR_NOT_IMPLEMENTED);
-	return -1;
+	return coro_bus_recv_impl(bus, channel, data, 1, sizeof(*data),
+		coro_bus_no_deadline) < 0 ? -1 : 0;
 }
 
 int
 coro_bus_try_recv(struct coro_bus *bus, int channel, unsigned *data)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	(void)bus;
-	(void)channel;
-	(void)data;
-	coro_bus_errno_set(CORO_BUS_ERR_NOT_IMPLEMENTED);
-	return -1;
+	return coro_bus_recv_impl(bus, channel, data, 1, sizeof(*data),
+		coro_bus_no_wait) < 0 ? -1 : 0;
 }
 
 
 #if NEED_BROADCAST
 
+/**
+ * Find the first full channel, pinned for a send. NULL if there
+ * are none. @a open_count is how many open channels of unsigned
+ * messages are seen.
+ */
+static struct coro_bus_channel *
+coro_bus_find_full(struct coro_bus *bus, int *open_count)
+{
+	*open_count = 0;
+	int count = __atomic_load_n(&bus->channel_count, __ATOMIC_ACQUIRE);
+	for (int i = 0; i < count; ++i) {
+		struct coro_bus_channel *ch = coro_bus_channel_pin(bus, i, true);
+		if (ch == NULL)
+			continue;
+		if (ch->msg_size != sizeof(unsigned)) {
+			coro_bus_channel_unpin(ch, true);
+			continue;
+		}
+		++*open_count;
+		if (coro_bus_channel_is_full(ch))
+			return ch;
+		coro_bus_channel_unpin(ch, true);
+	}
+	return NULL;
+}
+
+/**
+ * Send the message to all the open channels. A channel could get
+ * full after the check by a sender in another thread. Then it is
+ * waited for if @a is_blocking, and skipped otherwise. Returns
+ * false if any were skipped.
+ */
+static bool
+coro_bus_broadcast_push(struct coro_bus *bus, unsigned data, bool is_blocking)
+{
+	bool ok = true;
+	int count = __atomic_load_n(&bus->channel_count, __ATOMIC_ACQUIRE);
+	for (int i = 0; i < count; ++i) {
+		struct coro_bus_channel *ch = coro_bus_channel_pin(bus, i, true);
+		if (ch == NULL)
+			continue;
+		if (ch->msg_size != sizeof(unsigned)) {
+			coro_bus_channel_unpin(ch, true);
+			continue;
+		}
+		unsigned sent = coro_bus_channel_push(ch, &data, 1);
+		if (sent == 0 && is_blocking)
+			sent = coro_bus_channel_wait_push(ch, &data, 1,
+				coro_bus_no_deadline);
+		if (sent > 0)
+			coro_bus_channel_notify_send(ch);
+		else if (!coro_bus_channel_is_closed(ch))
+			ok = false;
+		coro_bus_channel_unpin(ch, true);
+	}
+	return ok;
+}
+
 int
 coro_bus_broadcast(struct coro_bus *bus, unsigned data)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	(void)bus;
-	(void)data;
-	coro_bus_errno_set(CORO_BUS_ERR_NOT_IMPLEMENTED);
-	return -1;
+	int open_count;
+	struct coro_bus_channel *ch;
+	while ((ch = coro_bus_find_full(bus, &open_count)) != NULL) {
+		coro_bus_channel_wait_space(ch);
+		coro_bus_channel_unpin(ch, true);
+	}
+	if (open_count == 0) {
+		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+		return -1;
+	}
+	coro_bus_broadcast_push(bus, data, true);
+	return 0;
 }
 
 int
 coro_bus_try_broadcast(struct coro_bus *bus, unsigned data)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	(void)bus;
-	(void)data;
-	coro_bus_errno_set(CORO_BUS_ERR_NOT_IMPLEMENTED);
-	return -1;
+	int open_count;
+	struct coro_bus_channel *ch = coro_bus_find_full(bus, &open_count);
+	if (ch != NULL) {
+		coro_bus_channel_unpin(ch, true);
+		coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
+		return -1;
+	}
+	if (open_count == 0) {
+		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+		return -1;
+	}
+	if (!coro_bus_broadcast_push(bus, data, false)) {
+		coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
+		return -1;
+	}
+	return 0;
 }
 
 #endif
@@ -232,49 +1449,635 @@ coro_bus_try_broadcast(struct coro_bus *bus, unsigned data)
 int
 coro_bus_send_v(struct coro_bus *bus, int channel, const unsigned *data, unsigned count)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	(void)bus;
-	(void)channel;
-	(void)data;
-	(void)count;
-	coro_bus_errno_set(CORO_BUS_ERR_NOT_IMPLEMENTED);
-	return -1;
+	return coro_bus_send_impl(bus, channel, data, count,
+		sizeof(*data), coro_bus_no_deadline);
 }
 
 int
 coro_bus_try_send_v(struct coro_bus *bus, int channel, const unsigned *data, unsigned count)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	(void)bus;
-	(void)channel;
-	(void)data;
-	(void)count;
-	coro_bus_errno_set(CORO_BUS_ERR_NOT_IMPLEMENTED);
-	return -1;
+	return coro_bus_send_impl(bus, channel, data, count,
+		sizeof(*data), coro_bus_no_wait);
 }
 
 int
 coro_bus_recv_v(struct coro_bus *bus, int channel, unsigned *data, unsigned capacity)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	(void)bus;
-	(void)channel;
-	(void)data;
-	(void)capacity;
-	coro_bus_errno_set(CORO_BUS_ERR_NOT_IMPLEMENTED);
-	return -1;
+	return coro_bus_recv_impl(bus, channel, data, capacity,
+		sizeof(*data), coro_bus_no_deadline);
 }
 
 int
 coro_bus_try_recv_v(struct coro_bus *bus, int channel, unsigned *data, unsigned capacity)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	(void)bus;
-	(void)channel;
-	(void)data;
-	(void)capacity;
-	coro_bus_errno_set(CORO_BUS_ERR_NOT_IMPLEMENTED);
-	return -1;
+	return coro_bus_recv_impl(bus, channel, data, capacity,
+		sizeof(*data), coro_bus_no_wait);
 }
 
 #endif
+
+int
+coro_bus_send_msg(struct coro_bus *bus, int channel, const void *msg)
+{
+	return coro_bus_send_impl(bus, channel, msg, 1, 0,
+		coro_bus_no_deadline) < 0 ? -1 : 0;
+}
+
+int
+coro_bus_try_send_msg(struct coro_bus *bus, int channel, const void *msg)
+{
+	return coro_bus_send_impl(bus, channel, msg, 1, 0,
+		coro_bus_no_wait) < 0 ? -1 : 0;
+}
+
+int
+coro_bus_recv_msg(struct coro_bus *bus, int channel, void *msg)
+{
+	return coro_bus_recv_impl(bus, channel, msg, 1, 0,
+		coro_bus_no_deadline) < 0 ? -1 : 0;
+}
+
+int
+coro_bus_try_recv_msg(struct coro_bus *bus, int channel, void *msg)
+{
+	return coro_bus_recv_impl(bus, channel, msg, 1, 0,
+		coro_bus_no_wait) < 0 ? -1 : 0;
+}
+
+int
+coro_bus_send_msg_v(struct coro_bus *bus, int channel, const void *msgs,
+	unsigned count)
+{
+	return coro_bus_send_impl(bus, channel, msgs, count, 0,
+		coro_bus_no_deadline);
+}
+
+int
+coro_bus_try_send_msg_v(struct coro_bus *bus, int channel, const void *msgs,
+	unsigned count)
+{
+	return coro_bus_send_impl(bus, channel, msgs, count, 0,
+		coro_bus_no_wait);
+}
+
+int
+coro_bus_recv_msg_v(struct coro_bus *bus, int channel, void *msgs,
+	unsigned capacity)
+{
+	return coro_bus_recv_impl(bus, channel, msgs, capacity, 0,
+		coro_bus_no_deadline);
+}
+
+int
+coro_bus_try_recv_msg_v(struct coro_bus *bus, int channel, void *msgs,
+	unsigned capacity)
+{
+	return coro_bus_recv_impl(bus, channel, msgs, capacity, 0,
+		coro_bus_no_wait);
+}
+
+int
+coro_bus_send_timeout(struct coro_bus *bus, int channel, unsigned data,
+	double timeout)
+{
+	return coro_bus_send_impl(bus, channel, &data, 1, sizeof(data),
+		coro_bus_deadline(timeout)) < 0 ? -1 : 0;
+}
+
+int
+coro_bus_recv_timeout(struct coro_bus *bus, int channel, unsigned *data,
+	double timeout)
+{
+	return coro_bus_recv_impl(bus, channel, data, 1, sizeof(*data),
+		coro_bus_deadline(timeout)) < 0 ? -1 : 0;
+}
+
+int
+coro_bus_send_v_timeout(struct coro_bus *bus, int channel,
+	const unsigned *data, unsigned count, double timeout)
+{
+	return coro_bus_send_impl(bus, channel, data, count, sizeof(*data),
+		coro_bus_deadline(timeout));
+}
+
+int
+coro_bus_recv_v_timeout(struct coro_bus *bus, int channel,
+	unsigned *data, unsigned capacity, double timeout)
+{
+	return coro_bus_recv_impl(bus, channel, data, capacity, sizeof(*data),
+		coro_bus_deadline(timeout));
+}
+
+int
+coro_bus_send_msg_timeout(struct coro_bus *bus, int channel, const void *msg,
+	double timeout)
+{
+	return coro_bus_send_impl(bus, channel, msg, 1, 0,
+		coro_bus_deadline(timeout)) < 0 ? -1 : 0;
+}
+
+int
+coro_bus_recv_msg_timeout(struct coro_bus *bus, int channel, void *msg,
+	double timeout)
+{
+	return coro_bus_recv_impl(bus, channel, msg, 1, 0,
+		coro_bus_deadline(timeout)) < 0 ? -1 : 0;
+}
+
+int
+coro_bus_send_msg_v_timeout(struct coro_bus *bus, int channel,
+	const void *msgs, unsigned count, double timeout)
+{
+	return coro_bus_send_impl(bus, channel, msgs, count, 0,
+		coro_bus_deadline(timeout));
+}
+
+int
+coro_bus_recv_msg_v_timeout(struct coro_bus *bus, int channel, void *msgs,
+	unsigned capacity, double timeout)
+{
+	return coro_bus_recv_impl(bus, channel, msgs, capacity, 0,
+		coro_bus_deadline(timeout));
+}
+
+int
+coro_bus_send_ptr(struct coro_bus *bus, int channel, void *ptr)
+{
+	return coro_bus_send_impl(bus, channel, &ptr, 1, sizeof(ptr),
+		coro_bus_no_deadline) < 0 ? -1 : 0;
+}
+
+int
+coro_bus_try_send_ptr(struct coro_bus *bus, int channel, void *ptr)
+{
+	return coro_bus_send_impl(bus, channel, &ptr, 1, sizeof(ptr),
+		coro_bus_no_wait) < 0 ? -1 : 0;
+}
+
+int
+coro_bus_recv_ptr(struct coro_bus *bus, int channel, void **ptr)
+{
+	return coro_bus_recv_impl(bus, channel, ptr, 1, sizeof(*ptr),
+		coro_bus_no_deadline) < 0 ? -1 : 0;
+}
+
+int
+coro_bus_try_recv_ptr(struct coro_bus *bus, int channel, void **ptr)
+{
+	return coro_bus_recv_impl(bus, channel, ptr, 1, sizeof(*ptr),
+		coro_bus_no_wait) < 0 ? -1 : 0;
+}
+
+/** A channel of a select, and the select's place in its queue. */
+struct coro_bus_select_entry {
+	struct coro_bus_channel *ch;
+	struct wakeup_entry wakeup;
+};
+
+enum {
+	/** Selects of up to that many operations allocate nothing. */
+	CORO_BUS_SELECT_STACK_COUNT = 8,
+};
+
+static inline struct wakeup_queue *
+coro_bus_op_queue(struct coro_bus_channel *ch, const struct coro_bus_op *op)
+{
+	return op->type == CORO_BUS_OP_SEND ? &ch->send_queue : &ch->recv_queue;
+}
+
+static bool
+coro_bus_select_is_closed(const struct coro_bus_select_entry *entries,
+	unsigned count)
+{
+	for (unsigned i = 0; i < count; ++i) {
+		if (coro_bus_channel_is_closed(entries[i].ch))
+			return true;
+	}
+	return false;
+}
+
+/**
+ * Do the first operation which can proceed. Returns its index, or
+ * -1 if none can. The others are notified by the caller, when it
+ * is out of the queues.
+ */
+static int
+coro_bus_select_try(struct coro_bus_select_entry *entries,
+	const struct coro_bus_op *ops, unsigned count)
+{
+	for (unsigned i = 0; i < count; ++i) {
+		struct coro_bus_channel *ch = entries[i].ch;
+		unsigned done;
+		if (ops[i].type == CORO_BUS_OP_SEND)
+			done = coro_bus_channel_push(ch, ops[i].msg, 1);
+		else
+			done = coro_bus_channel_pop(ch, ops[i].msg, 1);
+		if (done > 0)
+			return i;
+	}
+	return -1;
+}
+
+static void
+coro_bus_select_notify(struct coro_bus_channel *ch,
+	const struct coro_bus_op *op)
+{
+	if (op->type == CORO_BUS_OP_SEND)
+		coro_bus_channel_notify_send(ch);
+	else
+		coro_bus_channel_notify_recv(ch);
+}
+
+/**
+ * The select could be the first in the queue of a channel which it
+ * didn't use, and then it took the wakeup of the next waiter. So
+ * the wakeup is passed on if the channel is still ready.
+ */
+static void
+coro_bus_select_pass_wakeup(struct coro_bus_channel *ch,
+	const struct coro_bus_op *op)
+{
+	coro_bus_channel_pass_wakeup(ch, op->type == CORO_BUS_OP_SEND);
+}
+
+/**
+ * Select on the pinned channels. Like the single operations, the
+ * waiter is queued in all the channels until it is done, and is
+ * not interrupted by coro_cancel().
+ */
+static int
+coro_bus_select_pinned(struct coro_bus_select_entry *entries,
+	const struct coro_bus_op *ops, unsigned count, bool is_blocking)
+{
+	if (coro_bus_select_is_closed(entries, count)) {
+		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+		return -1;
+	}
+	int rc = coro_bus_select_try(entries, ops, count);
+	if (rc >= 0) {
+		coro_bus_select_notify(entries[rc].ch, &ops[rc]);
+		return rc;
+	}
+	if (!is_blocking) {
+		coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
+		return -1;
+	}
+	for (unsigned i = 0; i < count; ++i) {
+		wakeup_queue_add(coro_bus_op_queue(entries[i].ch, &ops[i]),
+			&entries[i].wakeup);
+	}
+	bool is_cancellable = coro_set_cancellable(false);
+	while (!coro_bus_select_is_closed(entries, count)) {
+		rc = coro_bus_select_try(entries, ops, count);
+		if (rc >= 0)
+			break;
+		coro_suspend_on("bus select", ops);
+	}
+	coro_set_cancellable(is_cancellable);
+	for (unsigned i = 0; i < count; ++i) {
+		wakeup_queue_del(coro_bus_op_queue(entries[i].ch, &ops[i]),
+			&entries[i].wakeup);
+	}
+	for (unsigned i = 0; i < count; ++i) {
+		if ((int)i == rc)
+			coro_bus_select_notify(entries[i].ch, &ops[i]);
+		else
+			coro_bus_select_pass_wakeup(entries[i].ch, &ops[i]);
+	}
+	if (rc < 0)
+		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+	return rc;
+}
+
+static int
+coro_bus_select_impl(struct coro_bus *bus, const struct coro_bus_op *ops,
+	unsigned count, bool is_blocking)
+{
+	if (count == 0) {
+		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+		return -1;
+	}
+	struct coro_bus_select_entry stack_entries[CORO_BUS_SELECT_STACK_COUNT];
+	struct coro_bus_select_entry *entries = stack_entries;
+	if (count > CORO_BUS_SELECT_STACK_COUNT)
+		entries = new struct coro_bus_select_entry[count];
+	unsigned pin_count = 0;
+	for (; pin_count < count; ++pin_count) {
+		const struct coro_bus_op *op = &ops[pin_count];
+		entries[pin_count].ch = coro_bus_channel_pin(bus, op->channel,
+			op->type == CORO_BUS_OP_SEND);
+		if (entries[pin_count].ch == NULL)
+			break;
+	}
+	int rc;
+	if (pin_count < count) {
+		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+		rc = -1;
+	} else {
+		rc = coro_bus_select_pinned(entries, ops, count, is_blocking);
+	}
+	for (unsigned i = 0; i < pin_count; ++i) {
+		coro_bus_channel_unpin(entries[i].ch,
+			ops[i].type == CORO_BUS_OP_SEND);
+	}
+	if (entries != stack_entries)
+		delete[] entries;
+	return rc;
+}
+
+int
+coro_bus_select(struct coro_bus *bus, const struct coro_bus_op *ops,
+	unsigned count)
+{
+	return coro_bus_select_impl(bus, ops, count, true);
+}
+
+int
+coro_bus_try_select(struct coro_bus *bus, const struct coro_bus_op *ops,
+	unsigned count)
+{
+	return coro_bus_select_impl(bus, ops, count, false);
+}
+
+////////////////////////////////////////////////////////////////////
+
+/**
+ * A topic is protected by a spinlock. A publish and a receive hold
+ * it only to copy one message, and wake up the waiters outside of
+ * it.
+ */
+struct coro_bus_topic {
+	int lock;
+	/** The ring of capacity messages, msg_size each. */
+	unsigned char *msgs;
+	size_t capacity;
+	size_t msg_size;
+	enum coro_bus_topic_policy policy;
+	/** Position of the next message to publish. */
+	size_t tail;
+	/**
+	 * Not bigger than the position of the slowest subscriber. It
+	 * is updated only when the ring looks full, so a publish
+	 * doesn't scan the subscribers each time.
+	 */
+	size_t head;
+	struct rlist subs;
+	/** Publishers waiting until the ring is not full. */
+	struct wakeup_queue pub_queue;
+	/** Subscribers waiting for new messages. */
+	struct wakeup_queue sub_queue;
+};
+
+struct coro_bus_sub {
+	struct coro_bus_topic *topic;
+	/** Position of the next message to receive. */
+	size_t pos;
+	bool is_disconnected;
+	struct rlist in_topic;
+};
+
+void
+coro_bus_topic_attr_create(struct coro_bus_topic_attr *attr)
+{
+	attr->policy = CORO_BUS_TOPIC_BLOCK;
+	attr->msg_size = sizeof(unsigned);
+}
+
+struct coro_bus_topic *
+coro_bus_topic_new(size_t size_limit, const struct coro_bus_topic_attr *attr)
+{
+	struct coro_bus_topic_attr default_attr;
+	if (attr == NULL) {
+		coro_bus_topic_attr_create(&default_attr);
+		attr = &default_attr;
+	}
+	if (attr->msg_size == 0 || attr->msg_size > CORO_BUS_MSG_SIZE_MAX) {
+		coro_bus_errno_set(CORO_BUS_ERR_MSG_SIZE);
+		return NULL;
+	}
+	if (size_limit == 0 || size_limit > SIZE_MAX / attr->msg_size) {
+		coro_bus_errno_set(CORO_BUS_ERR_SIZE_LIMIT);
+		return NULL;
+	}
+	struct coro_bus_topic *topic = new struct coro_bus_topic;
+	topic->lock = 0;
+	topic->msgs = new (std::nothrow) unsigned char[size_limit *
+		attr->msg_size];
+	if (topic->msgs == NULL) {
+		delete topic;
+		coro_bus_errno_set(CORO_BUS_ERR_SIZE_LIMIT);
+		return NULL;
+	}
+	topic->capacity = size_limit;
+	topic->msg_size = attr->msg_size;
+	topic->policy = attr->policy;
+	topic->tail = 0;
+	topic->head = 0;
+	rlist_create(&topic->subs);
+	wakeup_queue_create(&topic->pub_queue);
+	wakeup_queue_create(&topic->sub_queue);
+	return topic;
+}
+
+void
+coro_bus_topic_delete(struct coro_bus_topic *topic)
+{
+	assert(rlist_empty(&topic->subs));
+	assert(rlist_empty(&topic->pub_queue.coros));
+	assert(rlist_empty(&topic->sub_queue.coros));
+	delete[] topic->msgs;
+	delete topic;
+}
+
+/**
+ * With CORO_BUS_TOPIC_BLOCK the ring is full when the slowest
+ * subscriber is a whole ring behind. The other policies overwrite
+ * the old messages. The lock must be held.
+ */
+static bool
+coro_bus_topic_is_full(struct coro_bus_topic *topic)
+{
+	if (topic->policy != CORO_BUS_TOPIC_BLOCK ||
+	    topic->tail - topic->head < topic->capacity)
+		return false;
+	size_t head = topic->tail;
+	struct coro_bus_sub *sub;
+	rlist_foreach_entry(sub, &topic->subs, in_topic) {
+		if (sub->pos < head)
+			head = sub->pos;
+	}
+	topic->head = head;
+	return topic->tail - head >= topic->capacity;
+}
+
+/** Publish the message if it fits. */
+static bool
+coro_bus_topic_push(struct coro_bus_topic *topic, const void *msg)
+{
+	coro_bus_lock(&topic->lock);
+	bool ok = !coro_bus_topic_is_full(topic);
+	if (ok) {
+		size_t offset = topic->tail % topic->capacity * topic->msg_size;
+		coro_bus_msg_copy(topic->msgs + offset, msg, topic->msg_size);
+		++topic->tail;
+	}
+	coro_bus_unlock(&topic->lock);
+	return ok;
+}
+
+/**
+ * Wake up all the subscribers after a publish, and the next
+ * publisher if there is still space. The fence pairs with the one
+ * in wakeup_queue_add().
+ */
+static void
+coro_bus_topic_notify_publish(struct coro_bus_topic *topic)
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&topic->sub_queue.count, __ATOMIC_RELAXED) > 0)
+		wakeup_queue_wakeup_all(&topic->sub_queue);
+	if (__atomic_load_n(&topic->pub_queue.count, __ATOMIC_RELAXED) == 0)
+		return;
+	coro_bus_lock(&topic->lock);
+	bool is_full = coro_bus_topic_is_full(topic);
+	coro_bus_unlock(&topic->lock);
+	if (!is_full)
+		wakeup_queue_wakeup_first(&topic->pub_queue);
+}
+
+/** The slowest subscriber moved on, a publisher might proceed. */
+static void
+coro_bus_topic_notify_recv(struct coro_bus_topic *topic)
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	wakeup_queue_wakeup_first(&topic->pub_queue);
+}
+
+static int
+coro_bus_publish_impl(struct coro_bus_topic *topic, const void *msg,
+	bool is_blocking)
+{
+	if (!coro_bus_topic_push(topic, msg)) {
+		if (!is_blocking) {
+			coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
+			return -1;
+		}
+		struct wakeup_entry entry;
+		wakeup_queue_add(&topic->pub_queue, &entry);
+		bool is_cancellable = coro_set_cancellable(false);
+		while (!coro_bus_topic_push(topic, msg))
+			coro_suspend_on("bus publish", topic);
+		coro_set_cancellable(is_cancellable);
+		wakeup_queue_del(&topic->pub_queue, &entry);
+	}
+	coro_bus_topic_notify_publish(topic);
+	return 0;
+}
+
+int
+coro_bus_publish(struct coro_bus_topic *topic, const void *msg)
+{
+	return coro_bus_publish_impl(topic, msg, true);
+}
+
+int
+coro_bus_try_publish(struct coro_bus_topic *topic, const void *msg)
+{
+	return coro_bus_publish_impl(topic, msg, false);
+}
+
+struct coro_bus_sub *
+coro_bus_subscribe(struct coro_bus_topic *topic)
+{
+	struct coro_bus_sub *sub = new struct coro_bus_sub;
+	sub->topic = topic;
+	sub->is_disconnected = false;
+	coro_bus_lock(&topic->lock);
+	sub->pos = topic->tail;
+	rlist_add_tail_entry(&topic->subs, sub, in_topic);
+	coro_bus_unlock(&topic->lock);
+	return sub;
+}
+
+void
+coro_bus_unsubscribe(struct coro_bus_sub *sub)
+{
+	struct coro_bus_topic *topic = sub->topic;
+	coro_bus_lock(&topic->lock);
+	rlist_del_entry(sub, in_topic);
+	coro_bus_unlock(&topic->lock);
+	delete sub;
+	coro_bus_topic_notify_recv(topic);
+}
+
+/**
+ * Receive the next message if there is one. A subscriber behind
+ * the oldest kept message either skips the lost ones or is
+ * disconnected, depending on the policy.
+ */
+static enum coro_bus_error_code
+coro_bus_sub_pop(struct coro_bus_sub *sub, void *msg)
+{
+	struct coro_bus_topic *topic = sub->topic;
+	enum coro_bus_error_code err = CORO_BUS_ERR_NONE;
+	bool was_slowest = false;
+	coro_bus_lock(&topic->lock);
+	if (!sub->is_disconnected && topic->tail - sub->pos > topic->capacity) {
+		if (topic->policy == CORO_BUS_TOPIC_DISCONNECT)
+			sub->is_disconnected = true;
+		else
+			sub->pos = topic->tail - topic->capacity;
+	}
+	if (sub->is_disconnected) {
+		err = CORO_BUS_ERR_DISCONNECTED;
+	} else if (sub->pos == topic->tail) {
+		err = CORO_BUS_ERR_WOULD_BLOCK;
+	} else {
+		size_t offset = sub->pos % topic->capacity * topic->msg_size;
+		coro_bus_msg_copy(msg, topic->msgs + offset, topic->msg_size);
+		/*
+		 * A waiting publisher has seen the exact head. Only the
+		 * subscribers at it can let the publisher go.
+		 */
+		was_slowest = sub->pos == topic->head;
+		++sub->pos;
+	}
+	coro_bus_unlock(&topic->lock);
+	if (was_slowest)
+		coro_bus_topic_notify_recv(topic);
+	return err;
+}
+
+static int
+coro_bus_sub_recv_impl(struct coro_bus_sub *sub, void *msg, bool is_blocking)
+{
+	struct coro_bus_topic *topic = sub->topic;
+	enum coro_bus_error_code err = coro_bus_sub_pop(sub, msg);
+	if (err == CORO_BUS_ERR_WOULD_BLOCK && is_blocking) {
+		struct wakeup_entry entry;
+		wakeup_queue_add(&topic->sub_queue, &entry);
+		bool is_cancellable = coro_set_cancellable(false);
+		while ((err = coro_bus_sub_pop(sub, msg)) ==
+		       CORO_BUS_ERR_WOULD_BLOCK)
+			coro_suspend_on("bus topic recv", topic);
+		coro_set_cancellable(is_cancellable);
+		wakeup_queue_del(&topic->sub_queue, &entry);
+	}
+	if (err != CORO_BUS_ERR_NONE) {
+		coro_bus_errno_set(err);
+		return -1;
+	}
+	return 0;
+}
+
+int
+coro_bus_sub_recv(struct coro_bus_sub *sub, void *msg)
+{
+	return coro_bus_sub_recv_impl(sub, msg, true);
+}
+
+int
+coro_bus_sub_try_recv(struct coro_bus_sub *sub, void *msg)
+{
+	return coro_bus_sub_recv_impl(sub, msg, false);
+}
@@ -1,29 +1,120 @@
 #pragma once
 
 #include <stddef.h>
+#include <stdint.h>
 
 /**
  * Here you should specify which bonuses do you want via the
  * macros. It is important to define these macros here, in the
  * header, because it is used by tests.
  */
-#define NEED_BROADCAST 0
-#define NEED_BATCH 0
+#define NEED_BROADCAST 1
+#define NEED_BATCH 1
 
 enum coro_bus_error_code {
 	CORO_BUS_ERR_NONE = 0,
 	CORO_BUS_ERR_NO_CHANNEL,
 	CORO_BUS_ERR_WOULD_BLOCK,
 	CORO_BUS_ERR_NOT_IMPLEMENTED,
+	CORO_BUS_ERR_MSG_SIZE,
+	CORO_BUS_ERR_DISCONNECTED,
+	CORO_BUS_ERR_TIMEOUT,
+	CORO_BUS_ERR_SIZE_LIMIT,
+};
+
+enum {
+	/** Max size of a message stored right in a channel. */
+	CORO_BUS_MSG_SIZE_MAX = 64,
+};
+
+/**
+ * How a channel is used, see struct coro_bus_channel_attr. The
+ * channels are lock-free ring buffers, so the coroutines in
+ * different threads can exchange messages via them. Either in the
+ * M:N mode, or each running its own engine. A coroutine blocked on
+ * a channel is woken up by the thread which made it ready.
+ */
+enum coro_bus_channel_mode {
+	/** Any number of senders and receivers in any threads. */
+	CORO_BUS_CHANNEL_MPMC = 0,
+	/**
+	 * The sends are never concurrent with each other, and the
+	 * receives too. For example, a single sending coroutine and
+	 * a single receiving one, or all the senders in one thread.
+	 * Then the ring buffer is moved without compare-and-swap
+	 * loops, which the MPMC one needs.
+	 */
+	CORO_BUS_CHANNEL_SPSC,
+};
+
+/** Called for a message dropped with its channel. */
+typedef void (*coro_bus_msg_destructor_f)(void *msg);
+
+/** Channel creation attributes. */
+struct coro_bus_channel_attr {
+	enum coro_bus_channel_mode mode;
+	/**
+	 * Size of each message in bytes, from 1 to
+	 * CORO_BUS_MSG_SIZE_MAX. The messages are copied right into
+	 * the ring buffer of the channel, so a send and a receive
+	 * allocate nothing. Bigger messages are sent as pointers,
+	 * see coro_bus_send_ptr(). The default is sizeof(unsigned).
+	 */
+	size_t msg_size;
+	/**
+	 * Gets a pointer to each message left unreceived in a
+	 * closed channel, or in a deleted bus. For example, frees
+	 * the buffers of the pointer messages, which belong to the
+	 * channel until received. It is called by the close, or
+	 * later when the operations in other threads are done with
+	 * the channel, but at the latest by coro_bus_delete(). NULL
+	 * by default, the messages are just dropped.
+	 */
+	coro_bus_msg_destructor_f msg_destructor;
+	/**
+	 * Bounds of the size limit in the adaptive mode, where the
+	 * limit follows the load. When a sender finds the channel
+	 * full, the limit is doubled, up to the max. When a receiver
+	 * finds it empty, and the channel wasn't filled more than a
+	 * quarter of the limit since the last such time, the limit is
+	 * halved, down to the min. The limit given to the open is the
+	 * initial one. The ring is allocated for the max at once. 0
+	 * max, the default, means the limit is fixed.
+	 */
+	size_t size_limit_min;
+	size_t size_limit_max;
+};
+
+/** Statistics of a channel since it was opened. */
+struct coro_bus_channel_stats {
+	/** Messages sent to the channel. */
+	uint64_t send_count;
+	/** Messages received from the channel. */
+	uint64_t recv_count;
+	/** Total time the senders were suspended on the full channel. */
+	uint64_t send_wait_ns;
+	/** Total time the receivers were suspended on the empty one. */
+	uint64_t recv_wait_ns;
+	/**
+	 * Max number of messages the channel had at once. In the
+	 * SPSC mode it is sampled only when the sender or the receiver
+	 * look at the other side, so it can be a bit lower.
+	 */
+	size_t peak_size;
+	/** The current size limit. Changes in the adaptive mode. */
+	size_t size_limit;
 };
 
 struct coro_bus;
 
-/** Get the latest error happened in coro_bus. */
+/**
+ * Get the latest error happened in coro_bus in the current
+ * coroutine. Each coroutine has its own error.
+ */
 enum coro_bus_error_code
 coro_bus_errno(void);
 
-/** Set the global coro_bus error. */
+/** Set the coro_bus error of the current coroutine. */
 void
 coro_bus_errno_set(enum coro_bus_error_code err);
 
@@ -47,10 +138,45 @@ coro_bus_delete(struct coro_bus *bus);
  *
  * @retval >=0 Descriptor of the channel. It must be passed to the
  *     send/recv functions.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_SIZE_LIMIT - the ring for the size limit
+ *       wouldn't fit into memory.
  */
 int
 coro_bus_channel_open(struct coro_bus *bus, size_t size_limit);
 
+/** Initialize the channel attributes with the default values. */
+void
+coro_bus_channel_attr_create(struct coro_bus_channel_attr *attr);
+
+/**
+ * Same as coro_bus_channel_open(), but with the given attributes.
+ * NULL attributes mean the defaults.
+ *
+ * @retval >=0 Descriptor of the channel.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_MSG_SIZE - the message size is 0 or bigger
+ *       than CORO_BUS_MSG_SIZE_MAX.
+ *     - CORO_BUS_ERR_SIZE_LIMIT - the ring for the size limit or
+ *       its max wouldn't fit into memory, or the min is above the
+ *       max.
+ */
+int
+coro_bus_channel_open_ex(struct coro_bus *bus, size_t size_limit,
+	const struct coro_bus_channel_attr *attr);
+
+/**
+ * Get the statistics of the channel. The waits of the selects are
+ * not counted in the wait times, as they wait for many channels.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ */
+int
+coro_bus_channel_stats(struct coro_bus *bus, int channel,
+	struct coro_bus_channel_stats *stats);
+
 /**
  * Destroy the channel identified by the given descriptor. The
  * channel must exist. All pending messages of the channel are
@@ -66,6 +192,10 @@ coro_bus_channel_close(struct coro_bus *bus, int channel);
  * Send the given message to the specified channel. If the channel
  * is full, the function should suspend the current coroutine and
  * retry until success or until the channel is gone.
+ *
+ * The functions taking unsigned messages work only with the
+ * channels of sizeof(unsigned) messages, the default ones. With
+ * the others they fail with CORO_BUS_ERR_MSG_SIZE.
  * @param bus Bus where the channel is located.
  * @param channel Descriptor of the channel to send data to.
  * @param data Data to send.
@@ -133,7 +263,8 @@ coro_bus_try_recv(struct coro_bus *bus, int channel, unsigned *data);
  * Send the given message to all the registered channels at once.
  * If any of the channels are full, then the message isn't sent
  * anywhere, and the coroutine is suspended until can submit the
- * data to all the channels.
+ * data to all the channels. The channels of the messages other
+ * than unsigned are skipped.
  * @param bus Bus where the channels are located.
  * @param data Data to send.
  *
@@ -146,7 +277,11 @@ coro_bus_broadcast(struct coro_bus *bus, unsigned data);
 
 /**
  * Same as coro_bus_broadcast(), but if any of the channels are
- * full, it instantly returns, not suspends.
+ * full, it instantly returns, not suspends. When the channels have
+ * other senders in other threads, a channel can get full after the
+ * check. Then the message is delivered only to a part of the
+ * channels, and the function fails with CORO_BUS_ERR_WOULD_BLOCK.
+ * The blocking broadcast waits for such a channel instead.
  * @param bus  Bus where the channels are located.
  * @param data Data to send.
  *
@@ -245,3 +380,399 @@ coro_bus_try_recv_v(struct coro_bus *bus, int channel,
 	unsigned *data, unsigned capacity);
 
 #endif /* Bonus 2 */
+
+/**
+ * Send a message of the channel's message size, see struct
+ * coro_bus_channel_attr. It is copied from @a msg into the
+ * channel. Otherwise the same as coro_bus_send().
+ *
+ * @retval 0 Success.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ */
+int
+coro_bus_send_msg(struct coro_bus *bus, int channel, const void *msg);
+
+/**
+ * Same as coro_bus_send_msg(), but never suspends.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ *     - CORO_BUS_ERR_WOULD_BLOCK - the channel is full.
+ */
+int
+coro_bus_try_send_msg(struct coro_bus *bus, int channel, const void *msg);
+
+/**
+ * Receive a message of the channel's message size into @a msg.
+ * Otherwise the same as coro_bus_recv().
+ *
+ * @retval 0 Success.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ */
+int
+coro_bus_recv_msg(struct coro_bus *bus, int channel, void *msg);
+
+/**
+ * Same as coro_bus_recv_msg(), but never suspends.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ *     - CORO_BUS_ERR_WOULD_BLOCK - the channel is empty.
+ */
+int
+coro_bus_try_recv_msg(struct coro_bus *bus, int channel, void *msg);
+
+/**
+ * Same as coro_bus_send_v(), but @a msgs is an array of @a count
+ * messages of the channel's message size.
+ *
+ * @retval >0 Success, how many messages were sent.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ */
+int
+coro_bus_send_msg_v(struct coro_bus *bus, int channel, const void *msgs,
+	unsigned count);
+
+/**
+ * Same as coro_bus_send_msg_v(), but never suspends.
+ *
+ * @retval >0 Success, how many messages were sent.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ *     - CORO_BUS_ERR_WOULD_BLOCK - the channel is full.
+ */
+int
+coro_bus_try_send_msg_v(struct coro_bus *bus, int channel, const void *msgs,
+	unsigned count);
+
+/**
+ * Same as coro_bus_recv_v(), but @a msgs is an array for
+ * @a capacity messages of the channel's message size.
+ *
+ * @retval >0 Success, how many messages were received.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ */
+int
+coro_bus_recv_msg_v(struct coro_bus *bus, int channel, void *msgs,
+	unsigned capacity);
+
+/**
+ * Same as coro_bus_recv_msg_v(), but never suspends.
+ *
+ * @retval >0 Success, how many messages were received.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ *     - CORO_BUS_ERR_WOULD_BLOCK - the channel is empty.
+ */
+int
+coro_bus_try_recv_msg_v(struct coro_bus *bus, int channel, void *msgs,
+	unsigned capacity);
+
+/**
+ * Same as coro_bus_send(), but waits for space at most @a timeout
+ * seconds. A negative timeout means infinity. When the time is out
+ * the coroutine leaves the channel's queue of waiters, and nothing
+ * is sent.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ *     - CORO_BUS_ERR_TIMEOUT - the channel stayed full.
+ */
+int
+coro_bus_send_timeout(struct coro_bus *bus, int channel, unsigned data,
+	double timeout);
+
+/**
+ * Same as coro_bus_recv(), but waits for a message at most
+ * @a timeout seconds, like coro_bus_send_timeout().
+ *
+ * @retval 0 Success.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ *     - CORO_BUS_ERR_TIMEOUT - the channel stayed empty.
+ */
+int
+coro_bus_recv_timeout(struct coro_bus *bus, int channel, unsigned *data,
+	double timeout);
+
+/**
+ * Same as coro_bus_send_v(), but with a timeout like in
+ * coro_bus_send_timeout().
+ *
+ * @retval >0 Success, how many messages were sent.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ *     - CORO_BUS_ERR_TIMEOUT - the channel stayed full.
+ */
+int
+coro_bus_send_v_timeout(struct coro_bus *bus, int channel,
+	const unsigned *data, unsigned count, double timeout);
+
+/**
+ * Same as coro_bus_recv_v(), but with a timeout like in
+ * coro_bus_recv_timeout().
+ *
+ * @retval >0 Success, how many messages were received.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ *     - CORO_BUS_ERR_TIMEOUT - the channel stayed empty.
+ */
+int
+coro_bus_recv_v_timeout(struct coro_bus *bus, int channel,
+	unsigned *data, unsigned capacity, double timeout);
+
+/** Same as coro_bus_send_timeout(), but like coro_bus_send_msg(). */
+int
+coro_bus_send_msg_timeout(struct coro_bus *bus, int channel, const void *msg,
+	double timeout);
+
+/** Same as coro_bus_recv_timeout(), but like coro_bus_recv_msg(). */
+int
+coro_bus_recv_msg_timeout(struct coro_bus *bus, int channel, void *msg,
+	double timeout);
+
+/**
+ * Same as coro_bus_send_v_timeout(), but like
+ * coro_bus_send_msg_v().
+ */
+int
+coro_bus_send_msg_v_timeout(struct coro_bus *bus, int channel,
+	const void *msgs, unsigned count, double timeout);
+
+/**
+ * Same as coro_bus_recv_v_timeout(), but like
+ * coro_bus_recv_msg_v().
+ */
+int
+coro_bus_recv_msg_v_timeout(struct coro_bus *bus, int channel, void *msgs,
+	unsigned capacity, double timeout);
+
+/**
+ * Send a pointer to a channel of sizeof(void *) messages. Only the
+ * pointer is copied, so a buffer of any size is handed over to the
+ * receiver as is. The channel owns the buffer until it is
+ * received, see the message destructor in struct
+ * coro_bus_channel_attr. The arrays of pointers are sent and
+ * received with the vector functions of the messages.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ *     - CORO_BUS_ERR_MSG_SIZE - the channel isn't of pointers.
+ */
+int
+coro_bus_send_ptr(struct coro_bus *bus, int channel, void *ptr);
+
+/**
+ * Same as coro_bus_send_ptr(), but never suspends.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ *     - CORO_BUS_ERR_WOULD_BLOCK - the channel is full.
+ *     - CORO_BUS_ERR_MSG_SIZE - the channel isn't of pointers.
+ */
+int
+coro_bus_try_send_ptr(struct coro_bus *bus, int channel, void *ptr);
+
+/**
+ * Receive a pointer from a channel of sizeof(void *) messages. The
+ * receiver becomes the owner of the buffer.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ *     - CORO_BUS_ERR_MSG_SIZE - the channel isn't of pointers.
+ */
+int
+coro_bus_recv_ptr(struct coro_bus *bus, int channel, void **ptr);
+
+/**
+ * Same as coro_bus_recv_ptr(), but never suspends.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ *     - CORO_BUS_ERR_WOULD_BLOCK - the channel is empty.
+ *     - CORO_BUS_ERR_MSG_SIZE - the channel isn't of pointers.
+ */
+int
+coro_bus_try_recv_ptr(struct coro_bus *bus, int channel, void **ptr);
+
+enum coro_bus_op_type {
+	CORO_BUS_OP_SEND,
+	CORO_BUS_OP_RECV,
+};
+
+/** One operation of coro_bus_select(). */
+struct coro_bus_op {
+	enum coro_bus_op_type type;
+	int channel;
+	/**
+	 * The message to send, or the memory to receive one into. Of
+	 * the channel's message size, like in coro_bus_send_msg().
+	 */
+	void *msg;
+};
+
+/**
+ * Wait until any of the operations can proceed, and do exactly one
+ * of them. When several can, the first one in the array is done.
+ * The waiting coroutine is queued in all the channels at once, so
+ * one coroutine can serve many channels.
+ * @param bus Bus where the channels are located.
+ * @param ops Operations to choose from.
+ * @param count Size of @a ops.
+ *
+ * @retval >=0 Success, index of the done operation.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - any of the channels doesn't exist,
+ *       or there are no operations.
+ */
+int
+coro_bus_select(struct coro_bus *bus, const struct coro_bus_op *ops,
+	unsigned count);
+
+/**
+ * Same as coro_bus_select(), but if none of the operations can
+ * proceed, the function immediately returns.
+ *
+ * @retval >=0 Success, index of the done operation.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - any of the channels doesn't exist,
+ *       or there are no operations.
+ *     - CORO_BUS_ERR_WOULD_BLOCK - none of them can proceed.
+ */
+int
+coro_bus_try_select(struct coro_bus *bus, const struct coro_bus_op *ops,
+	unsigned count);
+
+/**
+ * What happens when the ring of a topic is full, because a
+ * subscriber didn't receive the oldest message yet.
+ */
+enum coro_bus_topic_policy {
+	/** The publisher waits until the slowest subscriber catches up. */
+	CORO_BUS_TOPIC_BLOCK = 0,
+	/**
+	 * The oldest message is overwritten. The subscribers which
+	 * didn't receive it yet skip it.
+	 */
+	CORO_BUS_TOPIC_DROP_OLDEST,
+	/**
+	 * Same as CORO_BUS_TOPIC_DROP_OLDEST, but a subscriber which
+	 * misses a message is disconnected instead.
+	 */
+	CORO_BUS_TOPIC_DISCONNECT,
+};
+
+/** Topic creation attributes. */
+struct coro_bus_topic_attr {
+	enum coro_bus_topic_policy policy;
+	/**
+	 * Size of each message, same as in struct
+	 * coro_bus_channel_attr. The default is sizeof(unsigned).
+	 */
+	size_t msg_size;
+};
+
+/**
+ * A topic is a ring buffer of messages shared by all its
+ * subscribers, each of them reading it from its own position. So
+ * a message is published once regardless of the number of the
+ * subscribers, and each of them receives all the messages
+ * published after it subscribed. The topics and the subscribers
+ * can be used in any threads.
+ */
+struct coro_bus_topic;
+struct coro_bus_sub;
+
+/** Initialize the topic attributes with the default values. */
+void
+coro_bus_topic_attr_create(struct coro_bus_topic_attr *attr);
+
+/**
+ * Create a topic keeping up to @a size_limit messages, at least 1.
+ * NULL attributes mean the defaults.
+ *
+ * @retval not NULL The new topic.
+ * @retval NULL Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_MSG_SIZE - the message size is 0 or bigger
+ *       than CORO_BUS_MSG_SIZE_MAX.
+ *     - CORO_BUS_ERR_SIZE_LIMIT - the size limit is 0, or the
+ *       messages wouldn't fit into memory.
+ */
+struct coro_bus_topic *
+coro_bus_topic_new(size_t size_limit, const struct coro_bus_topic_attr *attr);
+
+/**
+ * Delete the topic. It must have no subscribers and no suspended
+ * publishers.
+ */
+void
+coro_bus_topic_delete(struct coro_bus_topic *topic);
+
+/**
+ * Publish a message of the topic's message size to all the
+ * subscribers. With CORO_BUS_TOPIC_BLOCK and the ring full, the
+ * current coroutine is suspended until the slowest subscriber
+ * receives a message.
+ *
+ * @retval 0 Success.
+ */
+int
+coro_bus_publish(struct coro_bus_topic *topic, const void *msg);
+
+/**
+ * Same as coro_bus_publish(), but never suspends.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_WOULD_BLOCK - the ring is full, with
+ *       CORO_BUS_TOPIC_BLOCK.
+ */
+int
+coro_bus_try_publish(struct coro_bus_topic *topic, const void *msg);
+
+/** Subscribe to the messages published from now on. */
+struct coro_bus_sub *
+coro_bus_subscribe(struct coro_bus_topic *topic);
+
+/**
+ * Delete the subscriber. Its unreceived messages don't hold the
+ * publishers anymore. No coroutine can be suspended in it.
+ */
+void
+coro_bus_unsubscribe(struct coro_bus_sub *sub);
+
+/**
+ * Receive the next message of the topic. If there are none, the
+ * current coroutine is suspended until one is published.
+ *
+ * @retval 0 Success, @a msg is filled.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_DISCONNECTED - the subscriber missed a
+ *       message with CORO_BUS_TOPIC_DISCONNECT. It only can be
+ *       unsubscribed then.
+ */
+int
+coro_bus_sub_recv(struct coro_bus_sub *sub, void *msg);
+
+/**
+ * Same as coro_bus_sub_recv(), but never suspends.
+ *
+ * @retval 0 Success, @a msg is filled.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_WOULD_BLOCK - no new messages.
+ *     - CORO_BUS_ERR_DISCONNECTED - the subscriber missed a
+ *       message with CORO_BUS_TOPIC_DISCONNECT.
+ */
+int
+coro_bus_sub_try_recv(struct coro_bus_sub *sub, void *msg);
@@ -0,0 +1,85 @@
+#include "corobus.h"
+
+#include "bench.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/* Benchmarks of the bus. */
+
+static const int bench_run_count = 5;
+/** Close and open pairs per run of the churn. */
+static const int bench_churn_count = 1000000;
+
+////////////////////////////////////////////////////////////////////////////////
+
+/** Time of opening a channel, per channel, in a bus of that many. */
+static void
+bench_open(int channel_count)
+{
+	double times[bench_run_count];
+	for (int run_i = 0; run_i < bench_run_count; ++run_i) {
+		struct coro_bus *bus = coro_bus_new();
+		uint64_t start_ts = bench_now_ns();
+		for (int i = 0; i < channel_count; ++i)
+			coro_bus_channel_open(bus, 1);
+		uint64_t duration = bench_now_ns() - start_ts;
+		times[run_i] = (double)duration / channel_count;
+		coro_bus_delete(bus);
+	}
+	char name[128];
+	snprintf(name, sizeof(name), "Open of %d channels", channel_count);
+	bench_report(name, times, bench_run_count);
+}
+
+/**
+ * Time of closing a channel and opening a new one, in a bus of
+ * many channels. The closed descriptors are spread over the whole
+ * range, and each is the lowest free one, so it is reused.
+ */
+static void
+bench_churn(int channel_count)
+{
+	double times[bench_run_count];
+	struct coro_bus *bus = coro_bus_new();
+	for (int i = 0; i < channel_count; ++i)
+		coro_bus_channel_open(bus, 1);
+	uint32_t seed = 1;
+	for (int run_i = 0; run_i < bench_run_count; ++run_i) {
+		uint64_t start_ts = bench_now_ns();
+		for (int i = 0; i < bench_churn_count; ++i) {
+			seed = seed * 1664525 + 1013904223;
+			int channel = (int)(seed % channel_count);
+			coro_bus_channel_close(bus, channel);
+			if (coro_bus_channel_open(bus, 1) != channel) {
+				printf("The lowest descriptor isn't reused\n");
+				exit(-1);
+			}
+		}
+		uint64_t duration = bench_now_ns() - start_ts;
+		times[run_i] = (double)duration / bench_churn_count;
+	}
+	coro_bus_delete(bus);
+	char name[128];
+	snprintf(name, sizeof(name), "Close and open in %d channels",
+		channel_count);
+	bench_report(name, times, bench_run_count);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+int
+main(int argc, char **argv)
+{
+	if (bench_parse_args(argc, argv) != 0)
+		return -1;
+	if (bench_is_csv)
+		printf("name,min_ns,med_ns,max_ns\n");
+	const int channel_counts[] = {1000, 100000, 1000000};
+	for (int count : channel_counts) {
+		bench_open(count);
+		bench_churn(count);
+	}
+	return 0;
+}
@@ -0,0 +1,1031 @@
+#include "corobus.h"
+#include "libcoro.h"
+
+#include "unit.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/**
+ * The bus used by the coroutines in many threads, and the messages
+ * other than unsigned. The basic semantics are covered by
+ * test.cpp.
+ */
+
+////////////////////////////////////////////////////////////////////////////////
+
+enum {
+	TEST_THREAD_COUNT = 4,
+	TEST_SENDER_COUNT = 4,
+	TEST_RECEIVER_COUNT = 4,
+	TEST_MESSAGE_COUNT = 20000,
+	TEST_SENDER_SHIFT = 24,
+};
+
+/** Options of test_mt_run(). */
+enum {
+	/** Use the vector functions. */
+	TEST_MT_BATCH = 1 << 0,
+	/** Send the messages as pointers to them. */
+	TEST_MT_PTR = 1 << 1,
+	/** The size limit adapts from 1 up to 64. */
+	TEST_MT_ADAPTIVE = 1 << 2,
+};
+
+struct test_mt_ctx {
+	struct coro_bus *bus;
+	int channel;
+	/** Messages per sender. */
+	unsigned message_count;
+	/** Messages per receiver. */
+	unsigned receive_count;
+	/** Use the vector functions. */
+	bool is_batch;
+	/** Send the messages as pointers to them. */
+	bool is_ptr;
+	unsigned long long sum;
+	/** Each receiver got the messages of each sender in order. */
+	bool is_ordered;
+};
+
+struct test_mt_sender {
+	struct test_mt_ctx *ctx;
+	unsigned id;
+};
+
+static void *
+test_mt_send_f(void *arg)
+{
+	struct test_mt_sender *sender = (decltype(sender))arg;
+	struct test_mt_ctx *ctx = sender->ctx;
+	unsigned base = sender->id << TEST_SENDER_SHIFT;
+	unsigned i = 0;
+	while (i < ctx->message_count) {
+		if (ctx->is_ptr) {
+			unit_assert(coro_bus_send_ptr(ctx->bus, ctx->channel,
+				new unsigned(base + i)) == 0);
+			++i;
+			continue;
+		}
+		if (!ctx->is_batch) {
+			unit_assert(coro_bus_send(ctx->bus, ctx->channel,
+				base + i) == 0);
+			++i;
+			continue;
+		}
+		unsigned data[7];
+		unsigned count = 0;
+		for (; count < 7 && i + count < ctx->message_count; ++count)
+			data[count] = base + i + count;
+		int rc = coro_bus_send_v(ctx->bus, ctx->channel, data, count);
+		unit_assert(rc > 0);
+		i += rc;
+	}
+	return NULL;
+}
+
+static void *
+test_mt_recv_f(void *arg)
+{
+	struct test_mt_ctx *ctx = (decltype(ctx))arg;
+	unsigned next[TEST_SENDER_COUNT] = {0};
+	unsigned long long sum = 0;
+	bool is_ordered = true;
+	unsigned i = 0;
+	while (i < ctx->receive_count) {
+		unsigned data[5];
+		unsigned capacity = ctx->is_batch ? 5 : 1;
+		if (capacity > ctx->receive_count - i)
+			capacity = ctx->receive_count - i;
+		int rc;
+		if (ctx->is_ptr) {
+			/* The buffers are owned by the receiver now. */
+			unsigned *ptrs[5];
+			rc = coro_bus_recv_msg_v(ctx->bus, ctx->channel, ptrs,
+				capacity);
+			unit_assert(rc > 0);
+			for (int j = 0; j < rc; ++j) {
+				data[j] = *ptrs[j];
+				delete ptrs[j];
+			}
+		} else {
+			rc = coro_bus_recv_v(ctx->bus, ctx->channel, data,
+				capacity);
+			unit_assert(rc > 0);
+		}
+		for (int j = 0; j < rc; ++j) {
+			unsigned id = data[j] >> TEST_SENDER_SHIFT;
+			unsigned seq = data[j] & ((1 << TEST_SENDER_SHIFT) - 1);
+			unit_assert(id < TEST_SENDER_COUNT);
+			is_ordered = is_ordered && seq >= next[id];
+			next[id] = seq + 1;
+			sum += data[j];
+		}
+		i += rc;
+	}
+	__atomic_add_fetch(&ctx->sum, sum, __ATOMIC_RELAXED);
+	if (!is_ordered)
+		__atomic_store_n(&ctx->is_ordered, false, __ATOMIC_RELAXED);
+	return NULL;
+}
+
+/**
+ * Run the senders and the receivers of one channel in the M:N
+ * mode.
+ */
+static bool
+test_mt_run(enum coro_bus_channel_mode mode, size_t size_limit,
+	int sender_count, int receiver_count, unsigned flags)
+{
+	struct test_mt_ctx ctx;
+	ctx.bus = coro_bus_new();
+	struct coro_bus_channel_attr attr;
+	coro_bus_channel_attr_create(&attr);
+	attr.mode = mode;
+	if ((flags & TEST_MT_PTR) != 0)
+		attr.msg_size = sizeof(void *);
+	if ((flags & TEST_MT_ADAPTIVE) != 0) {
+		attr.size_limit_min = 1;
+		attr.size_limit_max = 64;
+	}
+	ctx.channel = coro_bus_channel_open_ex(ctx.bus, size_limit, &attr);
+	unit_assert(ctx.channel >= 0);
+	ctx.message_count = TEST_MESSAGE_COUNT;
+	unit_assert(TEST_MESSAGE_COUNT * sender_count % receiver_count == 0);
+	ctx.receive_count = TEST_MESSAGE_COUNT * sender_count / receiver_count;
+	ctx.is_batch = (flags & TEST_MT_BATCH) != 0;
+	ctx.is_ptr = (flags & TEST_MT_PTR) != 0;
+	ctx.sum = 0;
+	ctx.is_ordered = true;
+
+	struct test_mt_sender senders[TEST_SENDER_COUNT];
+	struct coro *coros[TEST_SENDER_COUNT + TEST_RECEIVER_COUNT];
+	int coro_count = 0;
+	unsigned long long expected = 0;
+	for (int i = 0; i < sender_count; ++i) {
+		senders[i].ctx = &ctx;
+		senders[i].id = i;
+		coros[coro_count++] = coro_new(test_mt_send_f, &senders[i]);
+		for (unsigned j = 0; j < ctx.message_count; ++j)
+			expected += ((unsigned)i << TEST_SENDER_SHIFT) + j;
+	}
+	for (int i = 0; i < receiver_count; ++i)
+		coros[coro_count++] = coro_new(test_mt_recv_f, &ctx);
+	coro_sched_run_mt(TEST_THREAD_COUNT);
+	for (int i = 0; i < coro_count; ++i)
+		unit_assert(coro_join(coros[i]) == NULL);
+
+	char data[CORO_BUS_MSG_SIZE_MAX];
+	unit_assert(coro_bus_try_recv_msg(ctx.bus, ctx.channel, data) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+	coro_bus_channel_close(ctx.bus, ctx.channel);
+	coro_bus_delete(ctx.bus);
+	return ctx.sum == expected && ctx.is_ordered;
+}
+
+static void
+test_mt(void)
+{
+	unit_test_start();
+
+	unit_check(test_mt_run(CORO_BUS_CHANNEL_MPMC, 16, TEST_SENDER_COUNT,
+		TEST_RECEIVER_COUNT, 0), "mpmc");
+	unit_check(test_mt_run(CORO_BUS_CHANNEL_MPMC, 5, TEST_SENDER_COUNT,
+		TEST_RECEIVER_COUNT, TEST_MT_BATCH), "mpmc batches, odd limit");
+	unit_check(test_mt_run(CORO_BUS_CHANNEL_MPMC, 1, TEST_SENDER_COUNT,
+		TEST_RECEIVER_COUNT, 0), "mpmc of one message");
+	unit_check(test_mt_run(CORO_BUS_CHANNEL_SPSC, 16, 1, 1, 0), "spsc");
+	unit_check(test_mt_run(CORO_BUS_CHANNEL_SPSC, 6, 1, 1, TEST_MT_BATCH),
+		"spsc batches");
+	unit_check(test_mt_run(CORO_BUS_CHANNEL_MPMC, 8, TEST_SENDER_COUNT,
+		TEST_RECEIVER_COUNT, TEST_MT_BATCH | TEST_MT_PTR),
+		"mpmc pointers");
+	unit_check(test_mt_run(CORO_BUS_CHANNEL_MPMC, 1, TEST_SENDER_COUNT,
+		TEST_RECEIVER_COUNT, TEST_MT_BATCH | TEST_MT_ADAPTIVE),
+		"mpmc adaptive");
+	unit_check(test_mt_run(CORO_BUS_CHANNEL_SPSC, 1, 1, 1,
+		TEST_MT_BATCH | TEST_MT_ADAPTIVE), "spsc adaptive");
+
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+struct test_close_ctx {
+	struct coro_bus *bus;
+	int channel;
+	int no_channel_count;
+};
+
+static void *
+test_close_recv_f(void *arg)
+{
+	struct test_close_ctx *ctx = (decltype(ctx))arg;
+	unsigned data;
+	if (coro_bus_recv(ctx->bus, ctx->channel, &data) != 0 &&
+	    coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL)
+		__atomic_add_fetch(&ctx->no_channel_count, 1, __ATOMIC_RELAXED);
+	return NULL;
+}
+
+static void *
+test_close_f(void *arg)
+{
+	struct test_close_ctx *ctx = (decltype(ctx))arg;
+	coro_sleep(0.01);
+	coro_bus_channel_close(ctx->bus, ctx->channel);
+	/* The waiters still leave the closed channel. */
+	int channel = coro_bus_channel_open(ctx->bus, 1);
+	unit_assert(channel == ctx->channel);
+	coro_bus_channel_close(ctx->bus, channel);
+	return NULL;
+}
+
+static void
+test_close(void)
+{
+	unit_test_start();
+
+	struct test_close_ctx ctx;
+	ctx.bus = coro_bus_new();
+	ctx.channel = coro_bus_channel_open(ctx.bus, 1);
+	ctx.no_channel_count = 0;
+	const int coro_count = 32;
+	struct coro *coros[coro_count + 1];
+	for (int i = 0; i < coro_count; ++i)
+		coros[i] = coro_new(test_close_recv_f, &ctx);
+	coros[coro_count] = coro_new(test_close_f, &ctx);
+	coro_sched_run_mt(TEST_THREAD_COUNT);
+	for (int i = 0; i <= coro_count; ++i)
+		unit_assert(coro_join(coros[i]) == NULL);
+	unit_check(ctx.no_channel_count == coro_count,
+		"close wakes up the waiters in all threads");
+	coro_bus_delete(ctx.bus);
+
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+enum {
+	TEST_ENGINE_ROUND_COUNT = 10000,
+	TEST_ENGINE_STOP = 0xffffffff,
+};
+
+struct test_engine_ctx {
+	struct coro_bus *bus;
+	int requests;
+	int replies;
+	coro_f func;
+	/** Set by the coroutine when it is done. */
+	bool is_ok;
+};
+
+static void *
+test_engine_ping_f(void *arg)
+{
+	struct test_engine_ctx *ctx = (decltype(ctx))arg;
+	bool ok = true;
+	for (unsigned i = 0; i < TEST_ENGINE_ROUND_COUNT; ++i) {
+		unsigned data = 0;
+		unit_assert(coro_bus_send(ctx->bus, ctx->requests, i) == 0);
+		unit_assert(coro_bus_recv(ctx->bus, ctx->replies, &data) == 0);
+		ok = ok && data == i + 1;
+	}
+	unit_assert(coro_bus_send(ctx->bus, ctx->requests,
+		TEST_ENGINE_STOP) == 0);
+	ctx->is_ok = ok;
+	return NULL;
+}
+
+static void *
+test_engine_pong_f(void *arg)
+{
+	struct test_engine_ctx *ctx = (decltype(ctx))arg;
+	while (true) {
+		unsigned data;
+		unit_assert(coro_bus_recv(ctx->bus, ctx->requests, &data) == 0);
+		if (data == TEST_ENGINE_STOP)
+			break;
+		unit_assert(coro_bus_send(ctx->bus, ctx->replies,
+			data + 1) == 0);
+	}
+	ctx->is_ok = true;
+	return NULL;
+}
+
+/** A thread with its own engine running one coroutine. */
+static void *
+test_engine_thread_f(void *arg)
+{
+	struct test_engine_ctx *ctx = (decltype(ctx))arg;
+	struct coro_engine *engine = coro_engine_new();
+	struct coro_attr attr;
+	coro_attr_create(&attr);
+	attr.engine = engine;
+	struct coro *c = coro_new_ex(ctx->func, ctx, &attr);
+	/*
+	 * The engine waits for the wakeups from the other thread
+	 * until the timeout.
+	 */
+	while (!ctx->is_ok)
+		coro_engine_run_for(engine, 0.1);
+	unit_assert(coro_join(c) == NULL);
+	coro_engine_delete(engine);
+	return NULL;
+}
+
+static void
+test_engines(void)
+{
+	unit_test_start();
+
+	struct coro_bus *bus = coro_bus_new();
+	struct test_engine_ctx ping, pong;
+	ping.bus = bus;
+	struct coro_bus_channel_attr attr;
+	coro_bus_channel_attr_create(&attr);
+	attr.mode = CORO_BUS_CHANNEL_SPSC;
+	ping.requests = coro_bus_channel_open_ex(bus, 4, &attr);
+	ping.replies = coro_bus_channel_open_ex(bus, 4, &attr);
+	ping.func = test_engine_ping_f;
+	ping.is_ok = false;
+	pong = ping;
+	pong.func = test_engine_pong_f;
+	pthread_t threads[2];
+	unit_assert(pthread_create(&threads[0], NULL, test_engine_thread_f,
+		&ping) == 0);
+	unit_assert(pthread_create(&threads[1], NULL, test_engine_thread_f,
+		&pong) == 0);
+	pthread_join(threads[0], NULL);
+	pthread_join(threads[1], NULL);
+	unit_check(ping.is_ok && pong.is_ok, "ping-pong of the engines");
+	coro_bus_channel_close(bus, ping.requests);
+	coro_bus_channel_close(bus, ping.replies);
+	coro_bus_delete(bus);
+
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+struct test_msg {
+	unsigned id;
+	char text[60];
+};
+
+static int test_msg_destroy_count = 0;
+
+static void
+test_msg_destroy_f(void *msg)
+{
+	free(*(void **)msg);
+	++test_msg_destroy_count;
+}
+
+static void *
+test_msg_f(void *arg)
+{
+	(void)arg;
+	struct coro_bus *bus = coro_bus_new();
+	struct coro_bus_channel_attr attr;
+	coro_bus_channel_attr_create(&attr);
+	attr.msg_size = CORO_BUS_MSG_SIZE_MAX + 1;
+	unit_check(coro_bus_channel_open_ex(bus, 1, &attr) == -1 &&
+		coro_bus_errno() == CORO_BUS_ERR_MSG_SIZE, "too big message");
+	unit_check(coro_bus_channel_open(bus, SIZE_MAX) == -1 &&
+		coro_bus_errno() == CORO_BUS_ERR_SIZE_LIMIT &&
+		coro_bus_channel_open(bus, ((size_t)1 << 63) + 1) == -1 &&
+		coro_bus_errno() == CORO_BUS_ERR_SIZE_LIMIT,
+		"too big size limit");
+	unit_check(coro_bus_channel_open(bus, (size_t)1 << 48) == -1 &&
+		coro_bus_errno() == CORO_BUS_ERR_SIZE_LIMIT,
+		"size limit out of memory");
+	coro_bus_channel_attr_create(&attr);
+	attr.size_limit_min = 4;
+	attr.size_limit_max = 2;
+	unit_check(coro_bus_channel_open_ex(bus, 1, &attr) == -1 &&
+		coro_bus_errno() == CORO_BUS_ERR_SIZE_LIMIT,
+		"adaptive min above the max");
+	attr.size_limit_min = 0;
+	attr.size_limit_max = SIZE_MAX;
+	unit_check(coro_bus_channel_open_ex(bus, 1, &attr) == -1 &&
+		coro_bus_errno() == CORO_BUS_ERR_SIZE_LIMIT,
+		"too big adaptive max");
+	attr.size_limit_max = 0;
+
+	/* The messages are stored inline. */
+	attr.msg_size = sizeof(struct test_msg);
+	int channel = coro_bus_channel_open_ex(bus, 2, &attr);
+	unit_assert(channel >= 0);
+	struct test_msg msgs[3];
+	for (unsigned i = 0; i < 3; ++i) {
+		msgs[i].id = i;
+		snprintf(msgs[i].text, sizeof(msgs[i].text), "message %u", i);
+	}
+	unit_check(coro_bus_try_send_msg_v(bus, channel, msgs, 3) == 2,
+		"inline messages up to the limit");
+	unit_check(coro_bus_try_send(bus, channel, 1) == -1 &&
+		coro_bus_errno() == CORO_BUS_ERR_MSG_SIZE,
+		"unsigned into a channel of other messages");
+	struct test_msg got[3];
+	unit_assert(coro_bus_recv_msg(bus, channel, &got[0]) == 0);
+	unit_assert(coro_bus_send_msg(bus, channel, &msgs[2]) == 0);
+	unit_assert(coro_bus_recv_msg_v(bus, channel, &got[1], 2) == 2);
+	bool ok = true;
+	for (unsigned i = 0; i < 3; ++i)
+		ok = ok && got[i].id == i && strcmp(got[i].text, msgs[i].text) == 0;
+	unit_check(ok, "inline messages are received");
+	coro_bus_channel_close(bus, channel);
+
+	/* The pointers hand the buffers over. */
+	coro_bus_channel_attr_create(&attr);
+	attr.msg_size = sizeof(void *);
+	attr.msg_destructor = test_msg_destroy_f;
+	channel = coro_bus_channel_open_ex(bus, 4, &attr);
+	for (int i = 0; i < 3; ++i) {
+		char *buf = strdup("buffer");
+		unit_assert(coro_bus_send_ptr(bus, channel, buf) == 0);
+	}
+	void *ptr;
+	unit_assert(coro_bus_recv_ptr(bus, channel, &ptr) == 0);
+	unit_check(strcmp((char *)ptr, "buffer") == 0, "pointer is received");
+	free(ptr);
+	unsigned data;
+	unit_check(coro_bus_try_recv(bus, channel, &data) == -1 &&
+		coro_bus_errno() == CORO_BUS_ERR_MSG_SIZE,
+		"unsigned from a channel of pointers");
+	coro_bus_channel_close(bus, channel);
+	unit_check(test_msg_destroy_count == 2,
+		"close destroys the pointers left");
+
+	channel = coro_bus_channel_open_ex(bus, 4, &attr);
+	unit_assert(coro_bus_send_ptr(bus, channel, strdup("buffer")) == 0);
+	int other = coro_bus_channel_open(bus, 1);
+	unit_check(coro_bus_broadcast(bus, 1) == 0 &&
+		coro_bus_try_recv(bus, other, &data) == 0 && data == 1,
+		"broadcast skips the channels of pointers");
+	coro_bus_delete(bus);
+	unit_check(test_msg_destroy_count == 3,
+		"bus delete destroys the pointers left");
+	return NULL;
+}
+
+static void
+test_msg(void)
+{
+	unit_test_start();
+
+	struct coro *c = coro_new(test_msg_f, NULL);
+	coro_sched_run();
+	unit_assert(coro_join(c) == NULL);
+
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+enum {
+	TEST_SELECT_CHANNEL_COUNT = 4,
+	TEST_SELECT_RECEIVER_COUNT = 2,
+	TEST_SELECT_MESSAGE_COUNT = 10000,
+};
+
+struct test_select_ctx {
+	struct coro_bus *bus;
+	int channels[TEST_SELECT_CHANNEL_COUNT];
+	unsigned long long sum;
+};
+
+struct test_select_sender {
+	struct test_select_ctx *ctx;
+	int channel;
+};
+
+static void *
+test_select_send_f(void *arg)
+{
+	struct test_select_sender *sender = (decltype(sender))arg;
+	for (unsigned i = 0; i < TEST_SELECT_MESSAGE_COUNT; ++i) {
+		unit_assert(coro_bus_send(sender->ctx->bus, sender->channel,
+			i) == 0);
+	}
+	return NULL;
+}
+
+/** One coroutine receives from all the channels. */
+static void *
+test_select_recv_f(void *arg)
+{
+	struct test_select_ctx *ctx = (decltype(ctx))arg;
+	unsigned data;
+	struct coro_bus_op ops[TEST_SELECT_CHANNEL_COUNT];
+	for (int i = 0; i < TEST_SELECT_CHANNEL_COUNT; ++i) {
+		ops[i].type = CORO_BUS_OP_RECV;
+		ops[i].channel = ctx->channels[i];
+		ops[i].msg = &data;
+	}
+	unsigned long long sum = 0;
+	const unsigned count = TEST_SELECT_MESSAGE_COUNT *
+		TEST_SELECT_CHANNEL_COUNT / TEST_SELECT_RECEIVER_COUNT;
+	for (unsigned i = 0; i < count; ++i) {
+		unit_assert(coro_bus_select(ctx->bus, ops,
+			TEST_SELECT_CHANNEL_COUNT) >= 0);
+		sum += data;
+	}
+	__atomic_add_fetch(&ctx->sum, sum, __ATOMIC_RELAXED);
+	return NULL;
+}
+
+struct test_select_helper {
+	struct coro_bus *bus;
+	int channel;
+	bool is_close;
+};
+
+/** Make a channel ready for the selecting coroutine, or close it. */
+static void *
+test_select_helper_f(void *arg)
+{
+	struct test_select_helper *helper = (decltype(helper))arg;
+	unsigned data;
+	coro_yield();
+	if (helper->is_close)
+		coro_bus_channel_close(helper->bus, helper->channel);
+	else if (coro_bus_try_recv(helper->bus, helper->channel, &data) != 0)
+		unit_assert(coro_bus_send(helper->bus, helper->channel, 7) == 0);
+	return NULL;
+}
+
+static int
+test_select_with_helper(struct coro_bus *bus, const struct coro_bus_op *ops,
+	unsigned count, int channel, bool is_close)
+{
+	struct test_select_helper helper;
+	helper.bus = bus;
+	helper.channel = channel;
+	helper.is_close = is_close;
+	struct coro *c = coro_new(test_select_helper_f, &helper);
+	int rc = coro_bus_select(bus, ops, count);
+	unit_assert(coro_join(c) == NULL);
+	return rc;
+}
+
+static void *
+test_select_f(void *arg)
+{
+	(void)arg;
+	struct coro_bus *bus = coro_bus_new();
+	int a = coro_bus_channel_open(bus, 1);
+	int b = coro_bus_channel_open(bus, 1);
+	int c = coro_bus_channel_open(bus, 1);
+	unit_assert(coro_bus_send(bus, c, 1) == 0);
+	unsigned recv_a = 0, recv_b = 0, send_c = 2;
+	struct coro_bus_op ops[3];
+	ops[0].type = CORO_BUS_OP_RECV;
+	ops[0].channel = a;
+	ops[0].msg = &recv_a;
+	ops[1].type = CORO_BUS_OP_RECV;
+	ops[1].channel = b;
+	ops[1].msg = &recv_b;
+	ops[2].type = CORO_BUS_OP_SEND;
+	ops[2].channel = c;
+	ops[2].msg = &send_c;
+	unit_check(coro_bus_try_select(bus, ops, 3) == -1 &&
+		coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK,
+		"try select when none is ready");
+	unit_check(test_select_with_helper(bus, ops, 3, b, false) == 1 &&
+		recv_b == 7, "select receive");
+	unit_check(test_select_with_helper(bus, ops, 3, c, false) == 2,
+		"select send");
+	unsigned data;
+	unit_check(coro_bus_try_recv(bus, c, &data) == 0 && data == 2,
+		"select sent the message");
+	unit_assert(coro_bus_send(bus, a, 3) == 0);
+	unit_assert(coro_bus_send(bus, b, 4) == 0);
+	unit_check(coro_bus_try_select(bus, ops, 3) == 0 && recv_a == 3,
+		"the first ready one is done");
+	unit_check(coro_bus_try_recv(bus, b, &data) == 0 && data == 4,
+		"only one is done");
+	unit_check(test_select_with_helper(bus, ops, 2, a, true) == -1 &&
+		coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL,
+		"close wakes up the select");
+	unit_check(coro_bus_try_select(bus, ops, 3) == -1 &&
+		coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL,
+		"select with a missing channel");
+	coro_bus_delete(bus);
+	return NULL;
+}
+
+static void
+test_select(void)
+{
+	unit_test_start();
+
+	struct coro *c = coro_new(test_select_f, NULL);
+	coro_sched_run();
+	unit_assert(coro_join(c) == NULL);
+
+	struct test_select_ctx ctx;
+	ctx.bus = coro_bus_new();
+	ctx.sum = 0;
+	struct test_select_sender senders[TEST_SELECT_CHANNEL_COUNT];
+	struct coro *coros[TEST_SELECT_CHANNEL_COUNT +
+		TEST_SELECT_RECEIVER_COUNT];
+	int coro_count = 0;
+	for (int i = 0; i < TEST_SELECT_CHANNEL_COUNT; ++i) {
+		ctx.channels[i] = coro_bus_channel_open(ctx.bus, 2);
+		senders[i].ctx = &ctx;
+		senders[i].channel = ctx.channels[i];
+		coros[coro_count++] = coro_new(test_select_send_f, &senders[i]);
+	}
+	for (int i = 0; i < TEST_SELECT_RECEIVER_COUNT; ++i)
+		coros[coro_count++] = coro_new(test_select_recv_f, &ctx);
+	coro_sched_run_mt(TEST_THREAD_COUNT);
+	for (int i = 0; i < coro_count; ++i)
+		unit_assert(coro_join(coros[i]) == NULL);
+	unsigned long long expected = TEST_SELECT_CHANNEL_COUNT *
+		(unsigned long long)TEST_SELECT_MESSAGE_COUNT *
+		(TEST_SELECT_MESSAGE_COUNT - 1) / 2;
+	unit_check(ctx.sum == expected, "fan-in of many channels in threads");
+	coro_bus_delete(ctx.bus);
+
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+enum {
+	TEST_TOPIC_SUB_COUNT = 4,
+	TEST_TOPIC_MESSAGE_COUNT = 20000,
+};
+
+static void *
+test_topic_policy_f(void *arg)
+{
+	(void)arg;
+	unsigned data;
+	struct coro_bus_topic_attr attr;
+	coro_bus_topic_attr_create(&attr);
+	unit_check(coro_bus_topic_new(0, &attr) == NULL &&
+		coro_bus_errno() == CORO_BUS_ERR_SIZE_LIMIT,
+		"topic of zero size limit");
+	unit_check(coro_bus_topic_new((size_t)1 << 48, &attr) == NULL &&
+		coro_bus_errno() == CORO_BUS_ERR_SIZE_LIMIT,
+		"topic out of memory");
+	struct coro_bus_topic *topic = coro_bus_topic_new(2, &attr);
+	struct coro_bus_sub *fast = coro_bus_subscribe(topic);
+	struct coro_bus_sub *slow = coro_bus_subscribe(topic);
+	for (unsigned i = 0; i < 2; ++i)
+		unit_assert(coro_bus_try_publish(topic, &i) == 0);
+	unit_assert(coro_bus_sub_recv(fast, &data) == 0 && data == 0);
+	unit_assert(coro_bus_sub_recv(fast, &data) == 0 && data == 1);
+	data = 2;
+	unit_check(coro_bus_try_publish(topic, &data) == -1 &&
+		coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK,
+		"block: the slowest subscriber holds the publisher");
+	unit_assert(coro_bus_sub_recv(slow, &data) == 0 && data == 0);
+	data = 2;
+	unit_check(coro_bus_try_publish(topic, &data) == 0,
+		"block: publish when the slowest one catches up");
+	unit_assert(coro_bus_sub_recv(slow, &data) == 0 && data == 1);
+	unit_assert(coro_bus_sub_recv(slow, &data) == 0 && data == 2);
+	unit_assert(coro_bus_sub_recv(fast, &data) == 0 && data == 2);
+	unit_check(coro_bus_sub_try_recv(fast, &data) == -1 &&
+		coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK, "no new messages");
+	coro_bus_unsubscribe(fast);
+	coro_bus_unsubscribe(slow);
+	coro_bus_topic_delete(topic);
+
+	attr.policy = CORO_BUS_TOPIC_DROP_OLDEST;
+	topic = coro_bus_topic_new(2, &attr);
+	struct coro_bus_sub *sub = coro_bus_subscribe(topic);
+	for (unsigned i = 0; i < 5; ++i)
+		unit_assert(coro_bus_try_publish(topic, &i) == 0);
+	unit_check(coro_bus_sub_recv(sub, &data) == 0 && data == 3 &&
+		coro_bus_sub_recv(sub, &data) == 0 && data == 4,
+		"drop oldest: a slow subscriber skips the lost messages");
+	coro_bus_unsubscribe(sub);
+	coro_bus_topic_delete(topic);
+
+	attr.policy = CORO_BUS_TOPIC_DISCONNECT;
+	topic = coro_bus_topic_new(2, &attr);
+	slow = coro_bus_subscribe(topic);
+	data = 0;
+	unit_assert(coro_bus_try_publish(topic, &data) == 0);
+	fast = coro_bus_subscribe(topic);
+	for (unsigned i = 1; i < 3; ++i)
+		unit_assert(coro_bus_try_publish(topic, &i) == 0);
+	unit_check(coro_bus_sub_recv(slow, &data) == -1 &&
+		coro_bus_errno() == CORO_BUS_ERR_DISCONNECTED,
+		"disconnect: a slow subscriber is disconnected");
+	unit_check(coro_bus_sub_recv(fast, &data) == 0 && data == 1 &&
+		coro_bus_sub_recv(fast, &data) == 0 && data == 2,
+		"disconnect: the others go on");
+	coro_bus_unsubscribe(fast);
+	coro_bus_unsubscribe(slow);
+	coro_bus_topic_delete(topic);
+	return NULL;
+}
+
+struct test_topic_ctx {
+	struct coro_bus_topic *topic;
+	struct coro_bus_sub *subs[TEST_TOPIC_SUB_COUNT];
+	/** How many subscribers got all the messages in order. */
+	int ok_count;
+};
+
+static void *
+test_topic_publish_f(void *arg)
+{
+	struct test_topic_ctx *ctx = (decltype(ctx))arg;
+	for (unsigned i = 0; i < TEST_TOPIC_MESSAGE_COUNT; ++i)
+		unit_assert(coro_bus_publish(ctx->topic, &i) == 0);
+	return NULL;
+}
+
+static void *
+test_topic_recv_f(void *arg)
+{
+	struct coro_bus_sub *sub = (decltype(sub))arg;
+	bool ok = true;
+	for (unsigned i = 0; i < TEST_TOPIC_MESSAGE_COUNT; ++i) {
+		unsigned data;
+		unit_assert(coro_bus_sub_recv(sub, &data) == 0);
+		ok = ok && data == i;
+	}
+	return (void *)(intptr_t)ok;
+}
+
+static void
+test_topic(void)
+{
+	unit_test_start();
+
+	struct coro *c = coro_new(test_topic_policy_f, NULL);
+	coro_sched_run();
+	unit_assert(coro_join(c) == NULL);
+
+	struct test_topic_ctx ctx;
+	ctx.topic = coro_bus_topic_new(8, NULL);
+	ctx.ok_count = 0;
+	struct coro *coros[TEST_TOPIC_SUB_COUNT];
+	for (int i = 0; i < TEST_TOPIC_SUB_COUNT; ++i) {
+		ctx.subs[i] = coro_bus_subscribe(ctx.topic);
+		coros[i] = coro_new(test_topic_recv_f, ctx.subs[i]);
+	}
+	struct coro *publisher = coro_new(test_topic_publish_f, &ctx);
+	coro_sched_run_mt(TEST_THREAD_COUNT);
+	unit_assert(coro_join(publisher) == NULL);
+	for (int i = 0; i < TEST_TOPIC_SUB_COUNT; ++i) {
+		ctx.ok_count += coro_join(coros[i]) != NULL;
+		coro_bus_unsubscribe(ctx.subs[i]);
+	}
+	unit_check(ctx.ok_count == TEST_TOPIC_SUB_COUNT,
+		"each subscriber gets all the messages in threads");
+	coro_bus_topic_delete(ctx.topic);
+
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+struct test_stats_ctx {
+	struct coro_bus *bus;
+	int channel;
+};
+
+static void *
+test_stats_recv_f(void *arg)
+{
+	struct test_stats_ctx *ctx = (decltype(ctx))arg;
+	unsigned data;
+	unit_assert(coro_bus_recv(ctx->bus, ctx->channel, &data) == 0);
+	return NULL;
+}
+
+static void *
+test_stats_f(void *arg)
+{
+	(void)arg;
+	struct coro_bus *bus = coro_bus_new();
+	struct coro_bus_channel_stats stats;
+	unit_check(coro_bus_channel_stats(bus, 0, &stats) == -1 &&
+		coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL,
+		"stats of a missing channel");
+	int channel = coro_bus_channel_open(bus, 4);
+	unsigned data[3] = {1, 2, 3};
+	unit_assert(coro_bus_send_v(bus, channel, data, 3) == 3);
+	unit_assert(coro_bus_recv_v(bus, channel, data, 2) == 2);
+	unit_assert(coro_bus_channel_stats(bus, channel, &stats) == 0);
+	unit_check(stats.send_count == 3 && stats.recv_count == 2 &&
+		stats.peak_size == 3 && stats.size_limit == 4,
+		"message counters");
+	unit_check(stats.send_wait_ns == 0 && stats.recv_wait_ns == 0,
+		"no waits");
+	unit_assert(coro_bus_recv_v(bus, channel, data, 1) == 1);
+
+	struct test_stats_ctx ctx;
+	ctx.bus = bus;
+	ctx.channel = channel;
+	struct coro *c = coro_new(test_stats_recv_f, &ctx);
+	coro_sleep(0.01);
+	unit_assert(coro_bus_send(bus, channel, 1) == 0);
+	unit_assert(coro_join(c) == NULL);
+	unit_assert(coro_bus_channel_stats(bus, channel, &stats) == 0);
+	unit_check(stats.recv_wait_ns >= 5000000 && stats.send_wait_ns == 0,
+		"receive wait time");
+	coro_bus_channel_close(bus, channel);
+
+	struct coro_bus_channel_attr attr;
+	coro_bus_channel_attr_create(&attr);
+	attr.size_limit_min = 2;
+	attr.size_limit_max = 16;
+	channel = coro_bus_channel_open_ex(bus, 2, &attr);
+	unsigned sent = 0;
+	while (coro_bus_try_send(bus, channel, sent) == 0)
+		++sent;
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+	unit_assert(coro_bus_channel_stats(bus, channel, &stats) == 0);
+	unit_check(sent == 16 && stats.size_limit == 16,
+		"adaptive limit grows up to the max on full channel");
+	unsigned value;
+	for (unsigned i = 0; i < sent; ++i)
+		unit_assert(coro_bus_try_recv(bus, channel, &value) == 0);
+	const size_t limits[] = {16, 8, 4, 2, 2};
+	bool ok = true;
+	for (size_t limit : limits) {
+		unit_assert(coro_bus_try_recv(bus, channel, &value) == -1);
+		unit_assert(coro_bus_channel_stats(bus, channel, &stats) == 0);
+		ok = ok && stats.size_limit == limit;
+	}
+	unit_check(ok, "adaptive limit shrinks down to the min when unused");
+	unit_check(stats.peak_size == 16, "peak is kept");
+	coro_bus_delete(bus);
+	return NULL;
+}
+
+static void
+test_stats(void)
+{
+	unit_test_start();
+
+	struct coro *c = coro_new(test_stats_f, NULL);
+	coro_sched_run();
+	unit_assert(coro_join(c) == NULL);
+
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+struct test_timeout_ctx {
+	struct coro_bus *bus;
+	int channel;
+	double timeout;
+	int rc;
+	enum coro_bus_error_code err;
+	unsigned data;
+};
+
+static void *
+test_timeout_recv_f(void *arg)
+{
+	struct test_timeout_ctx *ctx = (decltype(ctx))arg;
+	ctx->rc = coro_bus_recv_timeout(ctx->bus, ctx->channel, &ctx->data,
+		ctx->timeout);
+	ctx->err = coro_bus_errno();
+	return NULL;
+}
+
+static uint64_t
+test_timeout_now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void *
+test_timeout_f(void *arg)
+{
+	(void)arg;
+	struct coro_bus *bus = coro_bus_new();
+	unsigned value;
+	unit_check(coro_bus_recv_timeout(bus, 0, &value, 0.01) == -1 &&
+		coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL,
+		"timeout on a missing channel");
+	int channel = coro_bus_channel_open(bus, 2);
+
+	uint64_t start_ms = test_timeout_now_ms();
+	unit_check(coro_bus_recv_timeout(bus, channel, &value, 0.02) == -1 &&
+		coro_bus_errno() == CORO_BUS_ERR_TIMEOUT,
+		"recv times out on an empty channel");
+	unit_check(test_timeout_now_ms() - start_ms >= 20,
+		"the timeout is not early");
+	unit_check(coro_bus_recv_timeout(bus, channel, &value, 0) == -1 &&
+		coro_bus_errno() == CORO_BUS_ERR_TIMEOUT, "zero timeout");
+
+	unsigned data[3] = {1, 2, 3};
+	unit_assert(coro_bus_send_v_timeout(bus, channel, data, 3, 0.01) == 2);
+	unit_check(coro_bus_send_timeout(bus, channel, 4, 0.01) == -1 &&
+		coro_bus_errno() == CORO_BUS_ERR_TIMEOUT,
+		"send times out on a full channel");
+	unit_check(coro_bus_send_v_timeout(bus, channel, data, 3, 0) == -1 &&
+		coro_bus_errno() == CORO_BUS_ERR_TIMEOUT,
+		"vector send times out");
+	unit_check(coro_bus_recv_timeout(bus, channel, &value, 0) == 0 &&
+		value == 1, "zero timeout doesn't matter when ready");
+	unit_check(coro_bus_recv_v_timeout(bus, channel, data, 3, 0.01) == 1 &&
+		data[0] == 2, "vector recv");
+
+	/*
+	 * The first receiver times out and must leave the queue. Then
+	 * the second one is the only waiter, and gets the message.
+	 */
+	struct test_timeout_ctx ctx1;
+	ctx1.bus = bus;
+	ctx1.channel = channel;
+	ctx1.timeout = 0.01;
+	struct test_timeout_ctx ctx2 = ctx1;
+	ctx2.timeout = -1;
+	struct coro *c1 = coro_new(test_timeout_recv_f, &ctx1);
+	struct coro *c2 = coro_new(test_timeout_recv_f, &ctx2);
+	coro_sleep(0.03);
+	unit_assert(coro_join(c1) == NULL);
+	unit_check(ctx1.rc == -1 && ctx1.err == CORO_BUS_ERR_TIMEOUT,
+		"a waiter times out");
+	unit_assert(coro_bus_send(bus, channel, 5) == 0);
+	unit_assert(coro_join(c2) == NULL);
+	unit_check(ctx2.rc == 0 && ctx2.data == 5,
+		"the next waiter gets the message");
+
+	/* A message before the deadline is received. */
+	ctx1.timeout = 10;
+	c1 = coro_new(test_timeout_recv_f, &ctx1);
+	coro_sleep(0.01);
+	start_ms = test_timeout_now_ms();
+	unit_assert(coro_bus_send(bus, channel, 6) == 0);
+	unit_assert(coro_join(c1) == NULL);
+	unit_check(ctx1.rc == 0 && ctx1.data == 6 &&
+		test_timeout_now_ms() - start_ms < 1000,
+		"recv before the deadline");
+
+	/* Close wakes up the waiter before its deadline. */
+	c1 = coro_new(test_timeout_recv_f, &ctx1);
+	coro_sleep(0.01);
+	coro_bus_channel_close(bus, channel);
+	unit_assert(coro_join(c1) == NULL);
+	unit_check(ctx1.rc == -1 && ctx1.err == CORO_BUS_ERR_NO_CHANNEL,
+		"close during a wait with a timeout");
+
+	struct coro_bus_channel_attr attr;
+	coro_bus_channel_attr_create(&attr);
+	attr.msg_size = 16;
+	channel = coro_bus_channel_open_ex(bus, 1, &attr);
+	char msg[16] = "message";
+	unit_assert(coro_bus_send_msg_timeout(bus, channel, msg, 0) == 0);
+	unit_check(coro_bus_send_msg_timeout(bus, channel, msg, 0.01) == -1 &&
+		coro_bus_errno() == CORO_BUS_ERR_TIMEOUT, "msg send timeout");
+	char out[16];
+	unit_check(coro_bus_recv_msg_v_timeout(bus, channel, out, 1, 0.01) ==
+		1 && strcmp(out, msg) == 0, "msg vector recv");
+	unit_check(coro_bus_recv_msg_timeout(bus, channel, out, 0.01) == -1 &&
+		coro_bus_errno() == CORO_BUS_ERR_TIMEOUT, "msg recv timeout");
+	coro_bus_delete(bus);
+	return NULL;
+}
+
+static void
+test_timeout(void)
+{
+	unit_test_start();
+
+	struct coro *c = coro_new(test_timeout_f, NULL);
+	coro_sched_run();
+	unit_assert(coro_join(c) == NULL);
+
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+int
+main(void)
+{
+	coro_sched_init();
+	test_mt();
+	test_close();
+	test_engines();
+	test_msg();
+	test_select();
+	test_topic();
+	test_stats();
+	test_timeout();
+	coro_sched_destroy();
+	return 0;
+}
@@ -11,241 +11,286 @@
 #include <errno.h>
 #include <stdint.h>
 #include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+#define LIBCORO_USE_EPOLL 1
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#else
+#define LIBCORO_USE_EPOLL 0
+#endif
+
+#ifndef LIBCORO_STATS
+#define LIBCORO_STATS 0
+#endif
+
+/*
+ * The coroutine context switch has two backends. The default one
+ * is a hand-written register swap for the architectures listed
+ * below. The portable one creates the coroutine stacks via
+ * sigaltstack() and switches between them with sigsetjmp() and
+ * siglongjmp(). It is much slower, but works on any POSIX system.
+ */
+#ifndef LIBCORO_CTX_PORTABLE
+#if defined(__x86_64__) || defined(__aarch64__)
+#define LIBCORO_CTX_PORTABLE 0
+#else
+#define LIBCORO_CTX_PORTABLE 1
+#endif
+#endif
+
+/*
+ * The suspensions are backtraced in the debug mode. Not with the
+ * portable context, whose coroutine stacks start in a signal frame
+ * pointing at a stack long gone.
+ */
+#if (defined(__GLIBC__) || defined(__APPLE__)) && !LIBCORO_CTX_PORTABLE
+#define LIBCORO_USE_BACKTRACE 1
+#include <execinfo.h>
+#else
+#define LIBCORO_USE_BACKTRACE 0
+#endif
 
 #define handle_error() do {														\
 	printf("Error %s\n", strerror(errno));										\
 	exit(-1);																	\
 } while(0)
 
-enum coro_state {
-	CORO_STATE_RUNNING,
-	CORO_STATE_SUSPENDED,
-	CORO_STATE_FINISHED,
-};
+typedef void (*coro_ctx_f)(void *);
 
-/** Main coroutine structure, its context. */
-struct coro {
-	/** Coroutine state. */
-	enum coro_state state;
-	/** A value, returned by func. */
-	void *ret;
-	/** Stack, used by the coroutine. */
-	uint8_t *stack;
-	/** An argument for the function func. */
-	void *func_arg;
-	/** A function to call as a coroutine. */
-	coro_f func;
-	/** Last remembered coroutine context. */
-	sigjmp_buf ctx;
-	/**
-	 * Coroutine which is trying to join this one right now.
-	 */
-	struct coro *joiner;
-	/** Links in a coroutine list, used by the scheduler. */
-	struct rlist link;
-};
+#if !LIBCORO_CTX_PORTABLE
 
-struct coro_engine {
-	/**
-	 * Scheduler is the main coroutine - it represents the
-	 * context in which the scheduler itself runs.
-	 */
-	struct coro sched;
-	/** Which coroutine works at this moment. */
-	struct coro *this_coro;
+#if defined(__APPLE__)
+#define CORO_ASM_SYM(name) "_" #name
+#define CORO_ASM_FUNC_BEGIN(name)					\
+	".globl " CORO_ASM_SYM(name) "\n"				\
+	".private_extern " CORO_ASM_SYM(name) "\n"			\
+	".p2align 4\n"							\
+	CORO_ASM_SYM(name) ":\n"
+#define CORO_ASM_FUNC_END(name) ""
+#else
+#define CORO_ASM_SYM(name) #name
+#define CORO_ASM_FUNC_BEGIN(name)					\
+	".globl " CORO_ASM_SYM(name) "\n"				\
+	".hidden " CORO_ASM_SYM(name) "\n"				\
+	".type " CORO_ASM_SYM(name) ", %function\n"			\
+	".p2align 4\n"							\
+	CORO_ASM_SYM(name) ":\n"
+#define CORO_ASM_FUNC_END(name)						\
+	".size " CORO_ASM_SYM(name) ", .-" CORO_ASM_SYM(name) "\n"
+#endif
 
+/** Coroutine context - its stack pointer with the registers. */
+struct coro_ctx {
 	/**
-	 * Coroutines to run in this iteration of the loop. The
-	 * list gets populated once at the start of the iteration.
-	 */
-	struct rlist coros_running_now;
-	/**
-	 * Coroutines to run in the next iteration of the loop.
-	 * The list gets populated by wakeups and yields and new
-	 * coros.
+	 * The callee-saved registers are pushed onto the coroutine
+	 * stack right before the switch, so only the stack
+	 * pointer is left to remember.
 	 */
-	struct rlist coros_running_next;
-	/** Joined coroutines to be reused. */
-	struct rlist coros_pool;
-	/** Total number of coroutines, including the pool. */
-	size_t coro_count;
-	/**
-	 * Buffer, used by the coroutine constructor to escape
-	 * from the signal handler back into the constructor to
-	 * rollback sigaltstack etc.
-	 */
-	sigjmp_buf start_point;
+	void *sp;
 };
 
-static void
-coro_engine_create(struct coro_engine *engine)
-{
-	memset(engine, 0, sizeof(*engine));
-	rlist_create(&engine->sched.link);
-	rlist_create(&engine->coros_running_now);
-	rlist_create(&engine->coros_running_next);
-	rlist_create(&engine->coros_pool);
+extern "C" {
+/**
+ * Save the callee-saved registers on the current stack, store
+ * the stack pointer into @a from_sp, switch to @a to_sp and
+ * restore the registers from there.
+ */
+void
+coro_ctx_switch_asm(void **from_sp, void *to_sp);
+
+/**
+ * The first code executed on a new stack. Calls the function
+ * stored by coro_ctx_create() with its argument. The function
+ * must never return.
+ */
+void
+coro_ctx_start_asm(void);
 }
 
-static void
-coro_engine_resume_next(struct coro_engine *engine)
-{
-	assert(!rlist_empty(&engine->coros_running_now));
-	struct coro *to = rlist_shift_entry(&engine->coros_running_now,
-		struct coro, link);
-	struct coro *from = engine->this_coro;
-	assert(from != NULL);
+#if defined(__x86_64__)
 
-	engine->this_coro = NULL;
-	if (sigsetjmp(from->ctx, 0) == 0)
-		siglongjmp(to->ctx, 1);
-	assert(rlist_empty(&from->link));
-	assert(engine->this_coro == NULL);
-	engine->this_coro = from;
-}
+__asm__(
+	".text\n"
+	CORO_ASM_FUNC_BEGIN(coro_ctx_switch_asm)
+	"	pushq %rbp\n"
+	"	pushq %rbx\n"
+	"	pushq %r12\n"
+	"	pushq %r13\n"
+	"	pushq %r14\n"
+	"	pushq %r15\n"
+	"	subq $8, %rsp\n"
+	"	stmxcsr (%rsp)\n"
+	"	fnstcw 4(%rsp)\n"
+	"	movq %rsp, (%rdi)\n"
+	"	movq %rsi, %rsp\n"
+	"	ldmxcsr (%rsp)\n"
+	"	fldcw 4(%rsp)\n"
+	"	addq $8, %rsp\n"
+	"	popq %r15\n"
+	"	popq %r14\n"
+	"	popq %r13\n"
+	"	popq %r12\n"
+	"	popq %rbx\n"
+	"	popq %rbp\n"
+	"	ret\n"
+	CORO_ASM_FUNC_END(coro_ctx_switch_asm)
+	CORO_ASM_FUNC_BEGIN(coro_ctx_start_asm)
+	"	movq %r12, %rdi\n"
+	"	callq *%r13\n"
+	"	ud2\n"
+	CORO_ASM_FUNC_END(coro_ctx_start_asm)
+);
+
+/** FPU control word and MXCSR with their default values. */
+static const uint64_t coro_ctx_fpu_default = 0x037FULL << 32 | 0x1F80;
 
 static void
-coro_engine_suspend(struct coro_engine *engine)
+coro_ctx_create(struct coro_ctx *ctx, uint8_t *stack, size_t stack_size,
+	coro_ctx_f func, void *arg)
 {
-	struct coro *this_coro = engine->this_coro;
-	if (this_coro == NULL) {
-		printf("Error: deadlock - suspension with no active "
-			"coroutines\n");
-		exit(-1);
-	}
-	assert(rlist_empty(&this_coro->link));
-	assert(this_coro->state == CORO_STATE_RUNNING);
-	this_coro->state = CORO_STATE_SUSPENDED;
-	coro_engine_resume_next(engine);
+	uintptr_t top = (uintptr_t)(stack + stack_size) & ~(uintptr_t)15;
+	/*
+	 * The frame is what coro_ctx_switch_asm() expects to pop:
+	 * FPU state, r15, r14, r13, r12, rbx, rbp, return address.
+	 * Plus 16 bytes on top, so the stack is aligned by 16 at
+	 * the call in coro_ctx_start_asm().
+	 */
+	uint64_t *frame = (uint64_t *)(top - 80);
+	memset(frame, 0, 80);
+	frame[0] = coro_ctx_fpu_default;
+	frame[3] = (uint64_t)(uintptr_t)func;
+	frame[4] = (uint64_t)(uintptr_t)arg;
+	frame[7] = (uint64_t)(uintptr_t)coro_ctx_start_asm;
+	ctx->sp = frame;
 }
 
+#elif defined(__aarch64__)
+
+__asm__(
+	".text\n"
+	CORO_ASM_FUNC_BEGIN(coro_ctx_switch_asm)
+	"	sub sp, sp, #160\n"
+	"	stp x19, x20, [sp, #0]\n"
+	"	stp x21, x22, [sp, #16]\n"
+	"	stp x23, x24, [sp, #32]\n"
+	"	stp x25, x26, [sp, #48]\n"
+	"	stp x27, x28, [sp, #64]\n"
+	"	stp x29, x30, [sp, #80]\n"
+	"	stp d8, d9, [sp, #96]\n"
+	"	stp d10, d11, [sp, #112]\n"
+	"	stp d12, d13, [sp, #128]\n"
+	"	stp d14, d15, [sp, #144]\n"
+	"	mov x9, sp\n"
+	"	str x9, [x0]\n"
+	"	mov sp, x1\n"
+	"	ldp x19, x20, [sp, #0]\n"
+	"	ldp x21, x22, [sp, #16]\n"
+	"	ldp x23, x24, [sp, #32]\n"
+	"	ldp x25, x26, [sp, #48]\n"
+	"	ldp x27, x28, [sp, #64]\n"
+	"	ldp x29, x30, [sp, #80]\n"
+	"	ldp d8, d9, [sp, #96]\n"
+	"	ldp d10, d11, [sp, #112]\n"
+	"	ldp d12, d13, [sp, #128]\n"
+	"	ldp d14, d15, [sp, #144]\n"
+	"	add sp, sp, #160\n"
+	"	ret\n"
+	CORO_ASM_FUNC_END(coro_ctx_switch_asm)
+	CORO_ASM_FUNC_BEGIN(coro_ctx_start_asm)
+	"	mov x0, x19\n"
+	"	blr x20\n"
+	"	brk #0\n"
+	CORO_ASM_FUNC_END(coro_ctx_start_asm)
+);
+
 static void
-coro_engine_yield(struct coro_engine *engine)
+coro_ctx_create(struct coro_ctx *ctx, uint8_t *stack, size_t stack_size,
+	coro_ctx_f func, void *arg)
 {
-	struct coro *this_coro = engine->this_coro;
-	assert(rlist_empty(&this_coro->link));
-	assert(this_coro->state == CORO_STATE_RUNNING);
-	rlist_add_tail_entry(&engine->coros_running_next, this_coro, link);
-	coro_engine_resume_next(engine);
+	uintptr_t top = (uintptr_t)(stack + stack_size) & ~(uintptr_t)15;
+	/*
+	 * The frame is what coro_ctx_switch_asm() expects to pop:
+	 * x19-x28, x29, x30 (return address), d8-d15.
+	 */
+	uint64_t *frame = (uint64_t *)(top - 160);
+	memset(frame, 0, 160);
+	frame[0] = (uint64_t)(uintptr_t)arg;
+	frame[1] = (uint64_t)(uintptr_t)func;
+	frame[11] = (uint64_t)(uintptr_t)coro_ctx_start_asm;
+	ctx->sp = frame;
 }
 
-static void
-coro_engine_wakeup(struct coro_engine *engine, struct coro *coro)
+#endif
+
+static inline void
+coro_ctx_switch(struct coro_ctx *from, struct coro_ctx *to)
 {
-	if (coro->state == CORO_STATE_RUNNING)
-		return;
-	if (coro->state == CORO_STATE_FINISHED)
-		return;
-	assert(coro->state == CORO_STATE_SUSPENDED);
-	assert(rlist_empty(&coro->link));
-	coro->state = CORO_STATE_RUNNING;
-	rlist_add_tail_entry(&engine->coros_running_next, coro, link);
+	coro_ctx_switch_asm(&from->sp, to->sp);
 }
 
-static void
-coro_engine_run(struct coro_engine *engine)
-{
-	while (true) {
-		assert(rlist_empty(&engine->coros_running_now));
-		rlist_splice_tail(&engine->coros_running_now,
-			&engine->coros_running_next);
-		if (rlist_empty(&engine->coros_running_now))
-			break;
+#else /* LIBCORO_CTX_PORTABLE */
 
-		assert(engine->this_coro == NULL);
-		engine->this_coro = &engine->sched;
-		assert(rlist_empty(&engine->sched.link));
-		/*
-		 * Add the scheduler to the tail so the control
-		 * comes back in the end of this iteration of the
-		 * loop.
-		 */
-		rlist_add_tail_entry(&engine->coros_running_now,
-			&engine->sched, link);
-		coro_engine_resume_next(engine);
-		assert(rlist_empty(&engine->coros_running_now));
-		assert(engine->this_coro == &engine->sched);
-		engine->this_coro = NULL;
-	}
-}
+/** Coroutine context - a remembered point to jump to. */
+struct coro_ctx {
+	sigjmp_buf buf;
+};
 
-static void
-coro_engine_destroy(struct coro_engine *engine)
-{
-	assert(engine->this_coro == NULL);
-	assert(rlist_empty(&engine->coros_running_now));
-	assert(rlist_empty(&engine->coros_running_next));
-	while (!rlist_empty(&engine->coros_pool)) {
-		struct coro *c = rlist_shift_entry(&engine->coros_pool,
-			struct coro, link);
-		delete[] c->stack;
-		delete c;
-		assert(engine->coro_count > 0);
-		--engine->coro_count;
-	}
-	assert(engine->coro_count == 0);
-	memset(engine, '#', sizeof(*engine));
-}
+/** Arguments of a coroutine context being created. */
+struct coro_ctx_start {
+	/** Context to fill. */
+	struct coro_ctx *ctx;
+	/** Function to call on the first switch to the context. */
+	coro_ctx_f func;
+	/** Argument for the function. */
+	void *arg;
+	/**
+	 * Buffer, used by the context constructor to escape from
+	 * the signal handler back into the constructor to
+	 * rollback sigaltstack etc.
+	 */
+	sigjmp_buf start_point;
+};
 
-static __thread struct coro_engine *new_coro_engine = NULL;
+static __thread struct coro_ctx_start *new_coro_ctx = NULL;
 
 /**
- * The core part of the coroutines creation - this signal handler
+ * The core part of the context creation - this signal handler
  * runs on a separate stack using sigaltstack. At invocation it
- * remembers its current context and jumps back to the coroutine
+ * remembers its current context and jumps back to the context
  * constructor. Later the coroutine continues from here.
  */
 static void
-coro_body(int signum)
+coro_ctx_start_portable(int signum)
 {
 	(void)signum;
-	struct coro_engine *my_engine = new_coro_engine;
-	new_coro_engine = NULL;
-
-	struct coro *c = my_engine->this_coro;
-	my_engine->this_coro = NULL;
+	struct coro_ctx_start *start = new_coro_ctx;
+	new_coro_ctx = NULL;
+	coro_ctx_f func = start->func;
+	void *arg = start->arg;
 	/*
 	 * On invocation jump back to the constructor right after
 	 * remembering the context.
 	 */
-	if (sigsetjmp(c->ctx, 0) == 0)
-		siglongjmp(my_engine->start_point, 1);
+	if (sigsetjmp(start->ctx->buf, 0) == 0)
+		siglongjmp(start->start_point, 1);
 	/*
 	 * If the execution is here, then the coroutine should
 	 * finally start work.
 	 */
-	my_engine->this_coro = c;
-	while (true) {
-		c->ret = c->func(c->func_arg);
-		c->func = NULL;
-		assert(c->state == CORO_STATE_RUNNING);
-		c->state = CORO_STATE_FINISHED;
-		if (c->joiner != NULL)
-			coro_engine_wakeup(my_engine, c->joiner);
-		coro_engine_resume_next(my_engine);
-		/*
-		 * Here it is restarted already, must have its
-		 * state restored.
-		 */
-		assert(c->state == CORO_STATE_RUNNING);
-		assert(c->func != NULL);
-	}
+	func(arg);
+	abort();
 }
 
-static struct coro *
-coro_engine_spawn_new(struct coro_engine *engine, coro_f func, void *func_arg)
+static void
+coro_ctx_create(struct coro_ctx *ctx, uint8_t *stack, size_t stack_size,
+	coro_ctx_f func, void *arg)
 {
-	struct coro *c = new coro();
-	c->state = CORO_STATE_RUNNING;
-	c->ret = NULL;
-	int stack_size = 1024 * 1024;
-	if (stack_size < SIGSTKSZ)
-		stack_size = SIGSTKSZ;
-	c->stack = new uint8_t[stack_size];
-	c->func = func;
-	c->func_arg = func_arg;
-	c->joiner = NULL;
-	rlist_create(&c->link);
 	/*
 	 * SIGUSR2 is used. First of all, block new signals to be
 	 * able to set a new handler.
@@ -261,37 +306,38 @@ coro_engine_spawn_new(struct coro_engine *engine, coro_f func, void *func_arg)
 	 * becomes dedicated to that single coroutine.
 	 */
 	struct sigaction newsa, oldsa;
-	newsa.sa_handler = coro_body;
+	newsa.sa_handler = coro_ctx_start_portable;
 	newsa.sa_flags = SA_ONSTACK;
 	sigemptyset(&newsa.sa_mask);
 	if (sigaction(SIGUSR2, &newsa, &oldsa) != 0)
 		handle_error();
 	/* Create that new stack. */
 	stack_t oldst, newst;
-	newst.ss_sp = c->stack;
+	newst.ss_sp = stack;
 	newst.ss_size = stack_size;
 	newst.ss_flags = 0;
 	if (sigaltstack(&newst, &oldst) != 0)
 		handle_error();
 
 	/* Jump onto the stack and remember its position. */
-	assert(new_coro_engine == NULL);
-	new_coro_engine = engine;
-	struct coro *old_this = engine->this_coro;
-	engine->this_coro = c;
+	struct coro_ctx_start start;
+	start.ctx = ctx;
+	start.func = func;
+	start.arg = arg;
+	assert(new_coro_ctx == NULL);
+	new_coro_ctx = &start;
 	sigemptyset(&suss);
-	if (sigsetjmp(engine->start_point, 1) == 0) {
+	if (sigsetjmp(start.start_point, 1) == 0) {
 		raise(SIGUSR2);
-		while (engine->this_coro != NULL)
+		while (new_coro_ctx != NULL)
 			sigsuspend(&suss);
 	}
-	assert(new_coro_engine == NULL);
-	engine->this_coro = old_this;
+	assert(new_coro_ctx == NULL);
 
 	/*
 	 * Return the old stack, unblock SIGUSR2. In other words,
 	 * rollback all global changes. The newly created stack
-	 * now is remembered only by the new coroutine, and can be
+	 * now is remembered only by the new context, and can be
 	 * used by it only.
 	 */
 	if (sigaltstack(NULL, &newst) != 0)
@@ -306,102 +352,3710 @@ coro_engine_spawn_new(struct coro_engine *engine, coro_f func, void *func_arg)
 		handle_error();
 	if (sigprocmask(SIG_SETMASK, &olds, NULL) != 0)
 		handle_error();
-
-	/* Now scheduler can work with that coroutine. */
-	++engine->coro_count;
-	assert(rlist_empty(&c->link));
-	rlist_add_tail_entry(&engine->coros_running_next, c, link);
-	return c;
 }
 
-static struct coro *
-coro_engine_spawn(struct coro_engine *engine, coro_f func, void *func_arg)
+static inline void
+coro_ctx_switch(struct coro_ctx *from, struct coro_ctx *to)
 {
-	if (rlist_empty(&engine->coros_pool))
-		return coro_engine_spawn_new(engine, func, func_arg);
-
-	struct coro *c = rlist_shift_entry(&engine->coros_pool,
-		struct coro, link);
-	c->func = func;
-	c->func_arg = func_arg;
-	c->state = CORO_STATE_RUNNING;
-	assert(rlist_empty(&c->link));
-	rlist_add_tail_entry(&engine->coros_running_next, c, link);
-	return c;
+	if (sigsetjmp(from->buf, 0) == 0)
+		siglongjmp(to->buf, 1);
 }
 
-static void *
-coro_engine_join(struct coro_engine *engine, struct coro *coro)
-{
-	assert(coro->joiner == NULL);
-	coro->joiner = engine->this_coro;
-	while (coro->state == CORO_STATE_RUNNING ||
-		coro->state == CORO_STATE_SUSPENDED)
-		coro_engine_suspend(engine);
-	assert(coro->state == CORO_STATE_FINISHED);
-	assert(coro->joiner == engine->this_coro);
-	coro->joiner = NULL;
-	void *ret = coro->ret;
-	coro->ret = NULL;
-	assert(rlist_empty(&coro->link));
-	rlist_add_entry(&engine->coros_pool, coro, link);
-	return ret;
-}
+#endif /* LIBCORO_CTX_PORTABLE */
 
-//////////////////////////////////////////////////////////////////
+enum coro_state {
+	CORO_STATE_RUNNING,
+	CORO_STATE_SUSPENDED,
+	CORO_STATE_FINISHED,
+};
 
-static struct coro_engine glob_engine;
+/** Deadline of a timed suspension of a coroutine. */
+struct coro_timer {
+	/** Link in a slot of the timers wheel. */
+	struct rlist link;
+	/** Tick of the wheel when the timer expires. */
+	uint64_t deadline;
+	/**
+	 * Engine whose wheel has the timer. NULL when the timer
+	 * isn't armed.
+	 */
+	struct coro_engine *engine;
+	/** The timer has expired and woke the coroutine up. */
+	bool is_fired;
+};
 
-void
-coro_sched_init(void)
-{
-	coro_engine_create(&glob_engine);
-}
+/**
+ * Waiters of a file descriptor in one engine. A reader and a
+ * writer can wait at the same time, and the descriptor is in epoll
+ * with the events of both. A coroutine waiting for both the events
+ * takes both the places.
+ */
+struct coro_fd_waiters {
+	struct coro *reader;
+	struct coro *writer;
+};
 
-void
-coro_sched_run(void)
-{
-	coro_engine_run(&glob_engine);
-}
+/** Wait of a coroutine for a file descriptor. */
+struct coro_fd_wait {
+	/**
+	 * Engine whose epoll has the descriptor. NULL when the
+	 * coroutine doesn't wait.
+	 */
+	struct coro_engine *engine;
+	int fd;
+	/** CORO_EVENT_* to wait for. */
+	int events;
+	/** CORO_EVENT_* which have woken the coroutine up. */
+	int revents;
+};
 
-void
-coro_sched_destroy(void)
-{
-	coro_engine_destroy(&glob_engine);
-}
+enum {
+	/** Keys whose values are stored right in the coroutine. */
+	CORO_KEY_INLINE_COUNT = 8,
+	/**
+	 * How many times the destructors are called again when they
+	 * set new values, like PTHREAD_DESTRUCTOR_ITERATIONS.
+	 */
+	CORO_KEY_DESTRUCTOR_ITERATIONS = 4,
+};
 
-struct coro *
-coro_this(void)
-{
-	return glob_engine.this_coro;
-}
+/**
+ * Values of the coroutine-local keys. The first keys are looked
+ * up by a plain index. The values of the others are in an array
+ * allocated on their first use.
+ */
+struct coro_specific {
+	void *values[CORO_KEY_INLINE_COUNT];
+	/** Values of the keys after the inline ones. */
+	void **ext_values;
+	int ext_size;
+};
 
-struct coro *
-coro_new(coro_f func, void *func_arg)
-{
-	return coro_engine_spawn(&glob_engine, func, func_arg);
-}
+/** Main coroutine structure, its context. */
+struct coro {
+	/*
+	 * The members touched by a wakeup go first, to share a
+	 * cache line. A mass wakeup is bound by the cache misses.
+	 */
+	/** Coroutine state. */
+	enum coro_state state;
+	/** CORO_PRIORITY_*. */
+	int priority;
+	/** Links in a coroutine list, used by the scheduler. */
+	struct rlist link;
+	/**
+	 * Wait queue where the coroutine is suspended, linked via
+	 * its link. NULL if none.
+	 */
+	struct coro_wait_queue *wait_queue;
+	/** A value, returned by func. */
+	void *ret;
+	/** Stack, used by the coroutine. */
+	uint8_t *stack;
+	/** Usable size of the stack, without the guard page. */
+	size_t stack_size;
+	/** The stack is provided by the user, not allocated. */
+	bool is_user_stack;
+	/** The object itself is provided by the user. */
+	bool is_user_storage;
+	/**
+	 * Stack memory below this point isn't used by a finished
+	 * coroutine and can be returned to the kernel.
+	 */
+	uint8_t *stack_live;
+	/** The stack is painted with the canary for measurements. */
+	bool is_stack_painted;
+	/** Peak stack usage of the finished coroutine, if measured. */
+	size_t stack_used;
+	/** An argument for the function func. */
+	void *func_arg;
+	/** A function to call as a coroutine. */
+	coro_f func;
+	/** Engine which runs the coroutine now or ran it last. */
+	struct coro_engine *engine;
+	/**
+	 * Engine the coroutine belongs to. The one which spawned
+	 * it, or the main engine of the M:N group. It outlives the
+	 * engines of the other threads.
+	 */
+	struct coro_engine *home;
+	/** Last remembered coroutine context. */
+	struct coro_ctx ctx;
+	/**
+	 * Coroutine which is trying to join this one right now.
+	 */
+	struct coro *joiner;
+	/**
+	 * The coroutine was woken up while running. Its next
+	 * suspension is cancelled. Only used in the M:N mode.
+	 */
+	bool is_wakeup_pending;
+	/**
+	 * The coroutine is in the remote wakeups of its home engine,
+	 * see coro_engine_wakeup_remote().
+	 */
+	bool is_remote_queued;
+	/** Next coroutine in the remote wakeups. */
+	struct coro *remote_next;
+	/** coro_cancel() was called for the coroutine. */
+	bool is_cancelled;
+	/**
+	 * The waits of the public API fail when the coroutine is
+	 * cancelled. Otherwise the cancellation just waits.
+	 */
+	bool is_cancellable;
+	/** Timer of the current timed suspension. */
+	struct coro_timer timer;
+	/** The current wait for a descriptor. */
+	struct coro_fd_wait fd_wait;
+	/**
+	 * Values of the coroutine-local keys. Of the scheduler they
+	 * are used by the code running outside of the coroutines.
+	 */
+	struct coro_specific specific;
+	/**
+	 * What the coroutine waits for, for the debug dumps. Set
+	 * right before a suspension and reset after it. NULL is a
+	 * plain suspension.
+	 */
+	const char *wait_what;
+	const void *wait_object;
+	/** The coroutine is in the list of the suspended ones. */
+	bool is_wait_tracked;
+	/** Link in the list of the suspended coroutines. */
+	struct rlist wait_link;
+	/**
+	 * Backtrace of the current suspension in the debug mode.
+	 * Allocated on the first tracked suspension.
+	 */
+	void **wait_trace;
+	int wait_trace_size;
+#if LIBCORO_STATS
+	struct coro_stats stats;
+	/** When the coroutine became runnable last time. */
+	uint64_t ready_ns;
+	/** Link in the list of all not joined coroutines. */
+	struct rlist stats_link;
+#endif
+};
 
-void *
-coro_join(struct coro *coro)
+/**
+ * What the scheduler should do with a coroutine which switched
+ * back to it.
+ */
+enum coro_action {
+	CORO_ACTION_NONE,
+	/** Put to the end of the run queue. */
+	CORO_ACTION_YIELD,
+	/** Leave until somebody wakes it up. */
+	CORO_ACTION_SUSPEND,
+	/** The coroutine function returned. */
+	CORO_ACTION_FINISH,
+	/**
+	 * Same as yield, but the next to run is the coroutine
+	 * given in the engine.
+	 */
+	CORO_ACTION_SWITCH,
+};
+
+enum {
+	/**
+	 * Each level of the timers wheel has 2^6 slots. A slot of
+	 * level N covers 2^(6 * N) ticks.
+	 */
+	CORO_WHEEL_BITS = 6,
+	CORO_WHEEL_SIZE = 1 << CORO_WHEEL_BITS,
+	CORO_WHEEL_MASK = CORO_WHEEL_SIZE - 1,
+	CORO_WHEEL_LEVELS = 4,
+};
+
+/**
+ * Hierarchical timing wheel. Level 0 has a slot for each of the
+ * next 64 ticks. Timers further away are kept in the higher
+ * levels with coarser slots. When a slot of a higher level is
+ * reached, its timers are cascaded into the lower levels. Adding
+ * and removing a timer is O(1).
+ */
+struct coro_wheel {
+	/** The last processed tick. */
+	uint64_t now;
+	/** Number of timers in the wheel. */
+	size_t count;
+	struct rlist slots[CORO_WHEEL_LEVELS][CORO_WHEEL_SIZE];
+};
+
+enum {
+	/** Queue index of the highest priority. */
+	CORO_PRIORITY_COUNT = CORO_PRIORITY_HIGH - CORO_PRIORITY_LOW + 1,
+};
+
+/**
+ * Weighted round-robin: under load the priorities get the CPU in
+ * these proportions, from the highest. So the low ones don't
+ * starve.
+ */
+static const int coro_priority_weights[CORO_PRIORITY_COUNT] = {16, 4, 1};
+
+static inline int
+coro_priority_idx(int priority)
 {
-	return coro_engine_join(&glob_engine, coro);
+	return CORO_PRIORITY_HIGH - priority;
 }
 
-void
-coro_suspend(void)
+enum {
+	/** Max number of events taken from epoll at once. */
+	CORO_POLL_BATCH = 64,
+	/**
+	 * Max direct switches in a row. Then the chain goes through
+	 * the queue, so a pair switching to each other can't starve
+	 * the others.
+	 */
+	CORO_SWITCH_MAX = 64,
+	/**
+	 * A busy thread of the M:N mode checks its descriptors once
+	 * per this many resumed coroutines.
+	 */
+	CORO_POLL_INTERVAL = 64,
+	CORO_CACHE_LINE_SIZE = 64,
+	/** Capacity of a thread's run queue in the M:N mode. */
+	CORO_RUNQ_SIZE = 256,
+};
+
+/**
+ * Run queue of one thread in the M:N mode. Lock-free ring buffer.
+ * Only the owner thread pushes, but any thread can pop. The other
+ * threads do that to steal work from the owner.
+ */
+struct coro_runq {
+	/** Next coroutine to pop. Moved by the owner and thieves. */
+	alignas(CORO_CACHE_LINE_SIZE) uint32_t head;
+	/** Where to push next. Moved only by the owner. */
+	alignas(CORO_CACHE_LINE_SIZE) uint32_t tail;
+	alignas(CORO_CACHE_LINE_SIZE) struct coro *slots[CORO_RUNQ_SIZE];
+};
+
+/** Threads running coroutines together in the M:N mode. */
+struct coro_group {
+	/** Engines of all the threads. */
+	struct coro_engine **engines;
+	int engine_count;
+	/** Protects the shared queue and the idle threads' sleep. */
+	pthread_mutex_t mutex;
+	/** Idle threads wait on it for new work. */
+	pthread_cond_t cond;
+	/**
+	 * Runnable coroutines which didn't fit into the threads'
+	 * queues, or were woken up by foreign threads.
+	 */
+	struct rlist coros_shared;
+	/** Size of the shared queue. */
+	size_t shared_count;
+	/** Number of idle threads waiting for work. */
+	int idle_count;
+	/**
+	 * Number of running and runnable coroutines. When zero,
+	 * and there are no timers, the threads stop.
+	 */
+	size_t active_count;
+	/** Number of armed timers in all the engines. */
+	size_t timer_count;
+	/** Number of descriptor waits in all the engines. */
+	size_t fd_count;
+	/**
+	 * Number of the idle threads blocked in epoll instead of
+	 * the condition variable.
+	 */
+	int poll_count;
+};
+
+enum {
+	/** Stack sizes of the pool classes are 2^14 .. 2^28. */
+	CORO_STACK_CLASS_MIN_LOG2 = 14,
+	CORO_STACK_CLASS_COUNT = 15,
+	/**
+	 * How many pooled coroutines of one class can keep their
+	 * touched stack pages. The others are trimmed.
+	 */
+	CORO_STACK_CLASS_HOT_MAX = 16,
+};
+
+/**
+ * A chunk of memory cut into coroutine objects. Coroutine objects
+ * are allocated from the slabs, so spawning doesn't touch the
+ * heap. The slabs are never freed until the engine is destroyed.
+ */
+struct coro_slab {
+	struct coro_slab *next;
+};
+
+enum {
+	CORO_SLAB_SIZE = 64 * 1024,
+};
+
+/** Pooled coroutines with stacks of the same size. */
+struct coro_stack_class {
+	/**
+	 * Recently joined coroutines. Their stacks are reused as is,
+	 * with all the pages touched before.
+	 */
+	struct rlist hot;
+	/** Size of the hot list. */
+	size_t hot_count;
+	/**
+	 * Coroutines which fell out of the hot list. The used part
+	 * of their stacks is given back to the kernel.
+	 */
+	struct rlist cold;
+};
+
+struct coro_engine {
+	/**
+	 * Scheduler is the main coroutine - it represents the
+	 * context in which the scheduler itself runs. Each
+	 * coroutine switches back to it when stops running.
+	 */
+	struct coro sched;
+	/** Which coroutine works at this moment. */
+	struct coro *this_coro;
+	/**
+	 * What the last coroutine wants from the scheduler when
+	 * switching to it.
+	 */
+	enum coro_action action;
+
+	/**
+	 * Runnable coroutines, a queue per priority, the highest
+	 * first. Get populated by wakeups and yields and new coros.
+	 */
+	struct rlist coros_runnable[CORO_PRIORITY_COUNT];
+	/** Total size of the runnable queues. */
+	size_t runnable_count;
+	/**
+	 * How many coroutines are left to run in this iteration of
+	 * the loop. It is the number of the runnable ones at the
+	 * iteration start.
+	 */
+	size_t pass_left;
+	/**
+	 * How many more coroutines each priority can run before the
+	 * lower ones get their turn. Refilled with the weights
+	 * when no runnable priority has credits left.
+	 */
+	int credits[CORO_PRIORITY_COUNT];
+	/** The lower priorities get their share of the CPU. */
+	bool is_fair;
+	/** Joined coroutines to be reused, by stack size classes. */
+	struct coro_stack_class coros_pool[CORO_STACK_CLASS_COUNT];
+	/** Total stack size of the pooled coroutines. */
+	size_t pool_size;
+	/** Max total stack size the pool can keep. */
+	size_t pool_limit;
+	/** CORO_STACK_MODE_*. */
+	int stack_mode;
+	/** Total number of coroutines, including the pool. */
+	size_t coro_count;
+	/** Threads group in the M:N mode. NULL otherwise. */
+	struct coro_group *group;
+	/** Index of the engine in the group. */
+	int idx;
+	/** Timers of the coroutines suspended with a timeout. */
+	struct coro_wheel wheel;
+	/**
+	 * Protects the wheel and the descriptor waiters in the M:N
+	 * mode, where the timers and the waits can be stopped from
+	 * other threads.
+	 */
+	pthread_mutex_t mutex;
+	/** Epoll of the waited descriptors. Created on demand. */
+	int epoll_fd;
+	/**
+	 * Wakes the thread up from epoll in the M:N mode, where it
+	 * could sleep there while the others push work.
+	 */
+	int event_fd;
+	/** The thread is blocked in epoll as an idle one. */
+	bool is_polling;
+	/**
+	 * Coroutines woken up by the threads not running the engine,
+	 * a lock-free stack. The owner takes them all at once.
+	 */
+	struct coro *remote_wakeups;
+	/** The event descriptor was signalled for them. */
+	bool is_remote_signalled;
+	/**
+	 * Thread which ran the engine last. Only it can touch the
+	 * wait queues of a single thread engine.
+	 */
+	pthread_t thread;
+	/** Waiting coroutines by descriptors. */
+	struct coro_fd_waiters *fd_waiters;
+	int fd_waiters_size;
+	/** Number of the waiting coroutines. */
+	size_t fd_count;
+	/** Coroutines resumed since the last check of epoll. */
+	int poll_skip_count;
+#if LIBCORO_USE_EPOLL
+	struct epoll_event poll_events[CORO_POLL_BATCH];
+#endif
+#if LIBCORO_STATS
+	/** Sum of the stats of the coroutines run by the engine. */
+	struct coro_stats stats;
+	/** When the current coroutine got the CPU. */
+	uint64_t run_start_ns;
+#endif
+	/** Coroutine to run after the current one switches away. */
+	struct coro *switch_target;
+	/**
+	 * Direct switches in a row since the scheduler resumed a
+	 * coroutine.
+	 */
+	int switch_count;
+	/** Slabs of the coroutine objects, see coro_slab. */
+	struct coro_slab *slabs;
+	/** Free coroutine objects from the slabs. */
+	struct rlist coros_free;
+	/** Run queue in the M:N mode. */
+	struct coro_runq runq;
+};
+
+static_assert(sizeof(struct coro) <= sizeof(struct coro_storage),
+	"coroutine storage is too small");
+static_assert(alignof(struct coro) <= alignof(struct coro_storage),
+	"coroutine storage is misaligned");
+
+/** Stack size used when the attributes don't specify one. */
+static const size_t coro_stack_size_default = 1024 * 1024;
+/** Smallest allowed stack size. */
+static const size_t coro_stack_size_min =
+	(size_t)1 << CORO_STACK_CLASS_MIN_LOG2;
+/** Default limit of the pooled stacks total size. */
+static const size_t coro_pool_limit_default = 128 * 1024 * 1024;
+
+static size_t
+coro_page_size(void)
+{
+	static size_t page_size = 0;
+	if (page_size == 0)
+		page_size = sysconf(_SC_PAGESIZE);
+	return page_size;
+}
+
+/**
+ * Turn a requested stack size into the one actually allocated.
+ * Sizes are powers of 2, so stacks of close sizes could be reused
+ * by each other via the pool.
+ */
+static size_t
+coro_stack_size_normalize(size_t size)
+{
+	if (size == 0)
+		size = coro_stack_size_default;
+	if (size < coro_stack_size_min)
+		size = coro_stack_size_min;
+#if LIBCORO_CTX_PORTABLE
+	if (size < (size_t)SIGSTKSZ)
+		size = SIGSTKSZ;
+#endif
+	size_t page_size = coro_page_size();
+	if (size < page_size)
+		size = page_size;
+	size_t res = 1;
+	while (res < size)
+		res <<= 1;
+	return res;
+}
+
+/**
+ * Pool class of the given normalized stack size. Too big stacks
+ * have no class and aren't pooled.
+ */
+static int
+coro_stack_class_idx(size_t size)
+{
+	int idx = 0;
+	while (((size_t)1 << (idx + CORO_STACK_CLASS_MIN_LOG2)) < size)
+		++idx;
+	if (idx >= CORO_STACK_CLASS_COUNT)
+		return -1;
+	return idx;
+}
+
+/**
+ * Allocate a stack of the given size, which must be already
+ * normalized. The memory is mapped right from the kernel, so the
+ * pages are committed only when touched. Below the stack there is
+ * a guard page - an overflow crashes instead of corrupting the
+ * neighbour memory.
+ */
+static uint8_t *
+coro_stack_new(size_t size)
+{
+	size_t page_size = coro_page_size();
+	int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+#ifdef MAP_NORESERVE
+	flags |= MAP_NORESERVE;
+#endif
+#ifdef MAP_STACK
+	flags |= MAP_STACK;
+#endif
+	void *map = mmap(NULL, size + page_size, PROT_READ | PROT_WRITE,
+		flags, -1, 0);
+	if (map == MAP_FAILED)
+		handle_error();
+	if (mprotect(map, page_size, PROT_NONE) != 0)
+		handle_error();
+	return (uint8_t *)map + page_size;
+}
+
+static void
+coro_stack_delete(uint8_t *stack, size_t size)
+{
+	size_t page_size = coro_page_size();
+	if (munmap(stack - page_size, size + page_size) != 0)
+		handle_error();
+}
+
+/**
+ * Give the pages of a finished coroutine's stack back to the
+ * kernel. Only the part below the still alive frame of the
+ * coroutine body is dropped. The next touch of these pages gets
+ * fresh zeroed memory.
+ */
+static void
+coro_stack_trim(struct coro *c)
+{
+	size_t page_size = coro_page_size();
+	uintptr_t end = (uintptr_t)c->stack_live & ~(page_size - 1);
+	/*
+	 * Keep one more page for the frames of the context switch
+	 * below the remembered point.
+	 */
+	end -= page_size;
+	if (end <= (uintptr_t)c->stack)
+		return;
+#ifdef MADV_DONTNEED
+	if (madvise(c->stack, end - (uintptr_t)c->stack, MADV_DONTNEED) != 0)
+		handle_error();
+	/* The canary is gone with the pages. */
+	c->is_stack_painted = false;
+#endif
+}
+
+/**
+ * A pattern filling the unused stack memory. The stack usage is
+ * the distance from the top to the first overwritten word.
+ */
+static const uint64_t coro_stack_canary = 0xdeadc0dedeadc0deULL;
+
+static void
+coro_stack_paint(uint8_t *begin, uint8_t *end)
+{
+	uint64_t *pos = (uint64_t *)(((uintptr_t)begin + 7) & ~(uintptr_t)7);
+	uint64_t *stop = (uint64_t *)((uintptr_t)end & ~(uintptr_t)7);
+	for (; pos < stop; ++pos)
+		*pos = coro_stack_canary;
+}
+
+/**
+ * Paint the stack of a coroutine about to start. A new stack is
+ * painted fully. A reused one only where the previous run has
+ * left marks. The frames of the coroutine body, which are still
+ * alive at the top of the stack, are kept as is.
+ */
+static void
+coro_stack_prepare(struct coro_engine *engine, struct coro *c)
+{
+	uint8_t *top = c->stack + c->stack_size;
+	if (c->stack_live == c->stack) {
+		/* Not started yet. */
+		if (engine->stack_mode != CORO_STACK_MODE_FIXED) {
+			coro_stack_paint(c->stack, top);
+			c->is_stack_painted = true;
+		}
+	} else if (c->is_stack_painted ||
+		   engine->stack_mode != CORO_STACK_MODE_FIXED) {
+		size_t page_size = coro_page_size();
+		uintptr_t end = (uintptr_t)c->stack_live & ~(page_size - 1);
+		end -= page_size;
+		uint8_t *begin = c->stack;
+		if (c->is_stack_painted)
+			begin = top - c->stack_used;
+		if (end > (uintptr_t)begin)
+			coro_stack_paint(begin, (uint8_t *)end);
+		c->is_stack_painted = true;
+	}
+	c->stack_used = 0;
+}
+
+enum {
+	/** Size of the table of the stack usage by functions. */
+	CORO_STACK_PROFILE_COUNT = 256,
+};
+
+/** Stack usage of the coroutines running a function. */
+struct coro_stack_profile {
+	coro_f func;
+	/** Max stack usage seen so far. */
+	size_t used_max;
+};
+
+/**
+ * The profiles are global, a function can be run by any thread.
+ * An open addressing table without deletions, so it works without
+ * locks. When it is full, the new functions aren't profiled.
+ */
+static struct coro_stack_profile coro_stack_profiles[CORO_STACK_PROFILE_COUNT];
+
+static struct coro_stack_profile *
+coro_stack_profile_find(coro_f func, bool is_new)
+{
+	uintptr_t hash = (uintptr_t)func * 0x9e3779b97f4a7c15ULL;
+	size_t idx = (hash >> 32) % CORO_STACK_PROFILE_COUNT;
+	for (int i = 0; i < CORO_STACK_PROFILE_COUNT; ++i) {
+		struct coro_stack_profile *profile = &coro_stack_profiles[idx];
+		coro_f f = __atomic_load_n(&profile->func, __ATOMIC_ACQUIRE);
+		if (f == NULL) {
+			if (!is_new)
+				return NULL;
+			if (__atomic_compare_exchange_n(&profile->func, &f, func,
+					false, __ATOMIC_ACQ_REL,
+					__ATOMIC_ACQUIRE))
+				return profile;
+		}
+		if (f == func)
+			return profile;
+		idx = (idx + 1) % CORO_STACK_PROFILE_COUNT;
+	}
+	return NULL;
+}
+
+/**
+ * Measure the stack usage of a coroutine whose function has just
+ * returned, and remember it in the profile of the function.
+ */
+static void
+coro_stack_measure(struct coro *c)
+{
+	const uint64_t *pos = (const uint64_t *)(((uintptr_t)c->stack + 7) &
+		~(uintptr_t)7);
+	const uint8_t *top = c->stack + c->stack_size;
+	while ((const uint8_t *)pos < top && *pos == coro_stack_canary)
+		++pos;
+	size_t used = top - (const uint8_t *)pos;
+	__atomic_store_n(&c->stack_used, used, __ATOMIC_RELEASE);
+	struct coro_stack_profile *profile = coro_stack_profile_find(c->func,
+		true);
+	if (profile == NULL)
+		return;
+	size_t old = __atomic_load_n(&profile->used_max, __ATOMIC_RELAXED);
+	while (old < used &&
+	       !__atomic_compare_exchange_n(&profile->used_max, &old, used,
+			false, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+/**
+ * Stack size for a new coroutine of the function, given the usage
+ * of the previous ones. 0 if unknown.
+ */
+static size_t
+coro_stack_size_learned(coro_f func)
+{
+	struct coro_stack_profile *profile = coro_stack_profile_find(func,
+		false);
+	if (profile == NULL)
+		return 0;
+	size_t used = __atomic_load_n(&profile->used_max, __ATOMIC_RELAXED);
+	if (used == 0)
+		return 0;
+	/* A margin for the runs going deeper than the seen ones. */
+	return used + used / 2;
+}
+
+/** Number of the created coroutine-local keys. */
+static int coro_key_count = 0;
+/** Destructors of the values of the keys, can be NULL. */
+static coro_key_destructor_f coro_key_destructors[CORO_KEY_MAX];
+
+/**
+ * Call the destructors of the non-NULL values, and reset them.
+ * The destructors run in the context of the values' owner, and
+ * can use the keys too.
+ */
+static void
+coro_specific_clear(struct coro_specific *specific)
+{
+	int key_count = __atomic_load_n(&coro_key_count, __ATOMIC_ACQUIRE);
+	for (int i = 0; i < CORO_KEY_DESTRUCTOR_ITERATIONS; ++i) {
+		bool is_called = false;
+		for (int key = 0; key < key_count; ++key) {
+			void **value;
+			if (key < CORO_KEY_INLINE_COUNT) {
+				value = &specific->values[key];
+			} else {
+				int idx = key - CORO_KEY_INLINE_COUNT;
+				if (idx >= specific->ext_size)
+					break;
+				value = &specific->ext_values[idx];
+			}
+			if (*value == NULL)
+				continue;
+			void *old = *value;
+			*value = NULL;
+			coro_key_destructor_f destructor = __atomic_load_n(
+				&coro_key_destructors[key], __ATOMIC_ACQUIRE);
+			if (destructor == NULL)
+				continue;
+			destructor(old);
+			is_called = true;
+		}
+		if (!is_called)
+			return;
+	}
+	/* The destructors keep setting the values, drop them. */
+	memset(specific->values, 0, sizeof(specific->values));
+	memset(specific->ext_values, 0,
+		specific->ext_size * sizeof(specific->ext_values[0]));
+}
+
+static void
+coro_specific_destroy(struct coro_specific *specific)
+{
+	free(specific->ext_values);
+	specific->ext_values = NULL;
+	specific->ext_size = 0;
+}
+
+/** Take a zeroed coroutine object from the slabs. */
+static struct coro *
+coro_engine_coro_alloc(struct coro_engine *engine)
+{
+	if (rlist_empty(&engine->coros_free)) {
+		int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+		void *map = mmap(NULL, CORO_SLAB_SIZE, PROT_READ | PROT_WRITE,
+			flags, -1, 0);
+		if (map == MAP_FAILED)
+			handle_error();
+		struct coro_slab *slab = (struct coro_slab *)map;
+		slab->next = engine->slabs;
+		engine->slabs = slab;
+		size_t offset = sizeof(*slab);
+		size_t align = alignof(struct coro);
+		offset = (offset + align - 1) & ~(align - 1);
+		for (; offset + sizeof(struct coro) <= CORO_SLAB_SIZE;
+		     offset += sizeof(struct coro)) {
+			struct coro *c = (struct coro *)((char *)map + offset);
+			rlist_add_tail_entry(&engine->coros_free, c, link);
+		}
+	}
+	struct coro *c = rlist_shift_entry(&engine->coros_free, struct coro,
+		link);
+	memset(c, 0, sizeof(*c));
+	return c;
+}
+
+static void
+coro_engine_coro_free(struct coro_engine *engine, struct coro *c)
+{
+	/* The recent ones first, they are still in the cache. */
+	rlist_add_entry(&engine->coros_free, c, link);
+}
+
+static void
+coro_engine_delete_coro(struct coro_engine *engine, struct coro *c)
+{
+	if (!c->is_user_stack)
+		coro_stack_delete(c->stack, c->stack_size);
+	coro_specific_destroy(&c->specific);
+	free(c->wait_trace);
+	if (!c->is_user_storage)
+		coro_engine_coro_free(engine, c);
+	assert(engine->group != NULL || engine->coro_count > 0);
+	--engine->coro_count;
+}
+
+/**
+ * Drop the pooled coroutines until their total stack size fits
+ * the limit. The cold ones go first, as they are the oldest.
+ */
+static void
+coro_engine_pool_shrink(struct coro_engine *engine)
+{
+	for (int i = CORO_STACK_CLASS_COUNT - 1; i >= 0; --i) {
+		struct coro_stack_class *cls = &engine->coros_pool[i];
+		while (engine->pool_size > engine->pool_limit &&
+		       !rlist_empty(&cls->cold)) {
+			struct coro *c = rlist_shift_tail_entry(&cls->cold,
+				struct coro, link);
+			engine->pool_size -= c->stack_size;
+			coro_engine_delete_coro(engine, c);
+		}
+	}
+	for (int i = CORO_STACK_CLASS_COUNT - 1; i >= 0; --i) {
+		struct coro_stack_class *cls = &engine->coros_pool[i];
+		while (engine->pool_size > engine->pool_limit &&
+		       !rlist_empty(&cls->hot)) {
+			struct coro *c = rlist_shift_tail_entry(&cls->hot,
+				struct coro, link);
+			--cls->hot_count;
+			engine->pool_size -= c->stack_size;
+			coro_engine_delete_coro(engine, c);
+		}
+	}
+}
+
+/** Put a joined coroutine into the pool or delete it. */
+static void
+coro_engine_pool_put(struct coro_engine *engine, struct coro *c)
+{
+	assert(rlist_empty(&c->link));
+	int idx = coro_stack_class_idx(c->stack_size);
+	/* The user's memory is given back right away. */
+	if (idx < 0 || c->is_user_stack || c->is_user_storage ||
+	    engine->pool_size + c->stack_size > engine->pool_limit) {
+		coro_engine_delete_coro(engine, c);
+		return;
+	}
+	struct coro_stack_class *cls = &engine->coros_pool[idx];
+	engine->pool_size += c->stack_size;
+	rlist_add_entry(&cls->hot, c, link);
+	if (++cls->hot_count <= CORO_STACK_CLASS_HOT_MAX)
+		return;
+	struct coro *old = rlist_shift_tail_entry(&cls->hot, struct coro, link);
+	--cls->hot_count;
+	coro_stack_trim(old);
+	rlist_add_entry(&cls->cold, old, link);
+}
+
+/** Take a pooled coroutine with the given stack size, if any. */
+static struct coro *
+coro_engine_pool_get(struct coro_engine *engine, size_t stack_size)
+{
+	int idx = coro_stack_class_idx(stack_size);
+	if (idx < 0)
+		return NULL;
+	struct coro_stack_class *cls = &engine->coros_pool[idx];
+	struct coro *c;
+	if (!rlist_empty(&cls->hot)) {
+		c = rlist_shift_entry(&cls->hot, struct coro, link);
+		--cls->hot_count;
+	} else if (!rlist_empty(&cls->cold)) {
+		c = rlist_shift_entry(&cls->cold, struct coro, link);
+	} else {
+		return NULL;
+	}
+	assert(c->stack_size == stack_size);
+	engine->pool_size -= c->stack_size;
+	return c;
+}
+
+/** Length of a tick of the timers wheel. */
+static const uint64_t coro_wheel_tick_ns = 1000000;
+
+static uint64_t
+coro_clock_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+#if LIBCORO_STATS
+
+/** All the not joined coroutines, for the stats dump. */
+static struct rlist coro_stats_list = RLIST_HEAD_INITIALIZER(coro_stats_list);
+static pthread_mutex_t coro_stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static inline void
+coro_stats_add(struct coro_stats *dst, const struct coro_stats *src)
+{
+	dst->switch_count += src->switch_count;
+	dst->suspend_count += src->suspend_count;
+	dst->run_ns += src->run_ns;
+	dst->wait_ns += src->wait_ns;
+}
+
+/** A coroutine is started, and its stats begin anew. */
+static inline void
+coro_stats_start(struct coro *c)
+{
+	memset(&c->stats, 0, sizeof(c->stats));
+	pthread_mutex_lock(&coro_stats_mutex);
+	rlist_add_tail_entry(&coro_stats_list, c, stats_link);
+	pthread_mutex_unlock(&coro_stats_mutex);
+}
+
+static inline void
+coro_stats_join(struct coro *c)
+{
+	pthread_mutex_lock(&coro_stats_mutex);
+	rlist_del_entry(c, stats_link);
+	pthread_mutex_unlock(&coro_stats_mutex);
+}
+
+static inline void
+coro_stats_ready(struct coro *c)
+{
+	c->ready_ns = coro_clock_ns();
+}
+
+/** Account the time a coroutine waited for the CPU. */
+static inline void
+coro_stats_run_begin(struct coro_engine *engine, struct coro *c)
+{
+	uint64_t now = coro_clock_ns();
+	c->stats.wait_ns += now - c->ready_ns;
+	engine->stats.wait_ns += now - c->ready_ns;
+	engine->run_start_ns = now;
+}
+
+static inline void
+coro_stats_run_end(struct coro_engine *engine, struct coro *c,
+	bool is_suspended)
+{
+	uint64_t run_ns = coro_clock_ns() - engine->run_start_ns;
+	c->stats.run_ns += run_ns;
+	++c->stats.switch_count;
+	c->stats.suspend_count += is_suspended;
+	engine->stats.run_ns += run_ns;
+	++engine->stats.switch_count;
+	engine->stats.suspend_count += is_suspended;
+}
+
+#else /* !LIBCORO_STATS */
+
+static inline void
+coro_stats_start(struct coro *c)
+{
+	(void)c;
+}
+
+static inline void
+coro_stats_join(struct coro *c)
+{
+	(void)c;
+}
+
+static inline void
+coro_stats_ready(struct coro *c)
+{
+	(void)c;
+}
+
+static inline void
+coro_stats_run_begin(struct coro_engine *engine, struct coro *c)
+{
+	(void)engine;
+	(void)c;
+}
+
+static inline void
+coro_stats_run_end(struct coro_engine *engine, struct coro *c,
+	bool is_suspended)
+{
+	(void)engine;
+	(void)c;
+	(void)is_suspended;
+}
+
+#endif /* !LIBCORO_STATS */
+
+enum {
+	/** Max frames in the backtrace of a suspension. */
+	CORO_WAIT_TRACE_SIZE = 32,
+};
+
+/**
+ * In the debug mode the suspended coroutines are kept in a list,
+ * with the backtraces of their suspensions. So when the scheduler
+ * gets stuck, it can show who waits for what.
+ */
+static bool coro_debug_is_enabled = false;
+/** The suspended coroutines, in the debug mode. */
+static struct rlist coro_debug_list = RLIST_HEAD_INITIALIZER(coro_debug_list);
+/** Size of the list. */
+static size_t coro_debug_count = 0;
+static pthread_mutex_t coro_debug_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/** A coroutine is going to suspend. */
+static inline void
+coro_debug_wait_begin(struct coro *c)
+{
+	if (!__atomic_load_n(&coro_debug_is_enabled, __ATOMIC_RELAXED))
+		return;
+#if LIBCORO_USE_BACKTRACE
+	if (c->wait_trace == NULL) {
+		c->wait_trace = (void **)malloc(CORO_WAIT_TRACE_SIZE *
+			sizeof(c->wait_trace[0]));
+		if (c->wait_trace == NULL)
+			handle_error();
+	}
+	c->wait_trace_size = backtrace(c->wait_trace, CORO_WAIT_TRACE_SIZE);
+#endif
+	c->is_wait_tracked = true;
+	pthread_mutex_lock(&coro_debug_mutex);
+	rlist_add_tail_entry(&coro_debug_list, c, wait_link);
+	++coro_debug_count;
+	pthread_mutex_unlock(&coro_debug_mutex);
+}
+
+/** A coroutine is resumed after a suspension. */
+static inline void
+coro_debug_wait_end(struct coro *c)
+{
+	c->wait_what = NULL;
+	c->wait_object = NULL;
+	if (!c->is_wait_tracked)
+		return;
+	c->is_wait_tracked = false;
+	pthread_mutex_lock(&coro_debug_mutex);
+	rlist_del_entry(c, wait_link);
+	--coro_debug_count;
+	pthread_mutex_unlock(&coro_debug_mutex);
+}
+
+/**
+ * Check if a suspended coroutine waits for itself, via a chain of
+ * the coroutines waiting for each other. The mutex must be held.
+ */
+static bool
+coro_debug_is_in_cycle(const struct coro *c)
+{
+	const void *next = c->wait_object;
+	for (size_t i = 0; i < coro_debug_count && next != NULL; ++i) {
+		if (next == c)
+			return true;
+		const struct coro *waiter = NULL;
+		struct coro *it;
+		rlist_foreach_entry(it, &coro_debug_list, wait_link) {
+			if (it == next) {
+				waiter = it;
+				break;
+			}
+		}
+		if (waiter == NULL)
+			return false;
+		next = waiter->wait_object;
+	}
+	return false;
+}
+
+/**
+ * Count the suspended coroutines of an engine, or of all engines
+ * if it is NULL. The mutex must be held.
+ */
+static size_t
+coro_debug_count_of(const struct coro_engine *home)
+{
+	if (home == NULL)
+		return coro_debug_count;
+	size_t count = 0;
+	struct coro *c;
+	rlist_foreach_entry(c, &coro_debug_list, wait_link)
+		count += c->home == home;
+	return count;
+}
+
+/**
+ * Print the suspended coroutines of an engine, or of all engines
+ * if it is NULL. The mutex must be held.
+ */
+static void
+coro_debug_dump(const struct coro_engine *home)
+{
+	printf("Suspended coroutines: %zu\n", coro_debug_count_of(home));
+	struct coro *c;
+	rlist_foreach_entry(c, &coro_debug_list, wait_link) {
+		if (home != NULL && c->home != home)
+			continue;
+		printf("coro %p waits for %s", (void *)c,
+		       c->wait_what != NULL ? c->wait_what : "a wakeup");
+		if (c->wait_object != NULL)
+			printf(" %p", c->wait_object);
+		if (__atomic_load_n(&c->fd_wait.engine, __ATOMIC_ACQUIRE) != NULL)
+			printf(", fd %d", c->fd_wait.fd);
+		if (__atomic_load_n(&c->timer.engine, __ATOMIC_ACQUIRE) != NULL)
+			printf(", with a timeout");
+		if (coro_debug_is_in_cycle(c))
+			printf(", in a wait cycle");
+		printf("\n");
+#if LIBCORO_USE_BACKTRACE
+		fflush(stdout);
+		backtrace_symbols_fd(c->wait_trace, c->wait_trace_size,
+			STDOUT_FILENO);
+#endif
+	}
+	fflush(stdout);
+}
+
+/**
+ * The engine has stopped. Whoever of it is still suspended can
+ * only be woken up from outside of the coroutines, which most
+ * likely is a deadlock or a lost wakeup.
+ */
+static void
+coro_debug_check_stop(const struct coro_engine *engine)
+{
+	if (!__atomic_load_n(&coro_debug_is_enabled, __ATOMIC_RELAXED))
+		return;
+	pthread_mutex_lock(&coro_debug_mutex);
+	if (coro_debug_count_of(engine) > 0) {
+		printf("Warning: the scheduler has stopped with suspended "
+			"coroutines\n");
+		coro_debug_dump(engine);
+	}
+	pthread_mutex_unlock(&coro_debug_mutex);
+}
+
+static void
+coro_wheel_create(struct coro_wheel *wheel)
+{
+	wheel->now = coro_clock_ns() / coro_wheel_tick_ns;
+	wheel->count = 0;
+	for (int l = 0; l < CORO_WHEEL_LEVELS; ++l) {
+		for (int i = 0; i < CORO_WHEEL_SIZE; ++i)
+			rlist_create(&wheel->slots[l][i]);
+	}
+}
+
+/** Put a timer into the slot matching its deadline. */
+static void
+coro_wheel_place(struct coro_wheel *wheel, struct coro_timer *timer)
+{
+	assert(timer->deadline >= wheel->now);
+	uint64_t delta = timer->deadline - wheel->now;
+	uint64_t expire = timer->deadline;
+	const uint64_t range =
+		(uint64_t)1 << (CORO_WHEEL_BITS * CORO_WHEEL_LEVELS);
+	if (delta >= range) {
+		/*
+		 * Too far. Park in the last slot, it will be placed
+		 * again when cascaded.
+		 */
+		expire = wheel->now + range - 1;
+		delta = range - 1;
+	}
+	int level = 0;
+	while (delta >= (uint64_t)1 << (CORO_WHEEL_BITS * (level + 1)))
+		++level;
+	int idx = (expire >> (CORO_WHEEL_BITS * level)) & CORO_WHEEL_MASK;
+	rlist_add_tail_entry(&wheel->slots[level][idx], timer, link);
+}
+
+static void
+coro_wheel_add(struct coro_wheel *wheel, struct coro_timer *timer)
+{
+	if (wheel->count == 0) {
+		/* Nothing to process, can jump right to the present. */
+		uint64_t now = coro_clock_ns() / coro_wheel_tick_ns;
+		if (now > wheel->now)
+			wheel->now = now;
+	}
+	/* The current tick is already processed. */
+	if (timer->deadline <= wheel->now)
+		timer->deadline = wheel->now + 1;
+	coro_wheel_place(wheel, timer);
+	++wheel->count;
+}
+
+static void
+coro_wheel_del(struct coro_wheel *wheel, struct coro_timer *timer)
+{
+	assert(wheel->count > 0);
+	rlist_del_entry(timer, link);
+	--wheel->count;
+}
+
+/**
+ * Process all the ticks up to the given one. The expired timers
+ * are moved to the @a expired list.
+ */
+static void
+coro_wheel_advance(struct coro_wheel *wheel, uint64_t to,
+	struct rlist *expired)
+{
+	while (wheel->now < to) {
+		if (wheel->count == 0) {
+			wheel->now = to;
+			return;
+		}
+		uint64_t t = ++wheel->now;
+		/*
+		 * Cascade from the top, so the timers moved down
+		 * into a slot which is also due now are not missed.
+		 */
+		for (int l = CORO_WHEEL_LEVELS - 1; l > 0; --l) {
+			uint64_t mask = ((uint64_t)1 << (CORO_WHEEL_BITS * l)) - 1;
+			if ((t & mask) != 0)
+				continue;
+			int idx = (t >> (CORO_WHEEL_BITS * l)) & CORO_WHEEL_MASK;
+			struct rlist slot;
+			rlist_create(&slot);
+			rlist_splice(&slot, &wheel->slots[l][idx]);
+			while (!rlist_empty(&slot)) {
+				struct coro_timer *timer = rlist_shift_entry(
+					&slot, struct coro_timer, link);
+				coro_wheel_place(wheel, timer);
+			}
+		}
+		struct rlist *slot = &wheel->slots[0][t & CORO_WHEEL_MASK];
+		while (!rlist_empty(slot)) {
+			struct coro_timer *timer = rlist_shift_entry(slot,
+				struct coro_timer, link);
+			assert(timer->deadline <= t);
+			--wheel->count;
+			rlist_add_tail_entry(expired, timer, link);
+		}
+	}
+}
+
+/**
+ * The nearest tick when something has to be done with the timers:
+ * either one of them expires, or a higher level slot needs to be
+ * cascaded. UINT64_MAX if there are no timers.
+ */
+static uint64_t
+coro_wheel_next(const struct coro_wheel *wheel)
+{
+	if (wheel->count == 0)
+		return UINT64_MAX;
+	uint64_t res = UINT64_MAX;
+	for (int l = 0; l < CORO_WHEEL_LEVELS; ++l) {
+		int shift = CORO_WHEEL_BITS * l;
+		uint64_t base = wheel->now >> shift;
+		for (uint64_t i = 1; i <= CORO_WHEEL_SIZE; ++i) {
+			int idx = (base + i) & CORO_WHEEL_MASK;
+			if (rlist_empty(&wheel->slots[l][idx]))
+				continue;
+			uint64_t tick = (base + i) << shift;
+			if (tick < res)
+				res = tick;
+			break;
+		}
+	}
+	return res;
+}
+
+static void
+coro_engine_create(struct coro_engine *engine)
+{
+	memset(engine, 0, sizeof(*engine));
+	engine->thread = pthread_self();
+	rlist_create(&engine->sched.link);
+	for (int i = 0; i < CORO_PRIORITY_COUNT; ++i) {
+		rlist_create(&engine->coros_runnable[i]);
+		engine->credits[i] = coro_priority_weights[i];
+	}
+	engine->is_fair = true;
+	for (int i = 0; i < CORO_STACK_CLASS_COUNT; ++i) {
+		struct coro_stack_class *cls = &engine->coros_pool[i];
+		rlist_create(&cls->hot);
+		rlist_create(&cls->cold);
+	}
+	engine->pool_limit = coro_pool_limit_default;
+	coro_wheel_create(&engine->wheel);
+	pthread_mutex_init(&engine->mutex, NULL);
+	engine->epoll_fd = -1;
+	engine->event_fd = -1;
+	rlist_create(&engine->coros_free);
+	/* Make sure it is cached before any threads appear. */
+	coro_page_size();
+}
+
+static struct coro_engine glob_engine;
+
+/**
+ * Engine run by this thread right now. Only its owner thread can
+ * push into its run queue in the M:N mode. NULL means the thread
+ * doesn't run any engine, and works with the global one.
+ */
+static __thread struct coro_engine *coro_engine_current = NULL;
+
+/**
+ * Get the engine of the current thread. In the M:N mode a
+ * coroutine can continue in another thread after any switch, so
+ * the engine must be fetched again after each of them. The
+ * function is not inlined so the compiler wouldn't cache the
+ * thread-local address across the switches.
+ */
+static __attribute__((noinline)) struct coro_engine *
+coro_engine_this(void)
+{
+	struct coro_engine *engine = coro_engine_current;
+	__asm__ volatile("" ::: "memory");
+	if (engine == NULL)
+		return &glob_engine;
+	return engine;
+}
+
+/**
+ * Get the engine to handle a coroutine. In the M:N mode any engine
+ * of the group can, so it is the one of the current thread if it
+ * is in the group. A single thread engine handles only its own
+ * coroutines, and can be not the current one when used from
+ * outside of the scheduler or from another thread.
+ */
+static inline struct coro_engine *
+coro_engine_of(const struct coro *coro)
+{
+	struct coro_engine *home = coro->home;
+	if (home->group == NULL)
+		return home;
+	struct coro_engine *engine = coro_engine_this();
+	if (engine->group == home->group)
+		return engine;
+	return home;
+}
+
+static inline enum coro_state
+coro_state_get(const struct coro *c)
+{
+	return __atomic_load_n(&c->state, __ATOMIC_ACQUIRE);
+}
+
+static inline void
+coro_state_set(struct coro *c, enum coro_state state)
+{
+	__atomic_store_n(&c->state, state, __ATOMIC_SEQ_CST);
+}
+
+////////////////////////////////////////////////////////////////////
+// M:N mode run queues
+
+/**
+ * Push a runnable coroutine to the owner's queue. Only the owner
+ * can push. When the queue is full, false is returned.
+ */
+static bool
+coro_runq_push(struct coro_runq *q, struct coro *c)
+{
+	uint32_t tail = q->tail;
+	uint32_t head = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+	if (tail - head >= CORO_RUNQ_SIZE)
+		return false;
+	__atomic_store_n(&q->slots[tail % CORO_RUNQ_SIZE], c,
+		__ATOMIC_RELAXED);
+	__atomic_store_n(&q->tail, tail + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+/** Take the oldest coroutine from the owner's queue. */
+static struct coro *
+coro_runq_pop(struct coro_runq *q)
+{
+	while (true) {
+		uint32_t head = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+		uint32_t tail = q->tail;
+		if (tail == head)
+			return NULL;
+		struct coro *c = __atomic_load_n(
+			&q->slots[head % CORO_RUNQ_SIZE], __ATOMIC_RELAXED);
+		if (__atomic_compare_exchange_n(&q->head, &head, head + 1,
+				false, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+			return c;
+	}
+}
+
+/**
+ * Take a half of the coroutines from another thread's queue.
+ * Returns how many were saved into @a buf.
+ */
+static uint32_t
+coro_runq_grab(struct coro_runq *q, struct coro **buf)
+{
+	while (true) {
+		uint32_t head = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+		uint32_t tail = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+		uint32_t count = tail - head;
+		count -= count / 2;
+		if (count == 0)
+			return 0;
+		/* Head and tail were read not at once. */
+		if (count > CORO_RUNQ_SIZE / 2)
+			continue;
+		for (uint32_t i = 0; i < count; ++i) {
+			buf[i] = __atomic_load_n(
+				&q->slots[(head + i) % CORO_RUNQ_SIZE],
+				__ATOMIC_RELAXED);
+		}
+		if (__atomic_compare_exchange_n(&q->head, &head, head + count,
+				false, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+			return count;
+	}
+}
+
+/** Wake up the idle threads if there are any. */
+static void
+coro_group_notify(struct coro_group *group, bool is_all)
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&group->idle_count, __ATOMIC_RELAXED) == 0 &&
+	    !is_all)
+		return;
+	pthread_mutex_lock(&group->mutex);
+	/* The idle threads which don't poll wait on the condition. */
+	bool is_cond_idle = __atomic_load_n(&group->idle_count,
+		__ATOMIC_RELAXED) > group->poll_count;
+	if (is_all)
+		pthread_cond_broadcast(&group->cond);
+	else if (is_cond_idle)
+		pthread_cond_signal(&group->cond);
+	if ((is_all || !is_cond_idle) && group->poll_count > 0) {
+		uint64_t one = 1;
+		for (int i = 0; i < group->engine_count; ++i) {
+			struct coro_engine *e = group->engines[i];
+			if (!e->is_polling)
+				continue;
+			if (write(e->event_fd, &one, sizeof(one)) < 0)
+				handle_error();
+			if (!is_all)
+				break;
+		}
+	}
+	pthread_mutex_unlock(&group->mutex);
+}
+
+/**
+ * Make a coroutine runnable in the M:N mode. It goes to the queue
+ * of the given engine, or to the shared queue if the engine is
+ * NULL or its queue is full.
+ */
+static void
+coro_group_push(struct coro_group *group, struct coro_engine *engine,
+	struct coro *c)
+{
+	if (engine == NULL || !coro_runq_push(&engine->runq, c)) {
+		pthread_mutex_lock(&group->mutex);
+		rlist_add_tail_entry(&group->coros_shared, c, link);
+		__atomic_add_fetch(&group->shared_count, 1, __ATOMIC_RELAXED);
+		pthread_mutex_unlock(&group->mutex);
+	}
+	coro_group_notify(group, false);
+}
+
+/** Pop a coroutine from the shared queue. The mutex must be held. */
+static struct coro *
+coro_group_pop_shared_locked(struct coro_group *group)
+{
+	if (rlist_empty(&group->coros_shared))
+		return NULL;
+	__atomic_sub_fetch(&group->shared_count, 1, __ATOMIC_RELAXED);
+	return rlist_shift_entry(&group->coros_shared, struct coro, link);
+}
+
+/** Account a coroutine which became runnable or running. */
+static inline void
+coro_group_activate(struct coro_group *group)
+{
+	__atomic_add_fetch(&group->active_count, 1, __ATOMIC_SEQ_CST);
+}
+
+/**
+ * Account a coroutine which stopped being runnable. The last one
+ * means the work is over, and all the threads must stop.
+ */
+static inline void
+coro_group_deactivate(struct coro_group *group)
+{
+	if (__atomic_sub_fetch(&group->active_count, 1, __ATOMIC_SEQ_CST) != 0)
+		return;
+	if (__atomic_load_n(&group->timer_count, __ATOMIC_SEQ_CST) == 0 &&
+	    __atomic_load_n(&group->fd_count, __ATOMIC_SEQ_CST) == 0)
+		coro_group_notify(group, true);
+}
+
+/**
+ * Steal a half of the runnable coroutines of another thread. One
+ * of them is returned, the others are put into the own queue.
+ */
+static struct coro *
+coro_engine_steal(struct coro_engine *engine)
+{
+	struct coro_group *group = engine->group;
+	struct coro *buf[CORO_RUNQ_SIZE / 2];
+	for (int i = 1; i < group->engine_count; ++i) {
+		int idx = (engine->idx + i) % group->engine_count;
+		uint32_t count = coro_runq_grab(&group->engines[idx]->runq, buf);
+		if (count == 0)
+			continue;
+		/* Stealing is done with an empty own queue, all fits. */
+		for (uint32_t j = 1; j < count; ++j) {
+			bool ok = coro_runq_push(&engine->runq, buf[j]);
+			assert(ok);
+			(void)ok;
+		}
+		return buf[0];
+	}
+	return NULL;
+}
+
+/**
+ * Find a coroutine to run in the M:N mode: in the own queue, in
+ * the shared one, or steal from the other threads.
+ */
+static struct coro *
+coro_engine_find_work(struct coro_engine *engine)
+{
+	struct coro_group *group = engine->group;
+	struct coro *c = coro_runq_pop(&engine->runq);
+	if (c != NULL)
+		return c;
+	if (__atomic_load_n(&group->shared_count, __ATOMIC_RELAXED) > 0) {
+		pthread_mutex_lock(&group->mutex);
+		c = coro_group_pop_shared_locked(group);
+		pthread_mutex_unlock(&group->mutex);
+		if (c != NULL)
+			return c;
+	}
+	return coro_engine_steal(engine);
+}
+
+////////////////////////////////////////////////////////////////////
+
+/** Make a coroutine runnable in the single thread mode. */
+static void
+coro_engine_push_local(struct coro_engine *engine, struct coro *c)
+{
+	assert(engine->group == NULL);
+	assert(rlist_empty(&c->link));
+	rlist_add_tail_entry(&engine->coros_runnable[
+		coro_priority_idx(c->priority)], c, link);
+	++engine->runnable_count;
+}
+
+/**
+ * Take the next coroutine to run in the single thread mode. It is
+ * the first one of the highest priority, unless that priority used
+ * up its share of the CPU while the lower ones were waiting.
+ */
+static struct coro *
+coro_engine_pop_local(struct coro_engine *engine)
+{
+	assert(engine->runnable_count > 0);
+	int idx = -1;
+	int idx_first = -1;
+	for (int i = 0; i < CORO_PRIORITY_COUNT; ++i) {
+		if (rlist_empty(&engine->coros_runnable[i]))
+			continue;
+		if (idx_first < 0)
+			idx_first = i;
+		if (!engine->is_fair || engine->credits[i] > 0) {
+			idx = i;
+			break;
+		}
+	}
+	if (idx < 0) {
+		/* Everyone waiting has had the turn, a new round. */
+		for (int i = 0; i < CORO_PRIORITY_COUNT; ++i)
+			engine->credits[i] = coro_priority_weights[i];
+		idx = idx_first;
+	}
+	--engine->credits[idx];
+	--engine->runnable_count;
+	return rlist_shift_entry(&engine->coros_runnable[idx], struct coro,
+		link);
+}
+
+/**
+ * Switch from the current coroutine to the scheduler. The action
+ * tells the scheduler what to do with the coroutine once its
+ * context is saved. In the M:N mode the coroutine can be resumed
+ * in another thread.
+ */
+static void
+coro_engine_switch_to_sched(struct coro_engine *engine,
+	enum coro_action action)
+{
+	struct coro *c = engine->this_coro;
+	assert(c != NULL);
+	assert(engine->action == CORO_ACTION_NONE);
+	engine->action = action;
+	if (action != CORO_ACTION_SUSPEND) {
+		coro_ctx_switch(&c->ctx, &engine->sched.ctx);
+		return;
+	}
+	coro_debug_wait_begin(c);
+	coro_ctx_switch(&c->ctx, &engine->sched.ctx);
+	coro_debug_wait_end(c);
+}
+
+static bool
+coro_engine_wakeup(struct coro_engine *engine, struct coro *coro);
+
+/**
+ * Make a running coroutine runnable again after it yielded or
+ * was woken up.
+ */
+static void
+coro_engine_push_runnable(struct coro_engine *engine, struct coro *c)
+{
+	assert(coro_state_get(c) == CORO_STATE_RUNNING);
+	coro_stats_ready(c);
+	if (engine->group == NULL) {
+		assert(rlist_empty(&c->link));
+		coro_engine_push_local(engine, c);
+		return;
+	}
+	coro_group_push(engine->group, engine, c);
+}
+
+/**
+ * The wait queues are protected by a spinlock in the M:N mode. It
+ * is held only for a few list operations.
+ */
+static inline void
+coro_wait_queue_lock(struct coro_engine *engine, struct coro_wait_queue *queue)
+{
+	if (engine->group == NULL)
+		return;
+	int spin_count = 0;
+	while (__atomic_exchange_n(&queue->lock, 1, __ATOMIC_ACQUIRE) != 0) {
+		while (__atomic_load_n(&queue->lock, __ATOMIC_RELAXED) != 0) {
+			/* The owner thread might be preempted. */
+			if (++spin_count % 64 == 0)
+				sched_yield();
+		}
+	}
+}
+
+static inline void
+coro_wait_queue_unlock(struct coro_engine *engine,
+	struct coro_wait_queue *queue)
+{
+	if (engine->group != NULL)
+		__atomic_store_n(&queue->lock, 0, __ATOMIC_RELEASE);
+}
+
+/**
+ * Take a coroutine which has just been made running out of the
+ * wait queue where it was suspended, if any. Then its link is free
+ * for the run queues. A waker owning the queue has done it already.
+ */
+static inline void
+coro_wait_queue_leave(struct coro_engine *engine, struct coro *c)
+{
+	struct coro_wait_queue *queue = __atomic_load_n(&c->wait_queue,
+		__ATOMIC_ACQUIRE);
+	if (queue == NULL)
+		return;
+	coro_wait_queue_lock(engine, queue);
+	/* The queue owner could take it out concurrently. */
+	if (c->wait_queue == queue) {
+		rlist_del_entry(c, link);
+		__atomic_store_n(&c->wait_queue, NULL, __ATOMIC_RELEASE);
+	}
+	coro_wait_queue_unlock(engine, queue);
+}
+
+/** Publish the suspension of a coroutine whose context is saved. */
+static void
+coro_engine_publish_suspend(struct coro_engine *engine, struct coro *c)
+{
+	struct coro_group *group = engine->group;
+	if (group == NULL) {
+		c->state = CORO_STATE_SUSPENDED;
+		return;
+	}
+	coro_state_set(c, CORO_STATE_SUSPENDED);
+	/*
+	 * A wakeup could come from another thread while the
+	 * coroutine was still running. Then it is continued right
+	 * away. The mark is consumed only together with the
+	 * coroutine. Otherwise it might be already running in
+	 * another thread, and the mark could belong to a newer
+	 * wakeup, which would be lost.
+	 */
+	enum coro_state state = CORO_STATE_SUSPENDED;
+	if (__atomic_load_n(&c->is_wakeup_pending, __ATOMIC_SEQ_CST) &&
+	    __atomic_compare_exchange_n(&c->state, &state,
+			CORO_STATE_RUNNING, false, __ATOMIC_SEQ_CST,
+			__ATOMIC_SEQ_CST)) {
+		__atomic_store_n(&c->is_wakeup_pending, false,
+			__ATOMIC_SEQ_CST);
+		coro_wait_queue_leave(engine, c);
+		coro_stats_ready(c);
+		coro_group_push(group, engine, c);
+		return;
+	}
+	coro_group_deactivate(group);
+}
+
+/** Publish the end of a coroutine whose context is saved. */
+static void
+coro_engine_publish_finish(struct coro_engine *engine, struct coro *c)
+{
+	coro_state_set(c, CORO_STATE_FINISHED);
+	struct coro *joiner = __atomic_load_n(&c->joiner, __ATOMIC_SEQ_CST);
+	if (joiner != NULL)
+		coro_engine_wakeup(engine, joiner);
+	if (engine->group != NULL)
+		coro_group_deactivate(engine->group);
+}
+
+/**
+ * Run the coroutine until it switches back to the scheduler, and
+ * handle what it asked for. Then run the coroutine it switched
+ * to, if any.
+ */
+static void
+coro_engine_resume(struct coro_engine *engine, struct coro *c)
+{
+	assert(engine->this_coro == NULL);
+	engine->switch_count = 0;
+	while (c != NULL) {
+		assert(rlist_empty(&c->link));
+		c->engine = engine;
+		engine->this_coro = c;
+		coro_stats_run_begin(engine, c);
+		coro_ctx_switch(&engine->sched.ctx, &c->ctx);
+		/* Not the same one after a direct switch. */
+		c = engine->this_coro;
+		engine->this_coro = NULL;
+		enum coro_action action = engine->action;
+		engine->action = CORO_ACTION_NONE;
+		/* Before the publication, then it can run elsewhere. */
+		coro_stats_run_end(engine, c, action == CORO_ACTION_SUSPEND);
+		struct coro *next = NULL;
+		switch (action) {
+		case CORO_ACTION_SWITCH:
+			next = engine->switch_target;
+			engine->switch_target = NULL;
+			coro_engine_push_runnable(engine, c);
+			break;
+		case CORO_ACTION_YIELD:
+			coro_engine_push_runnable(engine, c);
+			break;
+		case CORO_ACTION_SUSPEND:
+			coro_engine_publish_suspend(engine, c);
+			break;
+		case CORO_ACTION_FINISH:
+			coro_engine_publish_finish(engine, c);
+			break;
+		default:
+			assert(false);
+		}
+		c = next;
+	}
+}
+
+static void
+coro_engine_suspend(struct coro_engine *engine)
+{
+	struct coro *this_coro = engine->this_coro;
+	if (this_coro == NULL) {
+		printf("Error: deadlock - suspension with no active "
+			"coroutines\n");
+		exit(-1);
+	}
+	assert(rlist_empty(&this_coro->link));
+	assert(coro_state_get(this_coro) == CORO_STATE_RUNNING);
+	coro_engine_switch_to_sched(engine, CORO_ACTION_SUSPEND);
+}
+
+/**
+ * Suspend the current coroutine, remembering what it waits for.
+ * The object is anything identifying the awaited event.
+ */
+static void
+coro_engine_suspend_on(struct coro_engine *engine, const char *what,
+	const void *object)
+{
+	struct coro *this_coro = engine->this_coro;
+	if (this_coro != NULL) {
+		this_coro->wait_what = what;
+		this_coro->wait_object = object;
+	}
+	coro_engine_suspend(engine);
+}
+
+static void
+coro_engine_yield(struct coro_engine *engine)
+{
+	assert(rlist_empty(&engine->this_coro->link));
+	assert(coro_state_get(engine->this_coro) == CORO_STATE_RUNNING);
+	coro_engine_switch_to_sched(engine, CORO_ACTION_YIELD);
+}
+
+/**
+ * Yield to the given coroutine right away. In the single thread
+ * mode the context is switched directly, bypassing the scheduler
+ * and the queues. In the M:N mode the current coroutine can be
+ * published only after its context is saved, so the switch goes
+ * through the scheduler, but still without a queue.
+ */
+static void
+coro_engine_switch_to(struct coro_engine *engine, struct coro *target)
+{
+	struct coro *c = engine->this_coro;
+	if (c == NULL) {
+		coro_engine_wakeup(engine, target);
+		return;
+	}
+	if (target == c)
+		return;
+	if (++engine->switch_count > CORO_SWITCH_MAX) {
+		coro_engine_wakeup(engine, target);
+		coro_engine_yield(engine);
+		return;
+	}
+	struct coro_group *group = engine->group;
+	if (group == NULL) {
+		if (target->state == CORO_STATE_SUSPENDED) {
+			target->state = CORO_STATE_RUNNING;
+			coro_wait_queue_leave(engine, target);
+		} else if (target->state == CORO_STATE_RUNNING &&
+			   !rlist_empty(&target->link)) {
+			/* Runnable already, jumps the queue. */
+			rlist_del_entry(target, link);
+			--engine->runnable_count;
+		} else {
+			coro_engine_yield(engine);
+			return;
+		}
+		coro_stats_ready(target);
+		coro_engine_push_runnable(engine, c);
+		coro_stats_run_end(engine, c, false);
+		coro_stats_run_begin(engine, target);
+		target->engine = engine;
+		engine->this_coro = target;
+		coro_ctx_switch(&c->ctx, &target->ctx);
+		return;
+	}
+	coro_group_activate(group);
+	enum coro_state state = CORO_STATE_SUSPENDED;
+	if (!__atomic_compare_exchange_n(&target->state, &state,
+			CORO_STATE_RUNNING, false, __ATOMIC_SEQ_CST,
+			__ATOMIC_SEQ_CST)) {
+		/* Running or queued somewhere. */
+		coro_group_deactivate(group);
+		coro_engine_wakeup(engine, target);
+		coro_engine_yield(engine);
+		return;
+	}
+	coro_wait_queue_leave(engine, target);
+	coro_stats_ready(target);
+	engine->switch_target = target;
+	coro_engine_switch_to_sched(engine, CORO_ACTION_SWITCH);
+}
+
+/**
+ * Make a suspended coroutine running in the M:N mode, and account
+ * it as active. Returns false if it wasn't suspended. A coroutine
+ * which is still running gets a pending wakeup instead.
+ */
+static bool
+coro_group_claim(struct coro_group *group, struct coro *coro)
+{
+	/*
+	 * The coroutine is accounted as active in advance, so the
+	 * threads wouldn't see zero active coroutines while it is
+	 * being pushed.
+	 */
+	coro_group_activate(group);
+	enum coro_state state = CORO_STATE_SUSPENDED;
+	if (!__atomic_compare_exchange_n(&coro->state, &state,
+			CORO_STATE_RUNNING, false, __ATOMIC_SEQ_CST,
+			__ATOMIC_SEQ_CST)) {
+		if (state == CORO_STATE_FINISHED) {
+			coro_group_deactivate(group);
+			return false;
+		}
+		/*
+		 * Running, but might be about to suspend. Leave a
+		 * mark and try again in case the suspension was
+		 * published in between.
+		 */
+		__atomic_store_n(&coro->is_wakeup_pending, true,
+			__ATOMIC_SEQ_CST);
+		state = CORO_STATE_SUSPENDED;
+		if (!__atomic_compare_exchange_n(&coro->state, &state,
+				CORO_STATE_RUNNING, false, __ATOMIC_SEQ_CST,
+				__ATOMIC_SEQ_CST)) {
+			coro_group_deactivate(group);
+			return false;
+		}
+	}
+	return true;
+}
+
+/**
+ * Make a suspended coroutine runnable. Returns false if it wasn't
+ * suspended. In the M:N mode a coroutine which is still running
+ * gets a pending wakeup instead.
+ */
+static bool
+coro_engine_wakeup(struct coro_engine *engine, struct coro *coro)
+{
+	struct coro_group *group = engine->group;
+	if (group == NULL) {
+		if (coro->state == CORO_STATE_RUNNING)
+			return false;
+		if (coro->state == CORO_STATE_FINISHED)
+			return false;
+		assert(coro->state == CORO_STATE_SUSPENDED);
+		coro->state = CORO_STATE_RUNNING;
+		coro_wait_queue_leave(engine, coro);
+		coro_stats_ready(coro);
+		coro_engine_push_local(engine, coro);
+		return true;
+	}
+	if (!coro_group_claim(group, coro))
+		return false;
+	coro_wait_queue_leave(engine, coro);
+	coro_stats_ready(coro);
+	/* A foreign thread doesn't own any queue. */
+	if (coro_engine_current != engine)
+		engine = NULL;
+	coro_group_push(group, engine, coro);
+	return true;
+}
+
+/**
+ * Wake up a coroutine of a single thread engine from a thread not
+ * running it. Only the owner can touch the engine's queues, so the
+ * coroutine is pushed to the remote wakeups, and the owner takes
+ * them on its next pass. A coroutine already there isn't pushed
+ * again. The event descriptor wakes the owner up if it sleeps in
+ * epoll, or tells a foreign loop to run the engine.
+ */
+static void
+coro_engine_wakeup_remote(struct coro_engine *engine, struct coro *coro)
+{
+	if (__atomic_exchange_n(&coro->is_remote_queued, true,
+			__ATOMIC_ACQ_REL))
+		return;
+	struct coro *head = __atomic_load_n(&engine->remote_wakeups,
+		__ATOMIC_RELAXED);
+	do {
+		coro->remote_next = head;
+	} while (!__atomic_compare_exchange_n(&engine->remote_wakeups, &head,
+		coro, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+	if (head != NULL)
+		return;
+	int fd = __atomic_load_n(&engine->event_fd, __ATOMIC_ACQUIRE);
+	if (fd < 0)
+		return;
+	uint64_t one = 1;
+	if (write(fd, &one, sizeof(one)) < 0)
+		handle_error();
+	/* After the write, so the owner can't miss it. */
+	__atomic_store_n(&engine->is_remote_signalled, true,
+		__ATOMIC_RELEASE);
+}
+
+/** Wake up the coroutines woken up by the other threads. */
+static void
+coro_engine_process_remote(struct coro_engine *engine)
+{
+	if (__atomic_load_n(&engine->is_remote_signalled, __ATOMIC_RELAXED)) {
+		__atomic_store_n(&engine->is_remote_signalled, false,
+			__ATOMIC_RELAXED);
+		uint64_t value;
+		if (read(engine->event_fd, &value, sizeof(value)) < 0 &&
+		    errno != EAGAIN)
+			handle_error();
+	}
+	if (__atomic_load_n(&engine->remote_wakeups, __ATOMIC_RELAXED) == NULL)
+		return;
+	struct coro *c = __atomic_exchange_n(&engine->remote_wakeups, NULL,
+		__ATOMIC_ACQUIRE);
+	/* The stack is in the reverse order of the wakeups. */
+	struct coro *list = NULL;
+	while (c != NULL) {
+		struct coro *next = c->remote_next;
+		c->remote_next = list;
+		list = c;
+		c = next;
+	}
+	while (list != NULL) {
+		c = list;
+		list = c->remote_next;
+		/* From now on it can be pushed again. */
+		__atomic_store_n(&c->is_remote_queued, false, __ATOMIC_RELEASE);
+		coro_engine_wakeup(engine, c);
+	}
+}
+
+/**
+ * Take a finished coroutine out of the remote wakeups of its home
+ * engine. It could be woken up locally first, by a timeout or
+ * anything else, and finish while a wakeup from another thread is
+ * still queued. Then its object can't be reused or freed until
+ * the owner takes the wakeup, or the remote list would point into
+ * it. The other thread could be between marking the coroutine and
+ * pushing it, so it is waited for.
+ */
+static void
+coro_engine_drop_remote(struct coro *coro)
+{
+	struct coro_engine *home = coro->home;
+	while (__atomic_load_n(&coro->is_remote_queued, __ATOMIC_ACQUIRE))
+		coro_engine_process_remote(home);
+}
+
+/**
+ * Wake up a coroutine from any thread. A single thread engine is
+ * only touched by the thread running it.
+ */
+static void
+coro_engine_wakeup_any(struct coro_engine *engine, struct coro *coro)
+{
+	if (engine->group == NULL && engine != coro_engine_this())
+		coro_engine_wakeup_remote(engine, coro);
+	else
+		coro_engine_wakeup(engine, coro);
+}
+
+/**
+ * Put the current coroutine into a wait queue while it still runs.
+ * It is taken out of the queue by whoever wakes it up. A wakeup
+ * from now on isn't lost: in the M:N mode it becomes a pending
+ * wakeup of the running coroutine, and its suspension returns
+ * right away.
+ */
+static void
+coro_engine_wait_queue_prepare(struct coro_engine *engine,
+	struct coro_wait_queue *queue)
+{
+	struct coro *c = engine->this_coro;
+	if (c == NULL) {
+		/* Reports the deadlock. */
+		coro_engine_suspend(engine);
+		return;
+	}
+	assert(rlist_empty(&c->link));
+	coro_wait_queue_lock(engine, queue);
+	rlist_add_tail_entry(&queue->coros, c, link);
+	__atomic_store_n(&c->wait_queue, queue, __ATOMIC_RELEASE);
+	coro_wait_queue_unlock(engine, queue);
+}
+
+/** Suspend the coroutine put into the queue by the prepare. */
+static void
+coro_engine_wait_queue_commit(struct coro_engine *engine,
+	struct coro_wait_queue *queue)
+{
+	struct coro *c = engine->this_coro;
+	c->wait_what = "wait queue";
+	c->wait_object = queue;
+	coro_engine_switch_to_sched(engine, CORO_ACTION_SUSPEND);
+	assert(c->wait_queue == NULL);
+}
+
+/**
+ * Take the prepared coroutine out of the queue without suspending.
+ * Returns true if it was woken up meanwhile.
+ */
+static bool
+coro_engine_wait_queue_abort(struct coro_engine *engine,
+	struct coro_wait_queue *queue)
+{
+	struct coro *c = engine->this_coro;
+	coro_wait_queue_lock(engine, queue);
+	bool is_woken = c->wait_queue != queue;
+	if (!is_woken) {
+		rlist_del_entry(c, link);
+		__atomic_store_n(&c->wait_queue, NULL, __ATOMIC_RELEASE);
+	}
+	coro_wait_queue_unlock(engine, queue);
+	return is_woken;
+}
+
+/**
+ * Take the first coroutine out of a wait queue and make it running.
+ * In the M:N mode a coroutine can be in the queue while it is still
+ * running. It gets a pending wakeup then, and NULL is returned.
+ */
+static struct coro *
+coro_engine_wait_queue_claim(struct coro_engine *engine,
+	struct coro_wait_queue *queue)
+{
+	struct coro *c = rlist_shift_entry(&queue->coros, struct coro, link);
+	__atomic_store_n(&c->wait_queue, NULL, __ATOMIC_RELEASE);
+	struct coro_group *group = engine->group;
+	if (group == NULL) {
+		assert(c->state == CORO_STATE_SUSPENDED);
+		c->state = CORO_STATE_RUNNING;
+	} else if (!coro_group_claim(group, c)) {
+		return NULL;
+	}
+	coro_stats_ready(c);
+	return c;
+}
+
+static bool
+coro_engine_wait_queue_wakeup_one(struct coro_engine *engine,
+	struct coro_wait_queue *queue)
+{
+	coro_wait_queue_lock(engine, queue);
+	if (rlist_empty(&queue->coros)) {
+		coro_wait_queue_unlock(engine, queue);
+		return false;
+	}
+	struct coro *c = coro_engine_wait_queue_claim(engine, queue);
+	coro_wait_queue_unlock(engine, queue);
+	if (c == NULL)
+		return true;
+	struct coro_group *group = engine->group;
+	if (group == NULL) {
+		coro_engine_push_local(engine, c);
+		return true;
+	}
+	if (coro_engine_current != engine)
+		engine = NULL;
+	coro_group_push(group, engine, c);
+	return true;
+}
+
+/**
+ * Make all the coroutines of a wait queue runnable. In the single
+ * thread mode the queue is spliced into the run queue as a whole,
+ * except for the coroutines of a not normal priority. In the M:N
+ * mode the woken coroutines fill the own run queue of the thread,
+ * and the rest is spliced into the shared one. The idle threads
+ * are notified once.
+ */
+static void
+coro_engine_wait_queue_wakeup_all(struct coro_engine *engine,
+	struct coro_wait_queue *queue)
+{
+	struct coro_group *group = engine->group;
+	if (group == NULL) {
+		size_t count = 0;
+		struct coro *c, *tmp;
+		rlist_foreach_entry_safe(c, &queue->coros, link, tmp) {
+			assert(c->state == CORO_STATE_SUSPENDED);
+			c->state = CORO_STATE_RUNNING;
+			c->wait_queue = NULL;
+			coro_stats_ready(c);
+			if (c->priority == CORO_PRIORITY_NORMAL) {
+				++count;
+				continue;
+			}
+			rlist_del_entry(c, link);
+			coro_engine_push_local(engine, c);
+		}
+		rlist_splice_tail(&engine->coros_runnable[
+			coro_priority_idx(CORO_PRIORITY_NORMAL)],
+			&queue->coros);
+		engine->runnable_count += count;
+		return;
+	}
+	struct rlist coros;
+	rlist_create(&coros);
+	size_t count = 0;
+	coro_wait_queue_lock(engine, queue);
+	while (!rlist_empty(&queue->coros)) {
+		struct coro *c = coro_engine_wait_queue_claim(engine, queue);
+		if (c == NULL)
+			continue;
+		rlist_add_tail_entry(&coros, c, link);
+		++count;
+	}
+	coro_wait_queue_unlock(engine, queue);
+	if (count == 0)
+		return;
+	bool is_many = count > 1;
+	/* A foreign thread doesn't own any queue. */
+	if (coro_engine_current == engine) {
+		while (!rlist_empty(&coros)) {
+			/* Can run elsewhere once pushed, unlink first. */
+			struct coro *c = rlist_shift_entry(&coros, struct coro,
+				link);
+			if (!coro_runq_push(&engine->runq, c)) {
+				rlist_add_entry(&coros, c, link);
+				break;
+			}
+			--count;
+		}
+	}
+	if (count > 0) {
+		pthread_mutex_lock(&group->mutex);
+		rlist_splice_tail(&group->coros_shared, &coros);
+		__atomic_add_fetch(&group->shared_count, count,
+			__ATOMIC_RELAXED);
+		pthread_mutex_unlock(&group->mutex);
+	}
+	coro_group_notify(group, is_many);
+}
+
+////////////////////////////////////////////////////////////////////
+
+static inline void
+coro_engine_mutex_lock(struct coro_engine *engine)
+{
+	if (engine->group != NULL)
+		pthread_mutex_lock(&engine->mutex);
+}
+
+static inline void
+coro_engine_mutex_unlock(struct coro_engine *engine)
+{
+	if (engine->group != NULL)
+		pthread_mutex_unlock(&engine->mutex);
+}
+
+/**
+ * The threads can stop when no coroutines are active and nothing
+ * can wake up the suspended ones.
+ */
+static bool
+coro_group_is_over(struct coro_group *group)
+{
+	return __atomic_load_n(&group->active_count, __ATOMIC_SEQ_CST) == 0 &&
+	       __atomic_load_n(&group->timer_count, __ATOMIC_SEQ_CST) == 0 &&
+	       __atomic_load_n(&group->fd_count, __ATOMIC_SEQ_CST) == 0;
+}
+
+/**
+ * One timer less in the group. The last one might have been the
+ * only thing keeping the threads alive.
+ */
+static void
+coro_group_timer_del(struct coro_group *group)
+{
+	if (__atomic_sub_fetch(&group->timer_count, 1, __ATOMIC_SEQ_CST) != 0)
+		return;
+	if (coro_group_is_over(group))
+		coro_group_notify(group, true);
+}
+
+/** Same as coro_group_timer_del(), but for a descriptor wait. */
+static void
+coro_group_fd_del(struct coro_group *group)
+{
+	if (__atomic_sub_fetch(&group->fd_count, 1, __ATOMIC_SEQ_CST) != 0)
+		return;
+	if (coro_group_is_over(group))
+		coro_group_notify(group, true);
+}
+
+/** Arm the timer of the current coroutine. */
+static void
+coro_engine_timer_start(struct coro_engine *engine, double timeout)
+{
+	struct coro *c = engine->this_coro;
+	struct coro_timer *timer = &c->timer;
+	assert(timer->engine == NULL);
+	uint64_t now = coro_clock_ns();
+	uint64_t deadline = UINT64_MAX;
+	if (timeout <= 0)
+		deadline = now;
+	else if (timeout < 1e9)
+		deadline = now + (uint64_t)(timeout * 1e9);
+	/* Round up, the timer can't expire early. */
+	timer->deadline = deadline / coro_wheel_tick_ns +
+		(deadline % coro_wheel_tick_ns != 0);
+	timer->is_fired = false;
+	if (engine->group != NULL)
+		__atomic_add_fetch(&engine->group->timer_count, 1,
+			__ATOMIC_SEQ_CST);
+	coro_engine_mutex_lock(engine);
+	coro_wheel_add(&engine->wheel, timer);
+	/* Published under the lock, for the stoppers. */
+	__atomic_store_n(&timer->engine, engine, __ATOMIC_RELEASE);
+	coro_engine_mutex_unlock(engine);
+}
+
+/**
+ * Disarm the timer of a coroutine. Returns false if it has already
+ * expired. In the M:N mode the coroutine could have moved to
+ * another thread, so the wheel is found via the timer.
+ */
+static bool
+coro_timer_stop(struct coro *c)
+{
+	struct coro_timer *timer = &c->timer;
+	struct coro_engine *engine =
+		__atomic_load_n(&timer->engine, __ATOMIC_ACQUIRE);
+	if (engine == NULL)
+		return false;
+	coro_engine_mutex_lock(engine);
+	bool is_armed = timer->engine == engine;
+	if (is_armed) {
+		coro_wheel_del(&engine->wheel, timer);
+		timer->engine = NULL;
+	}
+	coro_engine_mutex_unlock(engine);
+	if (is_armed && engine->group != NULL)
+		coro_group_timer_del(engine->group);
+	return is_armed;
+}
+
+/** Wake up the coroutines whose timers have expired. */
+static void
+coro_engine_process_timers(struct coro_engine *engine)
+{
+	if (__atomic_load_n(&engine->wheel.count, __ATOMIC_RELAXED) == 0)
+		return;
+	uint64_t now = coro_clock_ns() / coro_wheel_tick_ns;
+	struct rlist expired;
+	rlist_create(&expired);
+	coro_engine_mutex_lock(engine);
+	coro_wheel_advance(&engine->wheel, now, &expired);
+	struct coro_timer *timer;
+	rlist_foreach_entry(timer, &expired, link) {
+		timer->engine = NULL;
+		timer->is_fired = true;
+	}
+	coro_engine_mutex_unlock(engine);
+	while (!rlist_empty(&expired)) {
+		timer = rlist_shift_entry(&expired, struct coro_timer, link);
+		struct coro *c = rlist_entry(timer, struct coro, timer);
+		struct coro_group *group = engine->group;
+		if (group == NULL) {
+			/* Already woken up by someone else. */
+			if (!coro_engine_wakeup(engine, c))
+				timer->is_fired = false;
+			continue;
+		}
+		/*
+		 * In the M:N mode the coroutine might be running
+		 * already and see the timeout. Then the wakeup is
+		 * just spurious.
+		 */
+		coro_engine_wakeup(engine, c);
+		coro_group_timer_del(group);
+	}
+}
+
+/** Nanoseconds until the nearest timer tick. 0 if it is due. */
+static uint64_t
+coro_engine_timer_wait_ns(struct coro_engine *engine)
+{
+	coro_engine_mutex_lock(engine);
+	uint64_t next = coro_wheel_next(&engine->wheel);
+	coro_engine_mutex_unlock(engine);
+	if (next == UINT64_MAX)
+		return UINT64_MAX;
+	uint64_t now = coro_clock_ns();
+	uint64_t deadline = next * coro_wheel_tick_ns;
+	return deadline > now ? deadline - now : 0;
+}
+
+/**
+ * Suspend the current coroutine until a wakeup or until the
+ * timeout passes. Returns false on the timeout. The wait is
+ * described as in coro_engine_suspend_on().
+ */
+static bool
+coro_engine_suspend_timeout(struct coro_engine *engine, double timeout,
+	const char *what, const void *object)
+{
+	if (engine->this_coro == NULL)
+		coro_engine_suspend(engine);
+	struct coro *c = engine->this_coro;
+	coro_engine_timer_start(engine, timeout);
+	coro_engine_suspend_on(engine, what, object);
+	/* Could be resumed in another thread. */
+	if (coro_timer_stop(c))
+		return true;
+	return !c->timer.is_fired;
+}
+
+////////////////////////////////////////////////////////////////////
+
+#if LIBCORO_USE_EPOLL
+
+static void
+coro_engine_poll_create(struct coro_engine *engine)
+{
+	if (engine->epoll_fd >= 0)
+		return;
+	engine->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (engine->epoll_fd < 0)
+		handle_error();
+	int event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (event_fd < 0)
+		handle_error();
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.fd = event_fd;
+	if (epoll_ctl(engine->epoll_fd, EPOLL_CTL_ADD, event_fd, &ev) != 0)
+		handle_error();
+	/* The other threads signal it for the remote wakeups. */
+	__atomic_store_n(&engine->event_fd, event_fd, __ATOMIC_RELEASE);
+}
+
+/** Epoll events the waiters of a descriptor are interested in. */
+static uint32_t
+coro_fd_waiters_events(const struct coro_fd_waiters *waiters)
+{
+	uint32_t events = 0;
+	if (waiters->reader != NULL)
+		events |= EPOLLIN | EPOLLRDHUP;
+	if (waiters->writer != NULL)
+		events |= EPOLLOUT;
+	return events;
+}
+
+/**
+ * Take the waiter of a descriptor out of its places. The epoll
+ * registration is updated separately. The mutex must be held.
+ */
+static void
+coro_engine_fd_waiter_detach(struct coro_engine *engine, struct coro *c)
+{
+	struct coro_fd_waiters *waiters = &engine->fd_waiters[c->fd_wait.fd];
+	assert(waiters->reader == c || waiters->writer == c);
+	if (waiters->reader == c)
+		waiters->reader = NULL;
+	if (waiters->writer == c)
+		waiters->writer = NULL;
+	c->fd_wait.engine = NULL;
+	--engine->fd_count;
+}
+
+/**
+ * Make the epoll registration of a descriptor match its remaining
+ * waiters. The mutex must be held.
+ */
+static void
+coro_engine_fd_update(struct coro_engine *engine, int fd)
+{
+	uint32_t events = coro_fd_waiters_events(&engine->fd_waiters[fd]);
+	/* Both fail if the descriptor is closed already, it is fine. */
+	if (events == 0) {
+		epoll_ctl(engine->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+		return;
+	}
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events | EPOLLET;
+	ev.data.fd = fd;
+	epoll_ctl(engine->epoll_fd, EPOLL_CTL_MOD, fd, &ev);
+}
+
+/**
+ * Stop the descriptor wait of a coroutine, if it wasn't ended by
+ * the descriptor readiness. In the M:N mode the coroutine could
+ * have moved to another thread, so the engine is found via the
+ * wait.
+ */
+static void
+coro_fd_wait_stop(struct coro *c)
+{
+	struct coro_fd_wait *wait = &c->fd_wait;
+	struct coro_engine *engine =
+		__atomic_load_n(&wait->engine, __ATOMIC_ACQUIRE);
+	if (engine == NULL)
+		return;
+	coro_engine_mutex_lock(engine);
+	bool is_waiting = wait->engine == engine;
+	if (is_waiting) {
+		coro_engine_fd_waiter_detach(engine, c);
+		coro_engine_fd_update(engine, wait->fd);
+	}
+	coro_engine_mutex_unlock(engine);
+	if (is_waiting && engine->group != NULL)
+		coro_group_fd_del(engine->group);
+}
+
+/**
+ * Wait for events on the descriptors. At most @a timeout_ns,
+ * UINT64_MAX means infinity. Returns the number of the events.
+ */
+static int
+coro_engine_poll_wait(struct coro_engine *engine, uint64_t timeout_ns)
+{
+	int timeout_ms = -1;
+	if (timeout_ns != UINT64_MAX) {
+		/* Round up, the timers can't be checked too early. */
+		uint64_t ms = (timeout_ns + 999999) / 1000000;
+		timeout_ms = ms < INT32_MAX ? (int)ms : INT32_MAX;
+	}
+	int count = epoll_wait(engine->epoll_fd, engine->poll_events,
+		CORO_POLL_BATCH, timeout_ms);
+	if (count >= 0)
+		return count;
+	if (errno != EINTR)
+		handle_error();
+	return 0;
+}
+
+/** Wake up the coroutines whose descriptors are ready. */
+static void
+coro_engine_poll_process(struct coro_engine *engine, int count)
+{
+	/* Each event can wake up a reader and a writer. */
+	struct coro *ready[CORO_POLL_BATCH * 2];
+	int ready_count = 0;
+	coro_engine_mutex_lock(engine);
+	for (int i = 0; i < count; ++i) {
+		struct epoll_event *ev = &engine->poll_events[i];
+		int fd = ev->data.fd;
+		if (fd == engine->event_fd) {
+			uint64_t value;
+			if (read(fd, &value, sizeof(value)) < 0 &&
+			    errno != EAGAIN)
+				handle_error();
+			continue;
+		}
+		/*
+		 * The wait could be stopped after the event was
+		 * taken.
+		 */
+		if (fd >= engine->fd_waiters_size)
+			continue;
+		struct coro_fd_waiters *waiters = &engine->fd_waiters[fd];
+		int revents = 0;
+		if ((ev->events & (EPOLLIN | EPOLLRDHUP)) != 0)
+			revents |= CORO_EVENT_READ;
+		if ((ev->events & EPOLLOUT) != 0)
+			revents |= CORO_EVENT_WRITE;
+		/* Let the callers see the error in the next I/O call. */
+		if ((ev->events & (EPOLLERR | EPOLLHUP)) != 0)
+			revents |= CORO_EVENT_READ | CORO_EVENT_WRITE;
+		struct coro *cs[2] = {waiters->reader, waiters->writer};
+		bool is_changed = false;
+		for (int j = 0; j < 2; ++j) {
+			struct coro *c = cs[j];
+			/* Waits for both the events and is seen twice. */
+			if (c == NULL || c->fd_wait.engine == NULL)
+				continue;
+			if ((revents & c->fd_wait.events) == 0)
+				continue;
+			c->fd_wait.revents = revents & c->fd_wait.events;
+			coro_engine_fd_waiter_detach(engine, c);
+			ready[ready_count++] = c;
+			is_changed = true;
+		}
+		if (is_changed)
+			coro_engine_fd_update(engine, fd);
+	}
+	coro_engine_mutex_unlock(engine);
+	for (int i = 0; i < ready_count; ++i) {
+		coro_engine_wakeup(engine, ready[i]);
+		if (engine->group != NULL)
+			coro_group_fd_del(engine->group);
+	}
+}
+
+static int
+coro_engine_wait_fd(struct coro_engine *engine, int fd, int events,
+	double timeout)
+{
+	if (engine->this_coro == NULL)
+		coro_engine_suspend(engine);
+	struct coro *c = engine->this_coro;
+	if (fd < 0) {
+		errno = EBADF;
+		return -1;
+	}
+	if ((events & (CORO_EVENT_READ | CORO_EVENT_WRITE)) == 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	coro_engine_poll_create(engine);
+	coro_engine_mutex_lock(engine);
+	if (fd >= engine->fd_waiters_size) {
+		int size = engine->fd_waiters_size * 2;
+		if (size <= fd)
+			size = fd + 1;
+		struct coro_fd_waiters *waiters =
+			(struct coro_fd_waiters *)realloc(engine->fd_waiters,
+				size * sizeof(waiters[0]));
+		if (waiters == NULL)
+			handle_error();
+		memset(waiters + engine->fd_waiters_size, 0,
+			(size - engine->fd_waiters_size) * sizeof(waiters[0]));
+		engine->fd_waiters = waiters;
+		engine->fd_waiters_size = size;
+	}
+	struct coro_fd_waiters *waiters = &engine->fd_waiters[fd];
+	if (((events & CORO_EVENT_READ) != 0 && waiters->reader != NULL) ||
+	    ((events & CORO_EVENT_WRITE) != 0 && waiters->writer != NULL)) {
+		coro_engine_mutex_unlock(engine);
+		errno = EEXIST;
+		return -1;
+	}
+	uint32_t old_events = coro_fd_waiters_events(waiters);
+	struct coro_fd_waiters new_waiters = *waiters;
+	if ((events & CORO_EVENT_READ) != 0)
+		new_waiters.reader = c;
+	if ((events & CORO_EVENT_WRITE) != 0)
+		new_waiters.writer = c;
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	/*
+	 * The registration lives only while somebody waits, so only
+	 * the new edges are interesting after it. Besides, a
+	 * level-triggered descriptor would keep waking up epoll until
+	 * the waiters unregister it.
+	 */
+	ev.events = coro_fd_waiters_events(&new_waiters) | EPOLLET;
+	ev.data.fd = fd;
+	int op = old_events == 0 ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+	if (epoll_ctl(engine->epoll_fd, op, fd, &ev) != 0) {
+		int err = errno;
+		coro_engine_mutex_unlock(engine);
+		errno = err;
+		return -1;
+	}
+	*waiters = new_waiters;
+	++engine->fd_count;
+	c->fd_wait.fd = fd;
+	c->fd_wait.events = events;
+	c->fd_wait.revents = 0;
+	__atomic_store_n(&c->fd_wait.engine, engine, __ATOMIC_RELEASE);
+	if (engine->group != NULL)
+		__atomic_add_fetch(&engine->group->fd_count, 1, __ATOMIC_SEQ_CST);
+	coro_engine_mutex_unlock(engine);
+
+	if (timeout < 0)
+		coro_engine_suspend_on(engine, "fd", NULL);
+	else
+		coro_engine_suspend_timeout(engine, timeout, "fd", NULL);
+	/* Could be resumed in another thread. */
+	coro_fd_wait_stop(c);
+	return c->fd_wait.revents;
+}
+
+#else /* !LIBCORO_USE_EPOLL */
+
+static int
+coro_engine_poll_wait(struct coro_engine *engine, uint64_t timeout_ns)
+{
+	(void)engine;
+	(void)timeout_ns;
+	/* No descriptors can be waited, never called. */
+	assert(false);
+	return 0;
+}
+
+static void
+coro_engine_poll_process(struct coro_engine *engine, int count)
+{
+	(void)engine;
+	(void)count;
+	assert(false);
+}
+
+static int
+coro_engine_wait_fd(struct coro_engine *engine, int fd, int events,
+	double timeout)
+{
+	(void)engine;
+	(void)fd;
+	(void)events;
+	(void)timeout;
+	errno = ENOSYS;
+	return -1;
+}
+
+#endif /* !LIBCORO_USE_EPOLL */
+
+/** Check the descriptors and wake up the ready coroutines. */
+static void
+coro_engine_poll(struct coro_engine *engine, uint64_t timeout_ns)
+{
+	int count = coro_engine_poll_wait(engine, timeout_ns);
+	coro_engine_poll_process(engine, count);
+}
+
+/**
+ * Run the coroutines until there is nothing to wait for, or until
+ * the deadline. The deadline is checked between the passes over
+ * the runnable coroutines. So with deadline 0 one pass is done, and
+ * nothing is waited for. Before a deadline the engine waits even
+ * when has nothing to do, because the other threads can wake its
+ * coroutines up. UINT64_MAX means no deadline.
+ */
+static void
+coro_engine_run_until(struct coro_engine *engine, uint64_t deadline)
+{
+	assert(engine->group == NULL);
+	engine->thread = pthread_self();
+	bool is_started = false;
+	while (true) {
+		if (engine->pass_left == 0) {
+			if (is_started && deadline != UINT64_MAX &&
+			    coro_clock_ns() >= deadline)
+				break;
+			is_started = true;
+			coro_engine_process_remote(engine);
+			coro_engine_process_timers(engine);
+			if (engine->fd_count > 0)
+				coro_engine_poll(engine, 0);
+			engine->pass_left = engine->runnable_count;
+			if (engine->pass_left == 0) {
+				uint64_t ns = coro_engine_timer_wait_ns(engine);
+				if (deadline == UINT64_MAX) {
+					if (ns == UINT64_MAX &&
+					    engine->fd_count == 0)
+						break;
+				} else {
+					/*
+					 * The other threads can wake the
+					 * coroutines up until the deadline.
+					 */
+					uint64_t now = coro_clock_ns();
+					if (now >= deadline)
+						break;
+					if (ns > deadline - now)
+						ns = deadline - now;
+				}
+				if (engine->epoll_fd >= 0) {
+					coro_engine_poll(engine, ns);
+					continue;
+				}
+				struct timespec ts;
+				ts.tv_sec = ns / 1000000000;
+				ts.tv_nsec = ns % 1000000000;
+				nanosleep(&ts, NULL);
+				continue;
+			}
+		}
+		/*
+		 * The queues could have been shrunk by a priority
+		 * change.
+		 */
+		if (engine->runnable_count == 0) {
+			engine->pass_left = 0;
+			continue;
+		}
+		--engine->pass_left;
+		coro_engine_resume(engine, coro_engine_pop_local(engine));
+	}
+}
+
+/** Scheduler loop of one thread in the M:N mode. */
+static void
+coro_engine_run_mt(struct coro_engine *engine)
+{
+	struct coro_group *group = engine->group;
+	while (true) {
+		coro_engine_process_timers(engine);
+		if (++engine->poll_skip_count >= CORO_POLL_INTERVAL) {
+			engine->poll_skip_count = 0;
+			if (__atomic_load_n(&engine->fd_count,
+					__ATOMIC_RELAXED) > 0)
+				coro_engine_poll(engine, 0);
+		}
+		struct coro *c = coro_engine_find_work(engine);
+		if (c != NULL) {
+			coro_engine_resume(engine, c);
+			continue;
+		}
+		bool is_done = false;
+		uint64_t poll_ns = 0;
+		pthread_mutex_lock(&group->mutex);
+		__atomic_add_fetch(&group->idle_count, 1, __ATOMIC_SEQ_CST);
+		while (true) {
+			c = coro_group_pop_shared_locked(group);
+			if (c != NULL)
+				break;
+			if (coro_group_is_over(group)) {
+				is_done = true;
+				break;
+			}
+			/*
+			 * Check the other threads again after being
+			 * accounted as idle. Any push after that is
+			 * going to signal.
+			 */
+			c = coro_engine_steal(engine);
+			if (c != NULL)
+				break;
+			uint64_t ns = coro_engine_timer_wait_ns(engine);
+			if (__atomic_load_n(&engine->fd_count,
+					__ATOMIC_RELAXED) > 0) {
+				/*
+				 * Sleep in epoll then. The pushers know
+				 * to wake it up via the event descriptor.
+				 */
+				engine->is_polling = true;
+				++group->poll_count;
+				poll_ns = ns;
+				break;
+			}
+			if (ns == UINT64_MAX) {
+				pthread_cond_wait(&group->cond, &group->mutex);
+				continue;
+			}
+			if (ns == 0)
+				break;
+			/* The condition variable uses the real time. */
+			struct timespec ts;
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ns += ts.tv_nsec;
+			ts.tv_sec += ns / 1000000000;
+			ts.tv_nsec = ns % 1000000000;
+			if (pthread_cond_timedwait(&group->cond, &group->mutex,
+					&ts) == ETIMEDOUT)
+				break;
+		}
+		int poll_count = 0;
+		if (engine->is_polling) {
+			pthread_mutex_unlock(&group->mutex);
+			poll_count = coro_engine_poll_wait(engine, poll_ns);
+			pthread_mutex_lock(&group->mutex);
+			engine->is_polling = false;
+			--group->poll_count;
+		}
+		__atomic_sub_fetch(&group->idle_count, 1, __ATOMIC_SEQ_CST);
+		pthread_mutex_unlock(&group->mutex);
+		if (poll_count > 0) {
+			coro_engine_poll_process(engine, poll_count);
+			continue;
+		}
+		if (is_done)
+			break;
+		if (c != NULL)
+			coro_engine_resume(engine, c);
+	}
+}
+
+static void
+coro_engine_destroy(struct coro_engine *engine)
+{
+	assert(engine->this_coro == NULL);
+	/* Could be left for the coroutines joined already. */
+	coro_engine_process_remote(engine);
+	assert(engine->runnable_count == 0);
+	engine->pool_limit = 0;
+	coro_engine_pool_shrink(engine);
+	assert(engine->pool_size == 0);
+	assert(engine->coro_count == 0);
+	assert(engine->wheel.count == 0);
+	assert(engine->fd_count == 0);
+	while (engine->slabs != NULL) {
+		struct coro_slab *slab = engine->slabs;
+		engine->slabs = slab->next;
+		if (munmap(slab, CORO_SLAB_SIZE) != 0)
+			handle_error();
+	}
+	pthread_mutex_destroy(&engine->mutex);
+	if (engine->epoll_fd >= 0)
+		close(engine->epoll_fd);
+	if (engine->event_fd >= 0)
+		close(engine->event_fd);
+	free(engine->fd_waiters);
+	coro_specific_clear(&engine->sched.specific);
+	coro_specific_destroy(&engine->sched.specific);
+	memset(engine, '#', sizeof(*engine));
+}
+
+/**
+ * The coroutine body - runs the coroutine functions one by one
+ * on the coroutine's stack. Between the runs the coroutine stays
+ * in the pool of the engine.
+ */
+static void
+coro_body(void *arg)
+{
+	struct coro *c = (struct coro *)arg;
+	while (true) {
+		c->ret = c->func(c->func_arg);
+		/* A reused coroutine starts without the values. */
+		coro_specific_clear(&c->specific);
+		if (c->is_stack_painted)
+			coro_stack_measure(c);
+		c->func = NULL;
+		assert(coro_state_get(c) == CORO_STATE_RUNNING);
+		c->stack_live = (uint8_t *)&c;
+		/*
+		 * The joiner is woken up by the scheduler. Before
+		 * that the coroutine must leave its stack.
+		 */
+		coro_engine_switch_to_sched(c->engine, CORO_ACTION_FINISH);
+		/*
+		 * Here it is restarted already, must have its
+		 * state restored.
+		 */
+		assert(coro_state_get(c) == CORO_STATE_RUNNING);
+		assert(c->func != NULL);
+	}
+}
+
+/** Queue a new or a reused coroutine to start. */
+static void
+coro_engine_start(struct coro_engine *engine, struct coro *c)
+{
+	c->state = CORO_STATE_RUNNING;
+	c->is_wakeup_pending = false;
+	c->is_cancelled = false;
+	c->is_cancellable = true;
+	c->priority = CORO_PRIORITY_NORMAL;
+	coro_stats_start(c);
+	coro_stats_ready(c);
+	struct coro_group *group = engine->group;
+	c->home = group != NULL ? group->engines[0] : engine;
+	if (group == NULL) {
+		assert(rlist_empty(&c->link));
+		coro_engine_push_local(engine, c);
+		return;
+	}
+	coro_group_activate(group);
+	coro_group_push(group, engine, c);
+}
+
+static struct coro *
+coro_engine_spawn_new(struct coro_engine *engine, coro_f func, void *func_arg,
+	size_t stack_size, const struct coro_attr *attr)
+{
+	struct coro *c;
+	if (attr != NULL && attr->storage != NULL) {
+		c = (struct coro *)attr->storage;
+		memset(c, 0, sizeof(*c));
+		c->is_user_storage = true;
+	} else {
+		c = coro_engine_coro_alloc(engine);
+	}
+	c->ret = NULL;
+	c->stack_size = stack_size;
+	if (attr != NULL && attr->stack != NULL) {
+		c->stack = (uint8_t *)attr->stack;
+		c->is_user_stack = true;
+	} else {
+		c->stack = coro_stack_new(stack_size);
+	}
+	c->stack_live = c->stack;
+	coro_stack_prepare(engine, c);
+	c->func = func;
+	c->func_arg = func_arg;
+	c->joiner = NULL;
+	c->engine = engine;
+	c->timer.engine = NULL;
+	c->timer.is_fired = false;
+	c->fd_wait.engine = NULL;
+	c->wait_what = NULL;
+	c->wait_object = NULL;
+	c->is_wait_tracked = false;
+	c->wait_trace = NULL;
+	c->wait_trace_size = 0;
+	rlist_create(&c->timer.link);
+	rlist_create(&c->link);
+	coro_ctx_create(&c->ctx, c->stack, stack_size, coro_body, c);
+
+	/* Now scheduler can work with that coroutine. */
+	++engine->coro_count;
+	coro_engine_start(engine, c);
+	return c;
+}
+
+static struct coro *
+coro_engine_spawn(struct coro_engine *engine, coro_f func, void *func_arg,
+	const struct coro_attr *attr)
+{
+	if (attr != NULL && attr->stack != NULL) {
+		/* The user's stack is used as is. */
+		assert(attr->stack_size >= coro_stack_size_min);
+		return coro_engine_spawn_new(engine, func, func_arg,
+			attr->stack_size, attr);
+	}
+	size_t stack_size = attr != NULL ? attr->stack_size : 0;
+	if (stack_size == 0 && engine->stack_mode == CORO_STACK_MODE_AUTO)
+		stack_size = coro_stack_size_learned(func);
+	stack_size = coro_stack_size_normalize(stack_size);
+	/* The pooled objects live in the slabs, can't take those. */
+	if (attr != NULL && attr->storage != NULL) {
+		return coro_engine_spawn_new(engine, func, func_arg, stack_size,
+			attr);
+	}
+	struct coro *c = coro_engine_pool_get(engine, stack_size);
+	if (c == NULL) {
+		return coro_engine_spawn_new(engine, func, func_arg, stack_size,
+			attr);
+	}
+
+	coro_stack_prepare(engine, c);
+	c->func = func;
+	c->func_arg = func_arg;
+	coro_engine_start(engine, c);
+	return c;
+}
+
+static void *
+coro_engine_join(struct coro_engine *engine, struct coro *coro)
+{
+	assert(coro->joiner == NULL);
+	struct coro *this_coro = engine->this_coro;
+	__atomic_store_n(&coro->joiner, this_coro, __ATOMIC_SEQ_CST);
+	while (coro_state_get(coro) != CORO_STATE_FINISHED) {
+		coro_engine_suspend_on(engine, "join", coro);
+		engine = coro_engine_this();
+	}
+	assert(coro->joiner == engine->this_coro);
+	coro->joiner = NULL;
+	void *ret = coro->ret;
+	coro->ret = NULL;
+	coro_stats_join(coro);
+	coro_engine_drop_remote(coro);
+	coro_engine_pool_put(engine, coro);
+	return ret;
+}
+
+static void *
+coro_worker_f(void *arg)
+{
+	struct coro_engine *engine = (struct coro_engine *)arg;
+	coro_engine_current = engine;
+	coro_engine_run_mt(engine);
+	coro_engine_current = NULL;
+	return NULL;
+}
+
+/**
+ * Give everything a worker engine owns to the global engine after
+ * the M:N run is over.
+ */
+static void
+coro_engine_merge(struct coro_engine *dst, struct coro_engine *src)
+{
+	assert(src->coro_count == 0);
+	/* The objects could be in use anywhere, the slabs move too. */
+	rlist_splice_tail(&dst->coros_free, &src->coros_free);
+	while (src->slabs != NULL) {
+		struct coro_slab *slab = src->slabs;
+		src->slabs = slab->next;
+		slab->next = dst->slabs;
+		dst->slabs = slab;
+	}
+#if LIBCORO_STATS
+	coro_stats_add(&dst->stats, &src->stats);
+#endif
+	for (int i = 0; i < CORO_STACK_CLASS_COUNT; ++i) {
+		struct coro_stack_class *cls = &src->coros_pool[i];
+		while (!rlist_empty(&cls->hot)) {
+			struct coro *c = rlist_shift_entry(&cls->hot,
+				struct coro, link);
+			coro_engine_pool_put(dst, c);
+		}
+		while (!rlist_empty(&cls->cold)) {
+			struct coro *c = rlist_shift_entry(&cls->cold,
+				struct coro, link);
+			coro_engine_pool_put(dst, c);
+		}
+		cls->hot_count = 0;
+	}
+	src->pool_size = 0;
+}
+
+//////////////////////////////////////////////////////////////////
+
+void
+coro_sched_init(void)
+{
+	coro_engine_create(&glob_engine);
+}
+
+void
+coro_sched_run(void)
+{
+	coro_engine_run_until(&glob_engine, UINT64_MAX);
+	coro_debug_check_stop(&glob_engine);
+}
+
+void
+coro_sched_run_mt(int thread_count)
+{
+	struct coro_engine *engine = &glob_engine;
+	assert(engine->group == NULL);
+	assert(coro_engine_current == NULL);
+	engine->thread = pthread_self();
+	if (thread_count <= 1) {
+		coro_sched_run();
+		return;
+	}
+	struct coro_group group;
+	memset(&group, 0, sizeof(group));
+	pthread_mutex_init(&group.mutex, NULL);
+	pthread_cond_init(&group.cond, NULL);
+	rlist_create(&group.coros_shared);
+	group.engine_count = thread_count;
+	group.engines = new struct coro_engine *[thread_count];
+	group.engines[0] = engine;
+	for (int i = 1; i < thread_count; ++i) {
+		struct coro_engine *e = new struct coro_engine;
+		coro_engine_create(e);
+		e->pool_limit = engine->pool_limit;
+		e->stack_mode = engine->stack_mode;
+		e->idx = i;
+		e->group = &group;
+		group.engines[i] = e;
+	}
+	/* The threads of the group wake each other up differently. */
+	coro_engine_process_remote(engine);
+	engine->idx = 0;
+	engine->group = &group;
+	group.timer_count = engine->wheel.count;
+	/* The already runnable coroutines are shared by everyone. */
+	while (engine->runnable_count > 0) {
+		struct coro *c = coro_engine_pop_local(engine);
+		coro_group_activate(&group);
+		coro_group_push(&group, NULL, c);
+	}
+	engine->pass_left = 0;
+
+	pthread_t *threads = new pthread_t[thread_count];
+	for (int i = 1; i < thread_count; ++i) {
+		if (pthread_create(&threads[i], NULL, coro_worker_f,
+				group.engines[i]) != 0)
+			handle_error();
+	}
+	coro_engine_current = engine;
+	coro_engine_run_mt(engine);
+	coro_engine_current = NULL;
+	for (int i = 1; i < thread_count; ++i)
+		pthread_join(threads[i], NULL);
+	delete[] threads;
+
+	engine->group = NULL;
+	assert(rlist_empty(&group.coros_shared));
+	/*
+	 * Counters of the separate engines could be "negative",
+	 * only their sum is meaningful. It is collected before the
+	 * merge of the pools, which can delete the coroutines.
+	 */
+	for (int i = 1; i < thread_count; ++i) {
+		engine->coro_count += group.engines[i]->coro_count;
+		group.engines[i]->coro_count = 0;
+	}
+	for (int i = 1; i < thread_count; ++i) {
+		struct coro_engine *e = group.engines[i];
+		assert(e->this_coro == NULL);
+		coro_engine_merge(engine, e);
+		e->group = NULL;
+		coro_engine_destroy(e);
+		delete e;
+	}
+	delete[] group.engines;
+	pthread_cond_destroy(&group.cond);
+	pthread_mutex_destroy(&group.mutex);
+	coro_debug_check_stop(engine);
+}
+
+void
+coro_sched_destroy(void)
+{
+	coro_engine_destroy(&glob_engine);
+}
+
+void
+coro_sched_set_pool_limit(size_t size)
+{
+	glob_engine.pool_limit = size;
+	coro_engine_pool_shrink(&glob_engine);
+}
+
+/**
+ * Seconds until the engine has more work: 0 if a coroutine is
+ * runnable, the time until the nearest timer, or -1 if none.
+ */
+static double
+coro_engine_timeout(struct coro_engine *engine)
+{
+	if (engine->runnable_count > 0)
+		return 0;
+	uint64_t ns = coro_engine_timer_wait_ns(engine);
+	if (ns == UINT64_MAX)
+		return -1;
+	return ns / 1e9;
+}
+
+/** Run the engine by the current thread until the deadline. */
+static double
+coro_engine_run_here(struct coro_engine *engine, uint64_t deadline)
+{
+	assert(engine != &glob_engine);
+	/* Could be run from a coroutine of another engine. */
+	struct coro_engine *prev = coro_engine_current;
+	coro_engine_current = engine;
+	coro_engine_run_until(engine, deadline);
+	coro_engine_current = prev;
+	return coro_engine_timeout(engine);
+}
+
+struct coro_engine *
+coro_engine_new(void)
+{
+	struct coro_engine *engine = new struct coro_engine;
+	coro_engine_create(engine);
+#if LIBCORO_USE_EPOLL
+	/*
+	 * Right away, so the other threads could wake the engine up
+	 * when it waits for them.
+	 */
+	coro_engine_poll_create(engine);
+#endif
+	return engine;
+}
+
+void
+coro_engine_delete(struct coro_engine *engine)
+{
+	assert(engine != &glob_engine);
+	assert(engine != coro_engine_current);
+	coro_engine_destroy(engine);
+	delete engine;
+}
+
+double
+coro_engine_run_once(struct coro_engine *engine)
+{
+	return coro_engine_run_here(engine, 0);
+}
+
+double
+coro_engine_run_for(struct coro_engine *engine, double timeout)
+{
+	uint64_t deadline = UINT64_MAX;
+	if (timeout >= 0 && timeout < 1e9)
+		deadline = coro_clock_ns() + (uint64_t)(timeout * 1e9);
+	double rc = coro_engine_run_here(engine, deadline);
+	if (rc < 0 && engine->fd_count == 0)
+		coro_debug_check_stop(engine);
+	return rc;
+}
+
+int
+coro_engine_fd(struct coro_engine *engine)
+{
+#if LIBCORO_USE_EPOLL
+	coro_engine_poll_create(engine);
+	return engine->epoll_fd;
+#else
+	(void)engine;
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+struct coro *
+coro_this(void)
 {
-	coro_engine_suspend(&glob_engine);
+	return coro_engine_this()->this_coro;
 }
 
 void
+coro_attr_create(struct coro_attr *attr)
+{
+	memset(attr, 0, sizeof(*attr));
+}
+
+struct coro *
+coro_new(coro_f func, void *func_arg)
+{
+	return coro_engine_spawn(coro_engine_this(), func, func_arg, NULL);
+}
+
+struct coro *
+coro_new_ex(coro_f func, void *func_arg, const struct coro_attr *attr)
+{
+	struct coro_engine *engine = attr != NULL && attr->engine != NULL ?
+		attr->engine : coro_engine_this();
+	return coro_engine_spawn(engine, func, func_arg, attr);
+}
+
+void *
+coro_join(struct coro *coro)
+{
+	return coro_engine_join(coro_engine_of(coro), coro);
+}
+
+/**
+ * Check if the current coroutine should stop waiting, because it
+ * is cancelled. The waits inside the library don't check it, they
+ * treat the cancellation as a spurious wakeup.
+ */
+static inline bool
+coro_engine_is_cancelled(struct coro_engine *engine)
+{
+	struct coro *c = engine->this_coro;
+	return c != NULL && c->is_cancellable &&
+	       __atomic_load_n(&c->is_cancelled, __ATOMIC_ACQUIRE);
+}
+
+int
+coro_suspend(void)
+{
+	struct coro_engine *engine = coro_engine_this();
+	if (coro_engine_is_cancelled(engine))
+		return -1;
+	coro_engine_suspend(engine);
+	return coro_engine_is_cancelled(coro_engine_this()) ? -1 : 0;
+}
+
+int
+coro_suspend_on(const char *what, const void *object)
+{
+	struct coro_engine *engine = coro_engine_this();
+	if (coro_engine_is_cancelled(engine))
+		return -1;
+	coro_engine_suspend_on(engine, what, object);
+	return coro_engine_is_cancelled(coro_engine_this()) ? -1 : 0;
+}
+
+int
 coro_yield(void)
 {
-	coro_engine_yield(&glob_engine);
+	coro_engine_yield(coro_engine_this());
+	return coro_engine_is_cancelled(coro_engine_this()) ? -1 : 0;
 }
 
 void
 coro_wakeup(struct coro *coro)
 {
-	coro_engine_wakeup(&glob_engine, coro);
+	coro_engine_wakeup_any(coro_engine_of(coro), coro);
+}
+
+void
+coro_switch_to(struct coro *coro)
+{
+	coro_engine_switch_to(coro_engine_this(), coro);
+}
+
+void
+coro_cancel(struct coro *coro)
+{
+	__atomic_store_n(&coro->is_cancelled, true, __ATOMIC_RELEASE);
+	coro_engine_wakeup_any(coro_engine_of(coro), coro);
+}
+
+bool
+coro_is_cancelled(void)
+{
+	struct coro *c = coro_this();
+	return c != NULL && __atomic_load_n(&c->is_cancelled, __ATOMIC_ACQUIRE);
+}
+
+bool
+coro_set_cancellable(bool is_cancellable)
+{
+	struct coro *c = coro_this();
+	assert(c != NULL);
+	bool old = c->is_cancellable;
+	c->is_cancellable = is_cancellable;
+	return old;
+}
+
+void
+coro_set_priority(struct coro *coro, int priority)
+{
+	assert(priority >= CORO_PRIORITY_LOW && priority <= CORO_PRIORITY_HIGH);
+	struct coro_engine *engine = coro_engine_of(coro);
+	int old = coro->priority;
+	coro->priority = priority;
+	if (engine->group != NULL || old == priority)
+		return;
+	/* Already queued - move to the new queue. */
+	if (coro->state == CORO_STATE_RUNNING && !rlist_empty(&coro->link)) {
+		rlist_del_entry(coro, link);
+		--engine->runnable_count;
+		coro_engine_push_local(engine, coro);
+	}
+}
+
+void
+coro_sched_set_fairness(bool is_fair)
+{
+	glob_engine.is_fair = is_fair;
+}
+
+void
+coro_sched_set_stack_mode(int mode)
+{
+	assert(mode >= CORO_STACK_MODE_FIXED && mode <= CORO_STACK_MODE_AUTO);
+	glob_engine.stack_mode = mode;
+}
+
+void
+coro_sched_set_debug(bool is_enabled)
+{
+#if LIBCORO_USE_BACKTRACE
+	/*
+	 * The first backtrace loads the unwinder library. Better do
+	 * that on the big stack of the thread, not of a coroutine.
+	 */
+	void *frame;
+	backtrace(&frame, 1);
+#endif
+	__atomic_store_n(&coro_debug_is_enabled, is_enabled, __ATOMIC_RELAXED);
+}
+
+size_t
+coro_sched_dump_waits(void)
+{
+	pthread_mutex_lock(&coro_debug_mutex);
+	size_t count = coro_debug_count;
+	coro_debug_dump(NULL);
+	pthread_mutex_unlock(&coro_debug_mutex);
+	return count;
+}
+
+size_t
+coro_stack_size(const struct coro *coro)
+{
+	return coro->stack_size;
+}
+
+size_t
+coro_stack_used(const struct coro *coro)
+{
+	return __atomic_load_n(&coro->stack_used, __ATOMIC_ACQUIRE);
+}
+
+size_t
+coro_stack_used_max(coro_f func)
+{
+	struct coro_stack_profile *profile = coro_stack_profile_find(func,
+		false);
+	if (profile == NULL)
+		return 0;
+	return __atomic_load_n(&profile->used_max, __ATOMIC_RELAXED);
+}
+
+void
+coro_stats(const struct coro *coro, struct coro_stats *stats)
+{
+#if LIBCORO_STATS
+	*stats = coro->stats;
+#else
+	(void)coro;
+	memset(stats, 0, sizeof(*stats));
+#endif
+}
+
+void
+coro_sched_stats(struct coro_stats *stats)
+{
+#if LIBCORO_STATS
+	*stats = glob_engine.stats;
+	struct coro_group *group = glob_engine.group;
+	if (group == NULL)
+		return;
+	/* The worker engines are merged into the global one later. */
+	for (int i = 1; i < group->engine_count; ++i)
+		coro_stats_add(stats, &group->engines[i]->stats);
+#else
+	memset(stats, 0, sizeof(*stats));
+#endif
+}
+
+void
+coro_stats_dump(void)
+{
+#if LIBCORO_STATS
+	struct coro_stats total;
+	coro_sched_stats(&total);
+	printf("sched: switches %llu, suspends %llu, run %.3lf ms, "
+		"wait %.3lf ms\n", (unsigned long long)total.switch_count,
+		(unsigned long long)total.suspend_count, total.run_ns / 1e6,
+		total.wait_ns / 1e6);
+	pthread_mutex_lock(&coro_stats_mutex);
+	struct coro *c;
+	rlist_foreach_entry(c, &coro_stats_list, stats_link) {
+		printf("coro %p: switches %llu, suspends %llu, run %.3lf ms, "
+			"wait %.3lf ms\n", (void *)c,
+			(unsigned long long)c->stats.switch_count,
+			(unsigned long long)c->stats.suspend_count,
+			c->stats.run_ns / 1e6, c->stats.wait_ns / 1e6);
+	}
+	pthread_mutex_unlock(&coro_stats_mutex);
+#else
+	printf("coro stats are disabled\n");
+#endif
+}
+
+int
+coro_wait_fd(int fd, int events, double timeout)
+{
+	struct coro_engine *engine = coro_engine_this();
+	if (coro_engine_is_cancelled(engine)) {
+		errno = ECANCELED;
+		return -1;
+	}
+	int rc = coro_engine_wait_fd(engine, fd, events, timeout);
+	if (rc == 0 && coro_engine_is_cancelled(coro_engine_this())) {
+		errno = ECANCELED;
+		return -1;
+	}
+	return rc;
+}
+
+bool
+coro_suspend_timeout(double timeout)
+{
+	struct coro_engine *engine = coro_engine_this();
+	if (coro_engine_is_cancelled(engine))
+		return true;
+	return coro_engine_suspend_timeout(engine, timeout, NULL, NULL);
+}
+
+bool
+coro_suspend_timeout_on(double timeout, const char *what, const void *object)
+{
+	struct coro_engine *engine = coro_engine_this();
+	if (coro_engine_is_cancelled(engine))
+		return true;
+	return coro_engine_suspend_timeout(engine, timeout, what, object);
+}
+
+int
+coro_sleep(double timeout)
+{
+	uint64_t now = coro_clock_ns();
+	uint64_t deadline = timeout < 1e9 ?
+		now + (uint64_t)(timeout > 0 ? timeout * 1e9 : 0) : UINT64_MAX;
+	while (now < deadline) {
+		struct coro_engine *engine = coro_engine_this();
+		if (coro_engine_is_cancelled(engine))
+			return -1;
+		coro_engine_suspend_timeout(engine, (deadline - now) / 1e9,
+			"sleep", NULL);
+		now = coro_clock_ns();
+	}
+	return 0;
+}
+
+/**
+ * Values of the keys of the current coroutine, or of the scheduler
+ * when no coroutine is running.
+ */
+static inline struct coro_specific *
+coro_specific_this(void)
+{
+	struct coro_engine *engine = coro_engine_this();
+	struct coro *c = engine->this_coro;
+	if (c == NULL)
+		c = &engine->sched;
+	return &c->specific;
+}
+
+int
+coro_key_create(coro_key_destructor_f destructor)
+{
+	int key = __atomic_load_n(&coro_key_count, __ATOMIC_RELAXED);
+	do {
+		if (key >= CORO_KEY_MAX) {
+			errno = EAGAIN;
+			return -1;
+		}
+	} while (!__atomic_compare_exchange_n(&coro_key_count, &key, key + 1,
+			false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+	__atomic_store_n(&coro_key_destructors[key], destructor,
+		__ATOMIC_RELEASE);
+	return key;
+}
+
+void *
+coro_getspecific(int key)
+{
+	assert(key >= 0 && key < coro_key_count);
+	struct coro_specific *specific = coro_specific_this();
+	if (key < CORO_KEY_INLINE_COUNT)
+		return specific->values[key];
+	int idx = key - CORO_KEY_INLINE_COUNT;
+	if (idx >= specific->ext_size)
+		return NULL;
+	return specific->ext_values[idx];
+}
+
+void
+coro_setspecific(int key, void *value)
+{
+	assert(key >= 0 && key < coro_key_count);
+	struct coro_specific *specific = coro_specific_this();
+	if (key < CORO_KEY_INLINE_COUNT) {
+		specific->values[key] = value;
+		return;
+	}
+	int idx = key - CORO_KEY_INLINE_COUNT;
+	if (idx >= specific->ext_size) {
+		if (value == NULL)
+			return;
+		int size = specific->ext_size * 2;
+		if (size <= idx)
+			size = idx + 1;
+		void **values = (void **)realloc(specific->ext_values,
+			size * sizeof(values[0]));
+		if (values == NULL)
+			handle_error();
+		memset(values + specific->ext_size, 0,
+			(size - specific->ext_size) * sizeof(values[0]));
+		specific->ext_values = values;
+		specific->ext_size = size;
+	}
+	specific->ext_values[idx] = value;
+}
+
+void
+coro_wait_queue_create(struct coro_wait_queue *queue)
+{
+	queue->lock = 0;
+	rlist_create(&queue->coros);
+}
+
+void
+coro_wait_queue_destroy(struct coro_wait_queue *queue)
+{
+	assert(rlist_empty(&queue->coros));
+	(void)queue;
+}
+
+int
+coro_wait_queue_suspend(struct coro_wait_queue *queue)
+{
+	struct coro_engine *engine = coro_engine_this();
+	if (coro_engine_is_cancelled(engine))
+		return -1;
+	coro_engine_wait_queue_prepare(engine, queue);
+	coro_engine_wait_queue_commit(engine, queue);
+	return coro_engine_is_cancelled(coro_engine_this()) ? -1 : 0;
+}
+
+void
+coro_wait_queue_prepare(struct coro_wait_queue *queue)
+{
+	coro_engine_wait_queue_prepare(coro_engine_this(), queue);
+}
+
+int
+coro_wait_queue_commit(struct coro_wait_queue *queue)
+{
+	struct coro_engine *engine = coro_engine_this();
+	if (coro_engine_is_cancelled(engine)) {
+		coro_engine_wait_queue_abort(engine, queue);
+		return -1;
+	}
+	coro_engine_wait_queue_commit(engine, queue);
+	return coro_engine_is_cancelled(coro_engine_this()) ? -1 : 0;
+}
+
+bool
+coro_wait_queue_abort(struct coro_wait_queue *queue)
+{
+	return coro_engine_wait_queue_abort(coro_engine_this(), queue);
+}
+
+/**
+ * Get the engine to handle the waiters of a queue. Same as with
+ * coro_engine_of(), the waiters of a single thread engine are
+ * handled only by it. Its queues have no lock, so unlike
+ * coro_wakeup() they can't be woken up from another thread at all.
+ */
+static inline struct coro_engine *
+coro_engine_of_queue(struct coro_wait_queue *queue)
+{
+	struct coro_engine *engine = coro_engine_this();
+	if (engine->group != NULL || rlist_empty(&queue->coros))
+		return engine;
+	struct coro_engine *home = rlist_first_entry(&queue->coros,
+		struct coro, link)->home;
+	assert(home == engine || pthread_equal(home->thread, pthread_self()));
+	return home;
+}
+
+bool
+coro_wait_queue_wakeup_one(struct coro_wait_queue *queue)
+{
+	return coro_engine_wait_queue_wakeup_one(coro_engine_of_queue(queue),
+		queue);
+}
+
+void
+coro_wait_queue_wakeup_all(struct coro_wait_queue *queue)
+{
+	coro_engine_wait_queue_wakeup_all(coro_engine_of_queue(queue), queue);
 }
@@ -1,21 +1,126 @@
 #pragma once
 
+#include "rlist.h"
+
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 
 struct coro;
+struct coro_engine;
 typedef void *(*coro_f)(void *);
 
+/** Events of a file descriptor for coro_wait_fd(). */
+enum coro_event {
+	CORO_EVENT_READ = 1,
+	CORO_EVENT_WRITE = 2,
+};
+
+/**
+ * Coroutine priorities. A runnable coroutine of a higher priority
+ * runs before the lower ones.
+ */
+enum coro_priority {
+	CORO_PRIORITY_LOW = -1,
+	CORO_PRIORITY_NORMAL = 0,
+	CORO_PRIORITY_HIGH = 1,
+};
+
+/** How the coroutine stacks are sized, see coro_sched_set_stack_mode(). */
+enum coro_stack_mode {
+	/** The stacks are of the requested or the default size. */
+	CORO_STACK_MODE_FIXED = 0,
+	/** Peak stack usage of the coroutines is measured. */
+	CORO_STACK_MODE_TRACK,
+	/**
+	 * Measured, and the stacks of the default size are sized by
+	 * the usage seen in the earlier coroutines of the same
+	 * function.
+	 */
+	CORO_STACK_MODE_AUTO,
+};
+
+enum {
+	/** Size of the memory enough for any coroutine object. */
+	CORO_STORAGE_SIZE = 1024,
+	/** Max number of the coroutine-local keys. */
+	CORO_KEY_MAX = 1024,
+};
+
+/** Destructor of a coroutine-local value. */
+typedef void (*coro_key_destructor_f)(void *);
+
+/**
+ * Memory for a coroutine object, provided by the user. Can be
+ * embedded into the user's objects or taken from an arena.
+ */
+struct coro_storage {
+	alignas(16) unsigned char data[CORO_STORAGE_SIZE];
+};
+
+/** Coroutine creation attributes. */
+struct coro_attr {
+	/**
+	 * Stack size in bytes. It is rounded up to a power of 2.
+	 * 0 means the default size, 1MB. The stack memory is
+	 * committed lazily, as the coroutine touches it, so a big
+	 * stack costs only virtual address space. An overflow of
+	 * the stack crashes the process.
+	 */
+	size_t stack_size;
+	/**
+	 * Stack memory provided by the user, stack_size bytes, at
+	 * least 16KB. Is used as is, without a guard page. NULL
+	 * means the stack is allocated by the library.
+	 */
+	void *stack;
+	/**
+	 * Memory for the coroutine object. coro_new_ex() returns a
+	 * pointer into it. NULL means the object is allocated by
+	 * the library.
+	 *
+	 * The user's stack and storage must stay valid until the
+	 * coroutine is joined, and are free to reuse afterwards.
+	 * With both of them provided, a spawn allocates nothing.
+	 */
+	struct coro_storage *storage;
+	/**
+	 * Engine to run the coroutine, see coro_engine_new(). NULL
+	 * means the engine of the current coroutine, or the global
+	 * one outside of the coroutines.
+	 */
+	struct coro_engine *engine;
+};
+
 /** Initialize the coroutines engine. */
 void
 coro_sched_init(void);
 
 /**
  * Run the coroutines processing while there are any runnable
- * ones.
+ * ones, or any suspended with a timeout.
  */
 void
 coro_sched_run(void);
 
+/**
+ * Same as coro_sched_run(), but the coroutines are run by
+ * @a thread_count threads, the caller included. Each thread has
+ * its own run queue, and the idle threads steal coroutines from
+ * the busy ones. Returns when no coroutine is runnable anymore,
+ * and no timeouts are pending.
+ *
+ * In this mode any coroutine can continue in another thread after
+ * a yield or a suspension, and coro_wakeup() can be called from
+ * any thread. A wakeup of a running coroutine isn't lost - its
+ * next suspension returns right away. So a woken up coroutine
+ * must always recheck what it was waiting for. Thread-local
+ * variables (including errno) can't be trusted across yields and
+ * suspensions.
+ */
+void
+coro_sched_run_mt(int thread_count);
+
 /**
  * Destroy the coroutines engine. All coros must be finished by
  * now.
@@ -23,6 +128,72 @@ coro_sched_run(void);
 void
 coro_sched_destroy(void);
 
+/**
+ * Set the max total stack size of the finished coroutines kept
+ * for reuse. Extra finished coroutines are freed on join. The
+ * default is 128MB.
+ */
+void
+coro_sched_set_pool_limit(size_t size);
+
+/**
+ * Create an engine independent of the global scheduler. It runs
+ * only when its owner polls it with coro_engine_run_once() or
+ * coro_engine_run_for(), so it can be embedded into a foreign
+ * event loop. The coroutines are spawned in it via the engine
+ * attribute, and the ones spawned by its coroutines stay in it.
+ *
+ * An engine, its coroutines and its wait queues must be used by
+ * one thread at a time. So each thread can have its own engines
+ * without any shared state. The exception is coro_wakeup() and
+ * coro_cancel(), which can be called for its coroutines from any
+ * thread. Such a wakeup is handled on the next run of the engine.
+ * The M:N mode is only available for the global scheduler. The
+ * engine has the default settings, the coro_sched_set_*()
+ * functions are for the global scheduler.
+ */
+struct coro_engine *
+coro_engine_new(void);
+
+/** Delete an engine. All its coroutines must be joined by now. */
+void
+coro_engine_delete(struct coro_engine *engine);
+
+/**
+ * Do one iteration of the scheduler: fire the expired timers,
+ * check the descriptors, and run each coroutine which is runnable
+ * then until it yields or suspends. Never blocks.
+ *
+ * Returns in how many seconds the engine needs to be run again: 0
+ * if some coroutines are runnable, the time until the nearest
+ * timeout, or -1 if none. Either way it needs to be run as soon
+ * as coro_engine_fd() is readable, or some of its coroutines are
+ * woken up from outside.
+ */
+double
+coro_engine_run_once(struct coro_engine *engine);
+
+/**
+ * Run the engine until the timeout passes. Meanwhile, when it has
+ * nothing to do, it waits for the timeouts, the descriptors, and
+ * the wakeups from the other threads. A negative timeout means no
+ * limit, and then it stops when there is nothing to wait for: no
+ * runnable coroutines, timeouts or descriptor waits, same as
+ * coro_sched_run(). Returns the same as coro_engine_run_once().
+ */
+double
+coro_engine_run_for(struct coro_engine *engine, double timeout);
+
+/**
+ * Descriptor which becomes readable when any of the descriptors
+ * waited by the engine's coroutines is ready, or its coroutines
+ * are woken up from other threads. For the foreign event loops.
+ * Returns -1 with errno ENOSYS if the descriptor waits aren't
+ * supported.
+ */
+int
+coro_engine_fd(struct coro_engine *engine);
+
 /** Get the currently working coroutine. */
 struct coro *
 coro_this(void);
@@ -38,6 +209,17 @@ coro_this(void);
 struct coro *
 coro_new(coro_f func, void *func_arg);
 
+/** Initialize the coroutine attributes with the default values. */
+void
+coro_attr_create(struct coro_attr *attr);
+
+/**
+ * Same as coro_new(), but with the given attributes. NULL
+ * attributes mean the defaults.
+ */
+struct coro *
+coro_new_ex(coro_f func, void *func_arg, const struct coro_attr *attr);
+
 /**
  * Join a coroutine. When joined, its resources are freed, and the
  * result of its callback function is returned. Each coroutine
@@ -50,16 +232,30 @@ coro_join(struct coro *coro);
  * Pause the current coroutine until its explicitly woken up with
  * coro_wakeup(). Can be used to wait for some event, which will
  * wakeup this coro when happens.
+ *
+ * Returns 0, or -1 if the coroutine is cancelled. A cancelled
+ * coroutine doesn't suspend at all.
  */
-void
+int
 coro_suspend(void);
 
+/**
+ * Same as coro_suspend(), but tells what the coroutine waits for.
+ * It is shown by coro_sched_dump_waits(). @a what is a string like
+ * "reply" or "lock", and @a object is anything identifying the
+ * awaited event, or NULL. If it is a coroutine, then the dump
+ * checks the waits for cycles. Both must stay valid while the
+ * coroutine is suspended.
+ */
+int
+coro_suspend_on(const char *what, const void *object);
+
 /**
  * Pause the current coroutine until the next iteration of the
  * scheduler. Can be used to let the other coroutines work for a
- * bit.
+ * bit. Returns 0, or -1 if the coroutine is cancelled.
  */
-void
+int
 coro_yield(void);
 
 /**
@@ -69,3 +265,302 @@ coro_yield(void);
  */
 void
 coro_wakeup(struct coro *coro);
+
+/**
+ * Wake up a coroutine and yield to it right away. The current one
+ * stays runnable and continues later, same as after coro_yield().
+ * Skips the run queue, so a handoff between a pair of coroutines
+ * costs one context switch instead of a whole scheduler
+ * iteration. If the coroutine can't be run now, it is the same as
+ * coro_wakeup() + coro_yield().
+ */
+void
+coro_switch_to(struct coro *coro);
+
+/**
+ * Cancel a coroutine and wake it up. The cancellation is
+ * cooperative - the coroutine isn't stopped, but from now on its
+ * waits fail right away: coro_suspend(), coro_yield(), coro_sleep()
+ * return -1, coro_wait_fd() fails with ECANCELED, and
+ * coro_suspend_timeout() returns true without waiting. The
+ * coroutine is expected to notice that and finish. It still must
+ * be joined.
+ */
+void
+coro_cancel(struct coro *coro);
+
+/** Check if the current coroutine is cancelled. */
+bool
+coro_is_cancelled(void);
+
+/**
+ * Make the waits of the current coroutine fail on cancellation or
+ * not. When not, a cancellation only wakes the coroutine up, and
+ * the waits start failing when the cancellation is enabled again.
+ * Protects the waits which must be completed. Returns the previous
+ * state. A new coroutine is cancellable.
+ */
+bool
+coro_set_cancellable(bool is_cancellable);
+
+/**
+ * A queue of suspended coroutines waiting for some event. The
+ * coroutines are linked into it by themselves, without separate
+ * entries. Waking up all of them flips their states, and then
+ * splices them into the run queue at once instead of pushing them
+ * one by one. In the M:N mode they are claimed one by one, but the
+ * idle threads are notified once.
+ *
+ * The queue of a single thread engine's coroutines, see
+ * coro_engine_new(), must be used only by the thread running the
+ * engine, even for the wakeups. In the M:N mode the queue can be
+ * used from any thread. A waiter whose condition can change in
+ * another thread gets into the queue first, with
+ * coro_wait_queue_prepare(), and checks the condition after that.
+ * Then a wakeup can't slip in between the check and the
+ * suspension.
+ */
+struct coro_wait_queue {
+	/** Protects the queue in the M:N mode. */
+	int lock;
+	struct rlist coros;
+};
+
+void
+coro_wait_queue_create(struct coro_wait_queue *queue);
+
+/** The queue must be empty. */
+void
+coro_wait_queue_destroy(struct coro_wait_queue *queue);
+
+/**
+ * Suspend the current coroutine in the queue until it is woken up.
+ * A wakeup by any other means, like coro_wakeup() or coro_cancel(),
+ * takes the coroutine out of the queue as well. Returns the same
+ * as coro_suspend().
+ */
+int
+coro_wait_queue_suspend(struct coro_wait_queue *queue);
+
+/**
+ * Put the current coroutine into the queue without suspending it.
+ * Then the waiter checks its condition, and either suspends with
+ * coro_wait_queue_commit(), or leaves with coro_wait_queue_abort()
+ * if there is no need to wait. A wakeup in between isn't lost, the
+ * commit returns right away then. Nothing else can be waited for
+ * in between.
+ */
+void
+coro_wait_queue_prepare(struct coro_wait_queue *queue);
+
+/**
+ * Suspend the coroutine prepared in the queue until it is woken
+ * up. Returns the same as coro_wait_queue_suspend().
+ */
+int
+coro_wait_queue_commit(struct coro_wait_queue *queue);
+
+/**
+ * Leave the queue after coro_wait_queue_prepare() without
+ * suspending. Returns true if the coroutine was woken up
+ * meanwhile, then the wakeup might need to be passed on to another
+ * waiter. In the M:N mode the next wait of the coroutine can
+ * return early then.
+ */
+bool
+coro_wait_queue_abort(struct coro_wait_queue *queue);
+
+/**
+ * Wake up the first coroutine of the queue. Returns false if the
+ * queue is empty.
+ */
+bool
+coro_wait_queue_wakeup_one(struct coro_wait_queue *queue);
+
+/** Wake up all the coroutines of the queue at once. */
+void
+coro_wait_queue_wakeup_all(struct coro_wait_queue *queue);
+
+/**
+ * Same as coro_suspend(), but the coroutine is woken up by the
+ * scheduler anyway when @a timeout seconds pass. Returns true if
+ * it was woken up before that, and false on the timeout. The
+ * timeouts have millisecond precision and never fire early.
+ */
+bool
+coro_suspend_timeout(double timeout);
+
+/**
+ * Same as coro_suspend_timeout(), but tells what the coroutine
+ * waits for, like coro_suspend_on().
+ */
+bool
+coro_suspend_timeout_on(double timeout, const char *what, const void *object);
+
+/**
+ * Pause the current coroutine for @a timeout seconds. The other
+ * coroutines keep running meanwhile. Returns 0, or -1 if the
+ * coroutine is cancelled.
+ */
+int
+coro_sleep(double timeout);
+
+/**
+ * Suspend the current coroutine until the descriptor @a fd gets
+ * any of the @a events (a mask of CORO_EVENT_*), or until
+ * @a timeout seconds pass. A negative timeout means infinity. The
+ * scheduler waits for the descriptors in epoll when it has nothing
+ * else to do.
+ *
+ * The readiness the descriptor already has is reported right away,
+ * but after that the wait reacts only on new events. So the
+ * descriptor should be non-blocking, and the I/O should go on
+ * until it fails with EAGAIN before waiting again. An error or a
+ * hangup on the descriptor counts as all the @a events.
+ *
+ * Returns the ready events, 0 on the timeout or on a wakeup with
+ * coro_wakeup(), and -1 on an error with errno set. In the same
+ * thread one coroutine can wait for reading a descriptor and
+ * another one for writing it, a second waiter of the same event
+ * fails with EEXIST. @a events without any of them fail with
+ * EINVAL. Works on Linux only, elsewhere fails with ENOSYS.
+ */
+int
+coro_wait_fd(int fd, int events, double timeout);
+
+/**
+ * Scheduler statistics of a coroutine or of all of them. Are
+ * collected only when libcoro is built with LIBCORO_STATS (the
+ * ENABLE_CORO_STATS option in CMake). Otherwise they are always
+ * zeros and cost nothing.
+ */
+struct coro_stats {
+	/** How many times the coroutine got the CPU. */
+	uint64_t switch_count;
+	/** How many times the coroutine suspended. */
+	uint64_t suspend_count;
+	/** Total time spent running, in nanoseconds. */
+	uint64_t run_ns;
+	/** Total time spent runnable, but waiting for the CPU. */
+	uint64_t wait_ns;
+};
+
+/**
+ * Get the stats of a coroutine since its start. Of a coroutine
+ * running in another thread they are approximate.
+ */
+void
+coro_stats(const struct coro *coro, struct coro_stats *stats);
+
+/** Get the stats of all the coroutines run by the scheduler. */
+void
+coro_sched_stats(struct coro_stats *stats);
+
+/**
+ * Print the scheduler stats and the stats of each not joined
+ * coroutine to stdout.
+ */
+void
+coro_stats_dump(void);
+
+/**
+ * Change the priority of a coroutine, CORO_PRIORITY_*. A new
+ * coroutine has the normal one. In the M:N mode the priorities
+ * are ignored.
+ */
+void
+coro_set_priority(struct coro *coro, int priority);
+
+/**
+ * Make the scheduler fair or not. A fair scheduler under load
+ * gives the priorities the CPU in proportion 16:4:1, so the lower
+ * ones still make progress. An unfair one always runs the highest
+ * priority first, and the others can starve. Fair by default.
+ */
+void
+coro_sched_set_fairness(bool is_fair);
+
+/**
+ * Set how the coroutine stacks are sized, CORO_STACK_MODE_*. Fixed
+ * by default.
+ *
+ * In the tracking modes a stack is painted with a pattern before
+ * the coroutine starts, and when the coroutine function returns,
+ * the pattern shows how deep the stack was used. So the whole stack
+ * memory gets committed. It is cheap for the small stacks, and the
+ * auto mode makes them small: a coroutine of a function which has
+ * been seen already gets a stack of 1.5 times its max usage rounded
+ * up to a power of 2. The runs going deeper than any of the earlier
+ * ones can overflow such a stack, and the guard page below it
+ * crashes the process then.
+ */
+void
+coro_sched_set_stack_mode(int mode);
+
+/** Stack size of a coroutine. */
+size_t
+coro_stack_size(const struct coro *coro);
+
+/**
+ * Peak stack usage of a coroutine which is finished, but not
+ * joined yet. 0 if the stack isn't tracked, or the coroutine is
+ * still running.
+ */
+size_t
+coro_stack_used(const struct coro *coro);
+
+/**
+ * Max stack usage seen in the finished coroutines of a function.
+ * 0 if none of them were tracked.
+ */
+size_t
+coro_stack_used_max(coro_f func);
+
+/**
+ * Turn the debug mode on or off. In the debug mode the scheduler
+ * keeps track of the suspended coroutines, of what they wait for,
+ * and of the backtraces of their suspensions. When the scheduler
+ * stops while some coroutines are still suspended, it prints them
+ * with coro_sched_dump_waits(). Such coroutines can be woken up
+ * only from outside of the scheduler, so usually that is a
+ * deadlock or a lost wakeup.
+ *
+ * Each suspension takes a backtrace, so it is much slower than
+ * normally. Off by default.
+ */
+void
+coro_sched_set_debug(bool is_enabled);
+
+/**
+ * Print the suspended coroutines to stdout: what each of them
+ * waits for and where it was suspended. The coroutines waiting
+ * for each other in a cycle are marked. Only the suspensions
+ * started in the debug mode are known. Returns the number of the
+ * printed coroutines.
+ */
+size_t
+coro_sched_dump_waits(void);
+
+/**
+ * Create a key for coroutine-local values, an analogue of
+ * pthread_key_create(). Each coroutine has its own value of the
+ * key, NULL at start. When a coroutine finishes, the destructor is
+ * called in it for each non-NULL value. The code outside of the
+ * coroutines has its own values as well, per thread running a
+ * scheduler.
+ *
+ * The keys can't be deleted. Returns the key, or -1 with errno
+ * EAGAIN if there are CORO_KEY_MAX keys already. The first few
+ * keys are the fastest, their values are stored right in the
+ * coroutine object.
+ */
+int
+coro_key_create(coro_key_destructor_f destructor);
+
+/** Get the value of a key in the current coroutine. */
+void *
+coro_getspecific(int key);
+
+/** Set the value of a key in the current coroutine. */
+void
+coro_setspecific(int key, void *value);
@@ -0,0 +1,407 @@
+#include "libcoro.h"
+
+#include "bench.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+
+/* Benchmarks of the coroutine engine. */
+
+#ifndef LIBCORO_CTX_PORTABLE
+#if defined(__x86_64__) || defined(__aarch64__)
+#define LIBCORO_CTX_PORTABLE 0
+#else
+#define LIBCORO_CTX_PORTABLE 1
+#endif
+#endif
+
+static const int bench_run_count = 5;
+static const int bench_spawn_count = 5000;
+static const int bench_yield_count = 1000000;
+static const int bench_suspend_count = 1000000;
+/** Enough to keep all the spawned coroutines in the pool. */
+static const size_t bench_pool_limit = (size_t)bench_spawn_count * 1024 * 1024;
+static const int bench_ping_pong_count = 1000000;
+/** Runnable coroutines besides the ping-pong pair. */
+static const int bench_ping_pong_load = 4;
+/** Stack of each of the many waiting coroutines. */
+static const size_t bench_wakeup_stack_size = 16 * 1024;
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void *
+bench_empty_f(void *arg)
+{
+	return arg;
+}
+
+/**
+ * Time of creating a coroutine with a new stack. The engine is
+ * created from scratch for each run, so no coroutines are reused.
+ */
+static void
+bench_spawn(void)
+{
+	double times[bench_run_count];
+	struct coro **coros = new struct coro *[bench_spawn_count];
+	for (int run_i = 0; run_i < bench_run_count; ++run_i) {
+		coro_sched_init();
+		uint64_t start_ts = bench_now_ns();
+		for (int i = 0; i < bench_spawn_count; ++i)
+			coros[i] = coro_new(bench_empty_f, NULL);
+		uint64_t duration = bench_now_ns() - start_ts;
+		times[run_i] = (double)duration / bench_spawn_count;
+
+		coro_sched_run();
+		for (int i = 0; i < bench_spawn_count; ++i)
+			coro_join(coros[i]);
+		coro_sched_destroy();
+	}
+	delete[] coros;
+	bench_report("Coroutine creation, cold", times, bench_run_count);
+}
+
+/**
+ * Time of creating a coroutine when a finished one can be reused
+ * from the pool, with its stack and object.
+ */
+static void
+bench_spawn_pooled(void)
+{
+	double times[bench_run_count];
+	struct coro **coros = new struct coro *[bench_spawn_count];
+	coro_sched_init();
+	coro_sched_set_pool_limit(bench_pool_limit);
+	/* Fill the pool. */
+	for (int i = 0; i < bench_spawn_count; ++i)
+		coros[i] = coro_new(bench_empty_f, NULL);
+	coro_sched_run();
+	for (int i = 0; i < bench_spawn_count; ++i)
+		coro_join(coros[i]);
+	for (int run_i = 0; run_i < bench_run_count; ++run_i) {
+		uint64_t start_ts = bench_now_ns();
+		for (int i = 0; i < bench_spawn_count; ++i)
+			coros[i] = coro_new(bench_empty_f, NULL);
+		uint64_t duration = bench_now_ns() - start_ts;
+		times[run_i] = (double)duration / bench_spawn_count;
+
+		coro_sched_run();
+		for (int i = 0; i < bench_spawn_count; ++i)
+			coro_join(coros[i]);
+	}
+	coro_sched_destroy();
+	delete[] coros;
+	bench_report("Coroutine creation, pooled", times, bench_run_count);
+}
+
+/**
+ * Time of joining a finished coroutine. It is either put into the
+ * pool, or freed when the pool is disabled.
+ */
+static void
+bench_join(bool is_pooled)
+{
+	double times[bench_run_count];
+	struct coro **coros = new struct coro *[bench_spawn_count];
+	coro_sched_init();
+	coro_sched_set_pool_limit(is_pooled ? bench_pool_limit : 0);
+	for (int run_i = 0; run_i < bench_run_count; ++run_i) {
+		for (int i = 0; i < bench_spawn_count; ++i)
+			coros[i] = coro_new(bench_empty_f, NULL);
+		coro_sched_run();
+		uint64_t start_ts = bench_now_ns();
+		for (int i = 0; i < bench_spawn_count; ++i)
+			coro_join(coros[i]);
+		uint64_t duration = bench_now_ns() - start_ts;
+		times[run_i] = (double)duration / bench_spawn_count;
+	}
+	coro_sched_destroy();
+	delete[] coros;
+	bench_report(is_pooled ? "Coroutine join, pooled" :
+		"Coroutine join, freed", times, bench_run_count);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void *
+bench_yield_f(void *arg)
+{
+	(void)arg;
+	for (int i = 0; i < bench_yield_count; ++i)
+		coro_yield();
+	return NULL;
+}
+
+/**
+ * Time of one yield between 2 coroutines. Each yield is a context
+ * switch to the other coroutine or to the scheduler.
+ */
+static void
+bench_yield(void)
+{
+	double times[bench_run_count];
+	coro_sched_init();
+	for (int run_i = 0; run_i < bench_run_count; ++run_i) {
+		struct coro *c1 = coro_new(bench_yield_f, NULL);
+		struct coro *c2 = coro_new(bench_yield_f, NULL);
+		uint64_t start_ts = bench_now_ns();
+		coro_sched_run();
+		uint64_t duration = bench_now_ns() - start_ts;
+		times[run_i] = (double)duration / (2 * bench_yield_count);
+		coro_join(c1);
+		coro_join(c2);
+	}
+	coro_sched_destroy();
+	bench_report("Coroutine yield", times, bench_run_count);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+struct bench_suspend_ctx {
+	struct coro *sleeper;
+	bool is_done;
+};
+
+static void *
+bench_sleeper_f(void *arg)
+{
+	struct bench_suspend_ctx *ctx = (struct bench_suspend_ctx *)arg;
+	while (!ctx->is_done)
+		coro_suspend();
+	return NULL;
+}
+
+static void *
+bench_waker_f(void *arg)
+{
+	struct bench_suspend_ctx *ctx = (struct bench_suspend_ctx *)arg;
+	for (int i = 0; i < bench_suspend_count; ++i) {
+		coro_wakeup(ctx->sleeper);
+		coro_yield();
+	}
+	ctx->is_done = true;
+	coro_wakeup(ctx->sleeper);
+	return NULL;
+}
+
+/**
+ * Time of one cycle of a suspension and a wakeup. One coroutine
+ * keeps suspending, and the other one wakes it up and yields.
+ */
+static void
+bench_suspend_wakeup(void)
+{
+	double times[bench_run_count];
+	coro_sched_init();
+	for (int run_i = 0; run_i < bench_run_count; ++run_i) {
+		struct bench_suspend_ctx ctx;
+		ctx.is_done = false;
+		ctx.sleeper = coro_new(bench_sleeper_f, &ctx);
+		struct coro *waker = coro_new(bench_waker_f, &ctx);
+		uint64_t start_ts = bench_now_ns();
+		coro_sched_run();
+		uint64_t duration = bench_now_ns() - start_ts;
+		times[run_i] = (double)duration / bench_suspend_count;
+		coro_join(ctx.sleeper);
+		coro_join(waker);
+	}
+	coro_sched_destroy();
+	bench_report("Coroutine suspend and wakeup", times, bench_run_count);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+struct bench_ping_pong_ctx {
+	/** Whose turn it is, 0 or 1. */
+	int turn;
+	bool is_direct;
+	bool is_done;
+	struct coro *coros[2];
+};
+
+struct bench_ping_pong_side {
+	struct bench_ping_pong_ctx *ctx;
+	int id;
+};
+
+static void *
+bench_ping_pong_f(void *arg)
+{
+	struct bench_ping_pong_side *side = (struct bench_ping_pong_side *)arg;
+	struct bench_ping_pong_ctx *ctx = side->ctx;
+	for (int i = 0; i < bench_ping_pong_count; ++i) {
+		while (ctx->turn != side->id)
+			coro_suspend();
+		ctx->turn = 1 - side->id;
+		if (ctx->is_direct)
+			coro_switch_to(ctx->coros[ctx->turn]);
+		else
+			coro_wakeup(ctx->coros[ctx->turn]);
+	}
+	ctx->is_done = true;
+	return NULL;
+}
+
+static void *
+bench_load_f(void *arg)
+{
+	struct bench_ping_pong_ctx *ctx = (struct bench_ping_pong_ctx *)arg;
+	while (!ctx->is_done)
+		coro_yield();
+	return NULL;
+}
+
+/**
+ * Latency of passing a turn between 2 coroutines, while a few
+ * other coroutines keep the run queue busy.
+ */
+static void
+bench_ping_pong(bool is_direct)
+{
+	double times[bench_run_count];
+	coro_sched_init();
+	for (int run_i = 0; run_i < bench_run_count; ++run_i) {
+		struct bench_ping_pong_ctx ctx;
+		ctx.turn = 0;
+		ctx.is_direct = is_direct;
+		ctx.is_done = false;
+		struct bench_ping_pong_side sides[2];
+		for (int i = 0; i < 2; ++i) {
+			sides[i].ctx = &ctx;
+			sides[i].id = i;
+			ctx.coros[i] = coro_new(bench_ping_pong_f, &sides[i]);
+		}
+		struct coro *load[bench_ping_pong_load];
+		for (int i = 0; i < bench_ping_pong_load; ++i)
+			load[i] = coro_new(bench_load_f, &ctx);
+		uint64_t start_ts = bench_now_ns();
+		coro_sched_run();
+		uint64_t duration = bench_now_ns() - start_ts;
+		times[run_i] = (double)duration / (2 * bench_ping_pong_count);
+		for (int i = 0; i < 2; ++i)
+			coro_join(ctx.coros[i]);
+		for (int i = 0; i < bench_ping_pong_load; ++i)
+			coro_join(load[i]);
+	}
+	coro_sched_destroy();
+	bench_report(is_direct ? "Ping-pong via coro_switch_to()" :
+		"Ping-pong via coro_wakeup()", times, bench_run_count);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+struct bench_wakeup_ctx {
+	struct coro_wait_queue queue;
+	bool is_batch;
+	bool is_done;
+};
+
+static void *
+bench_wakeup_f(void *arg)
+{
+	struct bench_wakeup_ctx *ctx = (struct bench_wakeup_ctx *)arg;
+	while (!ctx->is_done) {
+		if (ctx->is_batch)
+			coro_wait_queue_suspend(&ctx->queue);
+		else
+			coro_suspend();
+	}
+	return NULL;
+}
+
+/**
+ * Time of waking up many suspended coroutines, per coroutine. Only
+ * the wakeup is measured, not the run of the woken coroutines. The
+ * coroutines use the memory given by the benchmark, so there can
+ * be many of them without a mapping per stack.
+ */
+static void
+bench_wakeup(int coro_count, bool is_batch)
+{
+	double times[bench_run_count];
+	size_t stacks_size = coro_count * bench_wakeup_stack_size;
+	void *stacks = mmap(NULL, stacks_size, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (stacks == MAP_FAILED) {
+		printf("Couldn't map the stacks\n");
+		exit(-1);
+	}
+	struct coro_storage *storages = new struct coro_storage[coro_count];
+	struct coro **coros = new struct coro *[coro_count];
+	struct bench_wakeup_ctx ctx;
+	coro_wait_queue_create(&ctx.queue);
+	ctx.is_batch = is_batch;
+	ctx.is_done = false;
+	coro_sched_init();
+	struct coro_attr attr;
+	coro_attr_create(&attr);
+	attr.stack_size = bench_wakeup_stack_size;
+	for (int i = 0; i < coro_count; ++i) {
+		attr.stack = (char *)stacks + i * bench_wakeup_stack_size;
+		attr.storage = &storages[i];
+		coros[i] = coro_new_ex(bench_wakeup_f, &ctx, &attr);
+	}
+	/* Returns when all of them are suspended. */
+	coro_sched_run();
+	for (int run_i = 0; run_i < bench_run_count; ++run_i) {
+		uint64_t start_ts = bench_now_ns();
+		if (is_batch) {
+			coro_wait_queue_wakeup_all(&ctx.queue);
+		} else {
+			for (int i = 0; i < coro_count; ++i)
+				coro_wakeup(coros[i]);
+		}
+		uint64_t duration = bench_now_ns() - start_ts;
+		times[run_i] = (double)duration / coro_count;
+		coro_sched_run();
+	}
+	ctx.is_done = true;
+	for (int i = 0; i < coro_count; ++i)
+		coro_wakeup(coros[i]);
+	coro_sched_run();
+	for (int i = 0; i < coro_count; ++i)
+		coro_join(coros[i]);
+	coro_sched_destroy();
+	coro_wait_queue_destroy(&ctx.queue);
+	delete[] coros;
+	delete[] storages;
+	munmap(stacks, stacks_size);
+	char name[128];
+	snprintf(name, sizeof(name), "Wakeup of %d coroutines via %s",
+		coro_count, is_batch ? "coro_wait_queue_wakeup_all()" :
+		"coro_wakeup()");
+	bench_report(name, times, bench_run_count);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+int
+main(int argc, char **argv)
+{
+	if (bench_parse_args(argc, argv) != 0)
+		return -1;
+	if (bench_is_csv) {
+		printf("# backend: %s\n",
+			LIBCORO_CTX_PORTABLE ? "portable" : "asm");
+		printf("name,min_ns,med_ns,max_ns\n");
+	} else {
+		printf("Context switch backend: %s\n",
+			LIBCORO_CTX_PORTABLE ? "portable" : "asm");
+	}
+	bench_spawn();
+	bench_spawn_pooled();
+	bench_join(true);
+	bench_join(false);
+	bench_yield();
+	bench_suspend_wakeup();
+	bench_ping_pong(false);
+	bench_ping_pong(true);
+	const int wakeup_counts[] = {1000, 100000};
+	for (int count : wakeup_counts) {
+		bench_wakeup(count, false);
+		bench_wakeup(count, true);
+	}
+	return 0;
+}
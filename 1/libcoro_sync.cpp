@@ -0,0 +1,345 @@
+#include "libcoro_sync.h"
+
+#include "libcoro.h"
+
+#include <assert.h>
+#include <sched.h>
+
+/**
+ * The state of the primitives is protected by a spinlock. It is
+ * held only for a few list operations, never across a suspension,
+ * and costs one atomic exchange when there is no contention, like
+ * in the single thread mode.
+ */
+static inline void
+coro_sync_lock(int *lock)
+{
+	int spin_count = 0;
+	while (__atomic_exchange_n(lock, 1, __ATOMIC_ACQUIRE) != 0) {
+		while (__atomic_load_n(lock, __ATOMIC_RELAXED) != 0) {
+			/* The owner thread might be preempted. */
+			if (++spin_count % 64 == 0)
+				sched_yield();
+		}
+	}
+}
+
+static inline void
+coro_sync_unlock(int *lock)
+{
+	__atomic_store_n(lock, 0, __ATOMIC_RELEASE);
+}
+
+static inline void
+coro_sync_waiter_create(struct coro_sync_waiter *waiter)
+{
+	waiter->coro = coro_this();
+	waiter->is_granted = false;
+	waiter->mutex = NULL;
+}
+
+/**
+ * Suspend until the resource is handed over. In the M:N mode a
+ * wakeup can be spurious, so the grant is what matters. It is
+ * checked under @a lock, the one held by the granter, so the
+ * waiter can't finish while the granter still wakes it up. The
+ * waiter is already in the queue and can't leave it, so the wait
+ * isn't interrupted by a cancellation. The primitive is named for
+ * the debug dumps.
+ */
+static void
+coro_sync_waiter_wait(struct coro_sync_waiter *waiter, int *lock,
+	const char *what, const void *object)
+{
+	bool is_cancellable = coro_set_cancellable(false);
+	while (true) {
+		coro_sync_lock(lock);
+		bool is_granted = waiter->is_granted;
+		coro_sync_unlock(lock);
+		if (is_granted)
+			break;
+		coro_suspend_on(what, object);
+	}
+	coro_set_cancellable(is_cancellable);
+}
+
+/**
+ * Hand the resource over to a waiter which is already out of the
+ * queue. The lock of the primitive must be held until the wakeup
+ * is done, see coro_sync_waiter_wait().
+ */
+static void
+coro_sync_waiter_grant(struct coro_sync_waiter *waiter)
+{
+	waiter->is_granted = true;
+	coro_wakeup(waiter->coro);
+}
+
+////////////////////////////////////////////////////////////////////
+
+void
+coro_mutex_create(struct coro_mutex *mutex)
+{
+	mutex->lock = 0;
+	mutex->is_locked = false;
+	rlist_create(&mutex->waiters);
+}
+
+void
+coro_mutex_destroy(struct coro_mutex *mutex)
+{
+	assert(!mutex->is_locked);
+	assert(rlist_empty(&mutex->waiters));
+	(void)mutex;
+}
+
+/**
+ * Make a waiter the owner of the mutex, or queue it. Returns true
+ * if the mutex is taken.
+ */
+static bool
+coro_mutex_lock_or_queue(struct coro_mutex *mutex,
+	struct coro_sync_waiter *waiter)
+{
+	coro_sync_lock(&mutex->lock);
+	if (!mutex->is_locked) {
+		mutex->is_locked = true;
+		coro_sync_unlock(&mutex->lock);
+		return true;
+	}
+	rlist_add_tail_entry(&mutex->waiters, waiter, link);
+	coro_sync_unlock(&mutex->lock);
+	return false;
+}
+
+void
+coro_mutex_lock(struct coro_mutex *mutex)
+{
+	struct coro_sync_waiter waiter;
+	coro_sync_waiter_create(&waiter);
+	if (coro_mutex_lock_or_queue(mutex, &waiter))
+		return;
+	coro_sync_waiter_wait(&waiter, &mutex->lock, "mutex", mutex);
+}
+
+bool
+coro_mutex_trylock(struct coro_mutex *mutex)
+{
+	coro_sync_lock(&mutex->lock);
+	bool ok = !mutex->is_locked;
+	mutex->is_locked = true;
+	coro_sync_unlock(&mutex->lock);
+	return ok;
+}
+
+void
+coro_mutex_unlock(struct coro_mutex *mutex)
+{
+	coro_sync_lock(&mutex->lock);
+	assert(mutex->is_locked);
+	if (rlist_empty(&mutex->waiters)) {
+		mutex->is_locked = false;
+		coro_sync_unlock(&mutex->lock);
+		return;
+	}
+	/* Stays locked, the first waiter is the new owner. */
+	struct coro_sync_waiter *waiter = rlist_shift_entry(&mutex->waiters,
+		struct coro_sync_waiter, link);
+	coro_sync_waiter_grant(waiter);
+	coro_sync_unlock(&mutex->lock);
+}
+
+////////////////////////////////////////////////////////////////////
+
+void
+coro_cond_create(struct coro_cond *cond)
+{
+	cond->lock = 0;
+	rlist_create(&cond->waiters);
+}
+
+void
+coro_cond_destroy(struct coro_cond *cond)
+{
+	assert(rlist_empty(&cond->waiters));
+	(void)cond;
+}
+
+void
+coro_cond_wait(struct coro_cond *cond, struct coro_mutex *mutex)
+{
+	struct coro_sync_waiter waiter;
+	coro_sync_waiter_create(&waiter);
+	waiter.mutex = mutex;
+	coro_sync_lock(&cond->lock);
+	rlist_add_tail_entry(&cond->waiters, &waiter, link);
+	coro_sync_unlock(&cond->lock);
+	coro_mutex_unlock(mutex);
+	/* Granted means the mutex is taken already. */
+	coro_sync_waiter_wait(&waiter, &mutex->lock, "cond", cond);
+}
+
+/**
+ * Move a signalled waiter to its mutex. It is woken up only when
+ * it can take the mutex.
+ */
+static void
+coro_cond_wakeup_waiter(struct coro_sync_waiter *waiter)
+{
+	struct coro_mutex *mutex = waiter->mutex;
+	coro_sync_lock(&mutex->lock);
+	if (!mutex->is_locked) {
+		mutex->is_locked = true;
+		coro_sync_waiter_grant(waiter);
+	} else {
+		rlist_add_tail_entry(&mutex->waiters, waiter, link);
+	}
+	coro_sync_unlock(&mutex->lock);
+}
+
+void
+coro_cond_signal(struct coro_cond *cond)
+{
+	coro_sync_lock(&cond->lock);
+	if (rlist_empty(&cond->waiters)) {
+		coro_sync_unlock(&cond->lock);
+		return;
+	}
+	struct coro_sync_waiter *waiter = rlist_shift_entry(&cond->waiters,
+		struct coro_sync_waiter, link);
+	coro_sync_unlock(&cond->lock);
+	coro_cond_wakeup_waiter(waiter);
+}
+
+void
+coro_cond_broadcast(struct coro_cond *cond)
+{
+	struct rlist waiters;
+	rlist_create(&waiters);
+	coro_sync_lock(&cond->lock);
+	rlist_splice_tail(&waiters, &cond->waiters);
+	coro_sync_unlock(&cond->lock);
+	/*
+	 * Only one of them gets the mutex right away, the others
+	 * are queued on it without waking up.
+	 */
+	while (!rlist_empty(&waiters)) {
+		struct coro_sync_waiter *waiter = rlist_shift_entry(&waiters,
+			struct coro_sync_waiter, link);
+		coro_cond_wakeup_waiter(waiter);
+	}
+}
+
+////////////////////////////////////////////////////////////////////
+
+void
+coro_sem_create(struct coro_sem *sem, size_t count)
+{
+	sem->lock = 0;
+	sem->count = count;
+	rlist_create(&sem->waiters);
+}
+
+void
+coro_sem_destroy(struct coro_sem *sem)
+{
+	assert(rlist_empty(&sem->waiters));
+	(void)sem;
+}
+
+void
+coro_sem_wait(struct coro_sem *sem)
+{
+	coro_sync_lock(&sem->lock);
+	if (sem->count > 0) {
+		--sem->count;
+		coro_sync_unlock(&sem->lock);
+		return;
+	}
+	struct coro_sync_waiter waiter;
+	coro_sync_waiter_create(&waiter);
+	rlist_add_tail_entry(&sem->waiters, &waiter, link);
+	coro_sync_unlock(&sem->lock);
+	coro_sync_waiter_wait(&waiter, &sem->lock, "semaphore", sem);
+}
+
+bool
+coro_sem_trywait(struct coro_sem *sem)
+{
+	coro_sync_lock(&sem->lock);
+	bool ok = sem->count > 0;
+	if (ok)
+		--sem->count;
+	coro_sync_unlock(&sem->lock);
+	return ok;
+}
+
+void
+coro_sem_post(struct coro_sem *sem)
+{
+	coro_sync_lock(&sem->lock);
+	if (rlist_empty(&sem->waiters)) {
+		++sem->count;
+		coro_sync_unlock(&sem->lock);
+		return;
+	}
+	struct coro_sync_waiter *waiter = rlist_shift_entry(&sem->waiters,
+		struct coro_sync_waiter, link);
+	coro_sync_waiter_grant(waiter);
+	coro_sync_unlock(&sem->lock);
+}
+
+////////////////////////////////////////////////////////////////////
+
+void
+coro_wait_group_create(struct coro_wait_group *group)
+{
+	group->lock = 0;
+	group->count = 0;
+	rlist_create(&group->waiters);
+}
+
+void
+coro_wait_group_destroy(struct coro_wait_group *group)
+{
+	assert(rlist_empty(&group->waiters));
+	(void)group;
+}
+
+void
+coro_wait_group_add(struct coro_wait_group *group, size_t count)
+{
+	coro_sync_lock(&group->lock);
+	group->count += count;
+	coro_sync_unlock(&group->lock);
+}
+
+void
+coro_wait_group_done(struct coro_wait_group *group)
+{
+	coro_sync_lock(&group->lock);
+	assert(group->count > 0);
+	if (--group->count == 0) {
+		while (!rlist_empty(&group->waiters)) {
+			struct coro_sync_waiter *waiter = rlist_shift_entry(
+				&group->waiters, struct coro_sync_waiter, link);
+			coro_sync_waiter_grant(waiter);
+		}
+	}
+	coro_sync_unlock(&group->lock);
+}
+
+void
+coro_wait_group_wait(struct coro_wait_group *group)
+{
+	coro_sync_lock(&group->lock);
+	if (group->count == 0) {
+		coro_sync_unlock(&group->lock);
+		return;
+	}
+	struct coro_sync_waiter waiter;
+	coro_sync_waiter_create(&waiter);
+	rlist_add_tail_entry(&group->waiters, &waiter, link);
+	coro_sync_unlock(&group->lock);
+	coro_sync_waiter_wait(&waiter, &group->lock, "wait group", group);
+}
@@ -0,0 +1,138 @@
+#pragma once
+
+#include "rlist.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * Synchronization primitives for the coroutines. Blocking in them
+ * suspends only the current coroutine. They work in the M:N mode
+ * as well. The waits in them aren't interrupted by coro_cancel().
+ *
+ * The waiters are queued in FIFO order, and a released resource is
+ * handed over to the first waiter directly. So a woken up waiter
+ * doesn't need to compete for it again, and only one coroutine is
+ * woken up per released resource. The waiter entries live on the
+ * waiters' stacks, nothing is allocated.
+ */
+
+struct coro;
+
+/** A coroutine waiting in one of the primitives. */
+struct coro_sync_waiter {
+	struct rlist link;
+	struct coro *coro;
+	/**
+	 * The resource is handed over to the waiter. Protected by
+	 * the lock of the primitive handing it over.
+	 */
+	bool is_granted;
+	/**
+	 * The mutex to take before waking up the waiter. Used by
+	 * the condition variables.
+	 */
+	struct coro_mutex *mutex;
+};
+
+struct coro_mutex {
+	/** Protects the state from the concurrent threads. */
+	int lock;
+	bool is_locked;
+	struct rlist waiters;
+};
+
+void
+coro_mutex_create(struct coro_mutex *mutex);
+
+/** The mutex must be unlocked and have no waiters. */
+void
+coro_mutex_destroy(struct coro_mutex *mutex);
+
+void
+coro_mutex_lock(struct coro_mutex *mutex);
+
+/** Lock the mutex if it is free. Returns true on success. */
+bool
+coro_mutex_trylock(struct coro_mutex *mutex);
+
+void
+coro_mutex_unlock(struct coro_mutex *mutex);
+
+struct coro_cond {
+	int lock;
+	struct rlist waiters;
+};
+
+void
+coro_cond_create(struct coro_cond *cond);
+
+void
+coro_cond_destroy(struct coro_cond *cond);
+
+/**
+ * Unlock the mutex, wait for a signal, lock the mutex again. A
+ * signalled waiter is moved right into the queue of the mutex,
+ * and isn't woken up until the mutex is handed over to it.
+ */
+void
+coro_cond_wait(struct coro_cond *cond, struct coro_mutex *mutex);
+
+/** Wake up the first waiter, if any. */
+void
+coro_cond_signal(struct coro_cond *cond);
+
+/** Wake up all the waiters. */
+void
+coro_cond_broadcast(struct coro_cond *cond);
+
+/** Counting semaphore. */
+struct coro_sem {
+	int lock;
+	size_t count;
+	struct rlist waiters;
+};
+
+void
+coro_sem_create(struct coro_sem *sem, size_t count);
+
+void
+coro_sem_destroy(struct coro_sem *sem);
+
+/** Take a unit, waiting for it if there are none. */
+void
+coro_sem_wait(struct coro_sem *sem);
+
+/** Take a unit if there is one. Returns true on success. */
+bool
+coro_sem_trywait(struct coro_sem *sem);
+
+/** Give a unit back, to the first waiter if there is one. */
+void
+coro_sem_post(struct coro_sem *sem);
+
+/** Wait until a set of jobs is done. */
+struct coro_wait_group {
+	int lock;
+	/** Number of the jobs not done yet. */
+	size_t count;
+	struct rlist waiters;
+};
+
+void
+coro_wait_group_create(struct coro_wait_group *group);
+
+void
+coro_wait_group_destroy(struct coro_wait_group *group);
+
+/** Add @a count more jobs to wait for. */
+void
+coro_wait_group_add(struct coro_wait_group *group, size_t count);
+
+/** One job is done. The last one wakes up all the waiters. */
+void
+coro_wait_group_done(struct coro_wait_group *group);
+
+/** Wait until all the jobs are done. */
+void
+coro_wait_group_wait(struct coro_wait_group *group);
@@ -1,7 +1,17 @@
 #include "libcoro.h"
+#include "libcoro_sync.h"
 
 #include "unit.h"
 
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
 ////////////////////////////////////////////////////////////////////////////////
 
 static void *
@@ -162,6 +172,1488 @@ test_wakeup_of_finished(void)
 
 ////////////////////////////////////////////////////////////////////////////////
 
+static void *
+test_stack_use_f(void *arg)
+{
+	size_t size = *(size_t *)arg;
+	volatile char *buf = (volatile char *)__builtin_alloca(size);
+	for (size_t i = 0; i < size; i += 512)
+		buf[i] = (char)(i / 512);
+	size_t sum = 0;
+	for (size_t i = 0; i < size; i += 512)
+		sum += (unsigned char)buf[i];
+	return (void *)sum;
+}
+
+static void
+test_stack_size(void)
+{
+	unit_test_start();
+
+	struct coro_attr attr;
+	coro_attr_create(&attr);
+	attr.stack_size = 64 * 1024;
+	size_t small_use = 48 * 1024;
+	struct coro *c1 = coro_new_ex(test_stack_use_f, &small_use, &attr);
+	attr.stack_size = 8 * 1024 * 1024;
+	size_t big_use = 6 * 1024 * 1024;
+	struct coro *c2 = coro_new_ex(test_stack_use_f, &big_use, &attr);
+	unit_check(coro_join(c1) != NULL, "small stack is usable");
+	unit_check(coro_join(c2) != NULL, "big stack is usable");
+
+	unit_msg("reuse the stacks");
+	attr.stack_size = 64 * 1024;
+	c1 = coro_new_ex(test_stack_use_f, &small_use, &attr);
+	c2 = coro_new(test_stack_use_f, &small_use);
+	unit_check(coro_join(c1) != NULL, "reused small stack");
+	unit_check(coro_join(c2) != NULL, "default stack");
+
+	unit_test_finish();
+}
+
+static void
+test_user_memory(void)
+{
+	unit_test_start();
+
+	const size_t stack_size = 64 * 1024;
+	static char stack[stack_size] alignas(16);
+	static struct coro_storage storage;
+	size_t use = 48 * 1024;
+	struct coro_attr attr;
+	coro_attr_create(&attr);
+	attr.stack = stack;
+	attr.stack_size = stack_size;
+	attr.storage = &storage;
+	for (int i = 0; i < 3; ++i) {
+		struct coro *c = coro_new_ex(test_stack_use_f, &use, &attr);
+		unit_assert((void *)c == (void *)&storage);
+		unit_assert(coro_join(c) != NULL);
+	}
+	unit_check(true, "user's stack and storage are reused");
+
+	attr.stack = NULL;
+	struct coro *c1 = coro_new_ex(test_stack_use_f, &use, &attr);
+	attr.stack = stack;
+	attr.storage = NULL;
+	struct coro *c2 = coro_new_ex(test_stack_use_f, &use, &attr);
+	unit_check((void *)c1 == (void *)&storage, "only storage");
+	unit_check(coro_join(c1) != NULL, "library's stack");
+	unit_check(coro_join(c2) != NULL, "only stack");
+
+	unit_test_finish();
+}
+
+static void
+test_stack_mode(void)
+{
+	unit_test_start();
+
+	coro_sched_set_stack_mode(CORO_STACK_MODE_TRACK);
+	size_t use = 40 * 1024;
+	struct coro *c = coro_new(test_stack_use_f, &use);
+	unit_assert(coro_stack_used(c) == 0);
+	while (coro_stack_used(c) == 0)
+		coro_yield();
+	size_t used = coro_stack_used(c);
+	unit_check(used >= use && used < use + 16 * 1024, "usage is measured");
+	unit_assert(coro_join(c) != NULL);
+
+	use = 8 * 1024;
+	c = coro_new(test_stack_use_f, &use);
+	while (coro_stack_used(c) == 0)
+		coro_yield();
+	used = coro_stack_used(c);
+	unit_check(used >= use && used < use + 16 * 1024,
+		"usage of a reused stack");
+	unit_assert(coro_join(c) != NULL);
+	size_t used_max = coro_stack_used_max(test_stack_use_f);
+	unit_check(used_max >= 40 * 1024 && used_max < 56 * 1024,
+		"max usage of a function");
+
+	coro_sched_set_stack_mode(CORO_STACK_MODE_AUTO);
+	c = coro_new(test_stack_use_f, &use);
+	size_t size = coro_stack_size(c);
+	unit_check(size >= used_max && size <= 128 * 1024,
+		"stack is sized by the usage");
+	unit_assert(coro_join(c) != NULL);
+	struct coro_attr attr;
+	coro_attr_create(&attr);
+	attr.stack_size = 256 * 1024;
+	c = coro_new_ex(test_stack_use_f, &use, &attr);
+	unit_check(coro_stack_size(c) == attr.stack_size,
+		"explicit size is kept");
+	unit_assert(coro_join(c) != NULL);
+	coro_sched_set_stack_mode(CORO_STACK_MODE_FIXED);
+
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void
+test_pool_limit(void)
+{
+	unit_test_start();
+
+	const int coro_count = 40;
+	struct coro *coros[coro_count];
+	size_t use = 12 * 1024;
+	struct coro_attr attr;
+	coro_attr_create(&attr);
+	attr.stack_size = 16 * 1024;
+
+	unit_msg("no pooling");
+	coro_sched_set_pool_limit(0);
+	for (int i = 0; i < coro_count; ++i)
+		coros[i] = coro_new_ex(test_stack_use_f, &use, &attr);
+	for (int i = 0; i < coro_count; ++i)
+		unit_assert(coro_join(coros[i]) != NULL);
+
+	unit_msg("pool more than can keep hot");
+	coro_sched_set_pool_limit(1024 * 1024);
+	for (int r = 0; r < 3; ++r) {
+		for (int i = 0; i < coro_count; ++i)
+			coros[i] = coro_new_ex(test_stack_use_f, &use, &attr);
+		for (int i = 0; i < coro_count; ++i)
+			unit_assert(coro_join(coros[i]) != NULL);
+	}
+	unit_msg("shrink the pool");
+	coro_sched_set_pool_limit(64 * 1024);
+	for (int i = 0; i < coro_count; ++i)
+		coros[i] = coro_new_ex(test_stack_use_f, &use, &attr);
+	for (int i = 0; i < coro_count; ++i)
+		unit_assert(coro_join(coros[i]) != NULL);
+	coro_sched_set_pool_limit(128 * 1024 * 1024);
+	unit_check(true, "pool works with limits");
+
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static double
+test_time(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+struct test_sleep_ctx {
+	double timeout;
+	int *order;
+	int *pos;
+};
+
+static void *
+test_sleep_f(void *arg)
+{
+	struct test_sleep_ctx *ctx = (decltype(ctx))arg;
+	double start = test_time();
+	coro_sleep(ctx->timeout);
+	unit_assert(test_time() - start >= ctx->timeout);
+	ctx->order[(*ctx->pos)++] = (int)(ctx->timeout * 1000);
+	return NULL;
+}
+
+static void *
+test_suspend_timeout_f(void *arg)
+{
+	double timeout = *(double *)arg;
+	return (void *)(long)coro_suspend_timeout(timeout);
+}
+
+static void
+test_timers(void)
+{
+	unit_test_start();
+
+	/* Both within the first level of the wheel and beyond. */
+	const int coro_count = 4;
+	double timeouts[coro_count] = {0.1, 0.003, 0.07, 0.001};
+	struct test_sleep_ctx ctxs[coro_count];
+	struct coro *coros[coro_count];
+	int order[coro_count];
+	int pos = 0;
+	for (int i = 0; i < coro_count; ++i) {
+		ctxs[i].timeout = timeouts[i];
+		ctxs[i].order = order;
+		ctxs[i].pos = &pos;
+		coros[i] = coro_new(test_sleep_f, &ctxs[i]);
+	}
+	for (int i = 0; i < coro_count; ++i)
+		unit_assert(coro_join(coros[i]) == NULL);
+	unit_check(order[0] == 1 && order[1] == 3 && order[2] == 70 &&
+		order[3] == 100, "sleeps end in the deadlines order");
+
+	double timeout = 0.01;
+	double start = test_time();
+	struct coro *c = coro_new(test_suspend_timeout_f, &timeout);
+	unit_check(coro_join(c) == (void *)0, "suspend timed out");
+	unit_check(test_time() - start >= timeout, "not earlier than needed");
+
+	timeout = 10;
+	start = test_time();
+	c = coro_new(test_suspend_timeout_f, &timeout);
+	coro_yield();
+	coro_wakeup(c);
+	unit_check(coro_join(c) == (void *)1, "suspend woken up");
+	unit_check(test_time() - start < timeout, "timer is stopped");
+
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void
+test_pipe(int *fds)
+{
+	unit_fail_if(pipe(fds) != 0);
+	for (int i = 0; i < 2; ++i)
+		unit_fail_if(fcntl(fds[i], F_SETFL, O_NONBLOCK) != 0);
+}
+
+static void *
+test_wait_read_f(void *arg)
+{
+	int fd = *(int *)arg;
+	/* Stays 0 on EOF. */
+	char c = 0;
+	while (read(fd, &c, 1) < 0) {
+		unit_assert(errno == EAGAIN);
+		int rc = coro_wait_fd(fd, CORO_EVENT_READ, 10);
+		unit_assert(rc == CORO_EVENT_READ);
+	}
+	return (void *)(long)c;
+}
+
+static void *
+test_wait_write_f(void *arg)
+{
+	int fd = *(int *)arg;
+	while (write(fd, "y", 1) < 0) {
+		unit_assert(errno == EAGAIN);
+		int rc = coro_wait_fd(fd, CORO_EVENT_WRITE, 10);
+		unit_assert(rc == CORO_EVENT_WRITE);
+	}
+	return (void *)1;
+}
+
+static void
+test_wait_fd(void)
+{
+	unit_test_start();
+
+	int fds[2];
+	test_pipe(fds);
+	struct coro *c = coro_new(test_wait_read_f, &fds[0]);
+	coro_sleep(0.005);
+	unit_fail_if(write(fds[1], "x", 1) != 1);
+	unit_check(coro_join(c) == (void *)'x', "woken up by data");
+
+	double start = test_time();
+	unit_check(coro_wait_fd(fds[0], CORO_EVENT_READ, 0.01) == 0,
+		"timed out");
+	unit_check(test_time() - start >= 0.01, "not earlier than needed");
+	unit_check(coro_wait_fd(fds[1], CORO_EVENT_READ | CORO_EVENT_WRITE,
+		-1) == CORO_EVENT_WRITE, "ready already");
+
+	c = coro_new(test_wait_read_f, &fds[0]);
+	coro_yield();
+	unit_check(coro_wait_fd(fds[0], CORO_EVENT_READ, 0) == -1 &&
+		errno == EEXIST, "one waiter per descriptor");
+	close(fds[1]);
+	unit_check(coro_join(c) == (void *)0, "woken up by hangup");
+	close(fds[0]);
+	unit_check(coro_wait_fd(fds[0], 0, 0) == -1 && errno == EINVAL,
+		"no events");
+
+	unit_fail_if(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0);
+	for (int i = 0; i < 2; ++i)
+		unit_fail_if(fcntl(fds[i], F_SETFL, O_NONBLOCK) != 0);
+	char buf[4096];
+	memset(buf, 0, sizeof(buf));
+	while (write(fds[0], buf, sizeof(buf)) > 0)
+		;
+	unit_fail_if(errno != EAGAIN);
+	struct coro *reader = coro_new(test_wait_read_f, &fds[0]);
+	struct coro *writer = coro_new(test_wait_write_f, &fds[0]);
+	coro_yield();
+	unit_check(coro_wait_fd(fds[0], CORO_EVENT_WRITE, 0) == -1 &&
+		errno == EEXIST, "one writer per descriptor");
+	unit_fail_if(write(fds[1], "x", 1) != 1);
+	unit_check(coro_join(reader) == (void *)'x',
+		"reader woken up next to a writer");
+	while (read(fds[1], buf, sizeof(buf)) > 0)
+		;
+	unit_check(coro_join(writer) == (void *)1,
+		"writer woken up after the reader");
+	close(fds[0]);
+	close(fds[1]);
+
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void *
+test_stats_f(void *arg)
+{
+	(void)arg;
+	for (int i = 0; i < 10; ++i)
+		coro_yield();
+	coro_suspend();
+	return NULL;
+}
+
+static void
+test_stats(void)
+{
+	unit_test_start();
+
+	struct coro_stats total_before;
+	coro_sched_stats(&total_before);
+	struct coro *c = coro_new(test_stats_f, NULL);
+	struct coro_stats stats;
+	coro_stats(c, &stats);
+	unit_check(stats.switch_count == 0, "not started");
+	coro_sleep(0.002);
+	coro_stats(c, &stats);
+	/* The start, 10 yields, and the suspension. */
+	unit_check(stats.switch_count == 11, "switches");
+	unit_check(stats.suspend_count == 1, "suspensions");
+	unit_check(stats.run_ns > 0 && stats.wait_ns > 0, "time");
+	coro_wakeup(c);
+	coro_join(c);
+
+	struct coro_stats total;
+	coro_sched_stats(&total);
+	unit_check(total.switch_count >= total_before.switch_count + 12,
+		"sched switches");
+	unit_check(total.run_ns > total_before.run_ns, "sched time");
+
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+struct test_priority_ctx {
+	int id;
+	int *order;
+	int *pos;
+};
+
+static void *
+test_priority_order_f(void *arg)
+{
+	struct test_priority_ctx *ctx = (decltype(ctx))arg;
+	ctx->order[(*ctx->pos)++] = ctx->id;
+	return NULL;
+}
+
+struct test_fairness_ctx {
+	bool is_stopped;
+	int low_run_count;
+};
+
+static void *
+test_fairness_high_f(void *arg)
+{
+	struct test_fairness_ctx *ctx = (decltype(ctx))arg;
+	for (int i = 0; i < 170; ++i)
+		coro_yield();
+	ctx->is_stopped = true;
+	return (void *)(long)ctx->low_run_count;
+}
+
+static void *
+test_fairness_low_f(void *arg)
+{
+	struct test_fairness_ctx *ctx = (decltype(ctx))arg;
+	while (!ctx->is_stopped) {
+		++ctx->low_run_count;
+		coro_yield();
+	}
+	return NULL;
+}
+
+/** How many times a low coroutine runs while a high one is busy. */
+static long
+test_fairness_run(void)
+{
+	struct test_fairness_ctx ctx;
+	ctx.is_stopped = false;
+	ctx.low_run_count = 0;
+	struct coro *low = coro_new(test_fairness_low_f, &ctx);
+	struct coro *high = coro_new(test_fairness_high_f, &ctx);
+	coro_set_priority(low, CORO_PRIORITY_LOW);
+	coro_set_priority(high, CORO_PRIORITY_HIGH);
+	long res = (long)coro_join(high);
+	coro_join(low);
+	return res;
+}
+
+static void
+test_priority(void)
+{
+	unit_test_start();
+
+	const int coro_count = 3;
+	int priorities[coro_count] = {
+		CORO_PRIORITY_LOW, CORO_PRIORITY_NORMAL, CORO_PRIORITY_HIGH,
+	};
+	struct test_priority_ctx ctxs[coro_count];
+	struct coro *coros[coro_count];
+	int order[coro_count];
+	int pos = 0;
+	for (int i = 0; i < coro_count; ++i) {
+		ctxs[i].id = i;
+		ctxs[i].order = order;
+		ctxs[i].pos = &pos;
+		coros[i] = coro_new(test_priority_order_f, &ctxs[i]);
+		coro_set_priority(coros[i], priorities[i]);
+	}
+	for (int i = 0; i < coro_count; ++i)
+		coro_join(coros[i]);
+	unit_check(order[0] == 2 && order[1] == 1 && order[2] == 0,
+		"higher priority runs first");
+
+	/*
+	 * The high one gets 16 turns per each one of the low one.
+	 * The first and the last rounds can be partial.
+	 */
+	long low_run_count = test_fairness_run();
+	unit_check(low_run_count >= 170 / 16 - 1 &&
+		low_run_count <= 170 / 16 + 1, "low priority progresses");
+	coro_sched_set_fairness(false);
+	unit_check(test_fairness_run() == 0, "low priority starves");
+	coro_sched_set_fairness(true);
+
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+struct test_sync_ctx {
+	struct coro_mutex mutex;
+	struct coro_cond cond;
+	struct coro_sem sem;
+	struct coro_wait_group group;
+	int in_section;
+	int counter;
+	int ready_count;
+	bool is_ready;
+	/** How many coroutines wait for the cond. */
+	int waiter_count;
+};
+
+static void *
+test_mutex_f(void *arg)
+{
+	struct test_sync_ctx *ctx = (decltype(ctx))arg;
+	for (int i = 0; i < 100; ++i) {
+		coro_mutex_lock(&ctx->mutex);
+		unit_assert(ctx->in_section++ == 0);
+		coro_yield();
+		++ctx->counter;
+		--ctx->in_section;
+		coro_mutex_unlock(&ctx->mutex);
+	}
+	return NULL;
+}
+
+static void *
+test_cond_f(void *arg)
+{
+	struct test_sync_ctx *ctx = (decltype(ctx))arg;
+	coro_mutex_lock(&ctx->mutex);
+	++ctx->ready_count;
+	while (!ctx->is_ready)
+		coro_cond_wait(&ctx->cond, &ctx->mutex);
+	unit_assert(ctx->in_section++ == 0);
+	coro_yield();
+	++ctx->counter;
+	--ctx->in_section;
+	coro_mutex_unlock(&ctx->mutex);
+	return NULL;
+}
+
+static void *
+test_sem_f(void *arg)
+{
+	struct test_sync_ctx *ctx = (decltype(ctx))arg;
+	for (int i = 0; i < 10; ++i) {
+		coro_sem_wait(&ctx->sem);
+		/* Two at once, so atomics for the M:N mode. */
+		unit_assert(__atomic_add_fetch(&ctx->in_section, 1,
+			__ATOMIC_RELAXED) <= 2);
+		coro_yield();
+		__atomic_sub_fetch(&ctx->in_section, 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&ctx->counter, 1, __ATOMIC_RELAXED);
+		coro_sem_post(&ctx->sem);
+	}
+	coro_wait_group_done(&ctx->group);
+	return NULL;
+}
+
+static void
+test_sync(void)
+{
+	unit_test_start();
+
+	struct test_sync_ctx ctx;
+	coro_mutex_create(&ctx.mutex);
+	coro_cond_create(&ctx.cond);
+	coro_sem_create(&ctx.sem, 2);
+	coro_wait_group_create(&ctx.group);
+	ctx.in_section = 0;
+	ctx.counter = 0;
+	ctx.ready_count = 0;
+	ctx.is_ready = false;
+	ctx.waiter_count = 0;
+
+	const int coro_count = 5;
+	struct coro *coros[coro_count];
+	for (int i = 0; i < coro_count; ++i)
+		coros[i] = coro_new(test_mutex_f, &ctx);
+	for (int i = 0; i < coro_count; ++i)
+		coro_join(coros[i]);
+	unit_check(ctx.counter == coro_count * 100, "mutex");
+	unit_check(coro_mutex_trylock(&ctx.mutex), "trylock free");
+	unit_check(!coro_mutex_trylock(&ctx.mutex), "trylock locked");
+	coro_mutex_unlock(&ctx.mutex);
+
+	ctx.counter = 0;
+	for (int i = 0; i < coro_count; ++i)
+		coros[i] = coro_new(test_cond_f, &ctx);
+	while (ctx.ready_count < coro_count)
+		coro_yield();
+	coro_mutex_lock(&ctx.mutex);
+	ctx.is_ready = true;
+	coro_cond_signal(&ctx.cond);
+	coro_cond_broadcast(&ctx.cond);
+	coro_mutex_unlock(&ctx.mutex);
+	for (int i = 0; i < coro_count; ++i)
+		coro_join(coros[i]);
+	unit_check(ctx.counter == coro_count, "cond broadcast");
+
+	ctx.counter = 0;
+	coro_wait_group_add(&ctx.group, coro_count);
+	for (int i = 0; i < coro_count; ++i)
+		coros[i] = coro_new(test_sem_f, &ctx);
+	coro_wait_group_wait(&ctx.group);
+	unit_check(ctx.counter == coro_count * 10, "semaphore and wait group");
+	for (int i = 0; i < coro_count; ++i)
+		coro_join(coros[i]);
+	unit_check(coro_sem_trywait(&ctx.sem) && coro_sem_trywait(&ctx.sem) &&
+		!coro_sem_trywait(&ctx.sem), "sem trywait");
+
+	coro_wait_group_destroy(&ctx.group);
+	coro_sem_destroy(&ctx.sem);
+	coro_cond_destroy(&ctx.cond);
+	coro_mutex_destroy(&ctx.mutex);
+
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+struct test_switch_ctx {
+	int id;
+	int *order;
+	int *pos;
+	struct coro *target;
+};
+
+static void *
+test_switch_f(void *arg)
+{
+	struct test_switch_ctx *ctx = (decltype(ctx))arg;
+	ctx->order[(*ctx->pos)++] = ctx->id;
+	if (ctx->target != NULL)
+		coro_switch_to(ctx->target);
+	ctx->order[(*ctx->pos)++] = ctx->id;
+	return NULL;
+}
+
+static void
+test_switch_to(void)
+{
+	unit_test_start();
+
+	const int coro_count = 3;
+	struct test_switch_ctx ctxs[coro_count];
+	struct coro *coros[coro_count];
+	int order[coro_count * 2];
+	int pos = 0;
+	for (int i = 0; i < coro_count; ++i) {
+		ctxs[i].id = i;
+		ctxs[i].order = order;
+		ctxs[i].pos = &pos;
+		ctxs[i].target = NULL;
+		coros[i] = coro_new(test_switch_f, &ctxs[i]);
+	}
+	/* The first one jumps over the second one to the third. */
+	ctxs[0].target = coros[2];
+	for (int i = 0; i < coro_count; ++i)
+		coro_join(coros[i]);
+	unit_check(order[0] == 0 && order[1] == 2 && order[2] == 2 &&
+		order[3] == 1 && order[4] == 1 && order[5] == 0,
+		"switched to a runnable one");
+
+	pos = 0;
+	struct coro *c = coro_new(test_suspend_and_return_f, NULL);
+	coro_yield();
+	coro_switch_to(c);
+	unit_check(coro_join(c) == NULL, "switched to a suspended one");
+
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void *
+test_cancel_suspend_f(void *arg)
+{
+	(void)arg;
+	int wakeup_count = 0;
+	while (coro_suspend() == 0)
+		++wakeup_count;
+	unit_assert(coro_is_cancelled());
+	unit_assert(coro_suspend() == -1);
+	unit_assert(coro_yield() == -1);
+	return (void *)(intptr_t)wakeup_count;
+}
+
+static void *
+test_cancel_sleep_f(void *arg)
+{
+	(void)arg;
+	return (void *)(intptr_t)coro_sleep(100);
+}
+
+static void *
+test_cancel_wait_fd_f(void *arg)
+{
+	int fd = *(int *)arg;
+	int rc = coro_wait_fd(fd, CORO_EVENT_READ, -1);
+	unit_assert(rc == -1 && errno == ECANCELED);
+	return NULL;
+}
+
+static void *
+test_cancel_sem_f(void *arg)
+{
+	struct coro_sem *sem = (struct coro_sem *)arg;
+	coro_sem_wait(sem);
+	return (void *)(intptr_t)coro_is_cancelled();
+}
+
+static void
+test_cancel(void)
+{
+	unit_test_start();
+
+	const int coro_count = 1000;
+	struct coro **coros = new struct coro *[coro_count];
+	for (int i = 0; i < coro_count; ++i)
+		coros[i] = coro_new(test_cancel_suspend_f, NULL);
+	coro_yield();
+	coro_wakeup(coros[0]);
+	coro_yield();
+	for (int i = 0; i < coro_count; ++i)
+		coro_cancel(coros[i]);
+	unit_assert(coro_join(coros[0]) == (void *)1);
+	for (int i = 1; i < coro_count; ++i)
+		unit_assert(coro_join(coros[i]) == NULL);
+	delete[] coros;
+	unit_check(true, "suspended coroutines are cancelled");
+
+	double start = test_time();
+	struct coro *c = coro_new(test_cancel_sleep_f, NULL);
+	coro_yield();
+	coro_cancel(c);
+	unit_check(coro_join(c) == (void *)-1 && test_time() - start < 1,
+		"sleep is cancelled");
+
+	int fds[2];
+	test_pipe(fds);
+	c = coro_new(test_cancel_wait_fd_f, &fds[0]);
+	coro_yield();
+	coro_cancel(c);
+	unit_assert(coro_join(c) == NULL);
+	close(fds[0]);
+	close(fds[1]);
+	unit_check(true, "descriptor wait is cancelled");
+
+	struct coro_sem sem;
+	coro_sem_create(&sem, 0);
+	c = coro_new(test_cancel_sem_f, &sem);
+	coro_yield();
+	coro_cancel(c);
+	coro_yield();
+	coro_sem_post(&sem);
+	unit_check(coro_join(c) == (void *)1, "semaphore wait isn't cancelled");
+	coro_sem_destroy(&sem);
+
+	unit_test_finish();
+}
+
+struct test_wait_queue_ctx {
+	struct coro_wait_queue queue;
+	/** Order in which the waiters woke up. */
+	int order[8];
+	int pos;
+	/** Waiters which have done their waits. */
+	int done_count;
+	int wait_count;
+};
+
+struct test_wait_queue_side {
+	struct test_wait_queue_ctx *ctx;
+	int id;
+};
+
+static void *
+test_wait_queue_f(void *arg)
+{
+	struct test_wait_queue_side *side = (decltype(side))arg;
+	struct test_wait_queue_ctx *ctx = side->ctx;
+	int rc = coro_wait_queue_suspend(&ctx->queue);
+	ctx->order[ctx->pos++] = side->id;
+	return (void *)(intptr_t)rc;
+}
+
+static void
+test_wait_queue(void)
+{
+	unit_test_start();
+
+	const int coro_count = 4;
+	struct test_wait_queue_ctx ctx;
+	coro_wait_queue_create(&ctx.queue);
+	ctx.pos = 0;
+	struct test_wait_queue_side sides[coro_count];
+	struct coro *coros[coro_count];
+	for (int i = 0; i < coro_count; ++i) {
+		sides[i].ctx = &ctx;
+		sides[i].id = i;
+		coros[i] = coro_new(test_wait_queue_f, &sides[i]);
+	}
+	coro_yield();
+	unit_assert(ctx.pos == 0);
+	coro_set_priority(coros[3], CORO_PRIORITY_HIGH);
+	unit_assert(coro_wait_queue_wakeup_one(&ctx.queue));
+	coro_yield();
+	unit_check(ctx.pos == 1 && ctx.order[0] == 0, "wakeup one");
+
+	/* Other wakeups take the coroutines out of the queue. */
+	coro_wakeup(coros[1]);
+	coro_cancel(coros[2]);
+	coro_yield();
+	unit_check(ctx.pos == 3, "wakeup outside of the queue");
+	unit_check(coro_join(coros[2]) == (void *)-1, "cancelled waiter");
+	for (int i = 0; i < 2; ++i)
+		unit_assert(coro_join(coros[i]) == NULL);
+
+	/* The remaining one is alone in the queue. */
+	ctx.pos = 0;
+	for (int i = 0; i < 2; ++i)
+		coros[i] = coro_new(test_wait_queue_f, &sides[i]);
+	coro_yield();
+	coro_wait_queue_wakeup_all(&ctx.queue);
+	unit_assert(!coro_wait_queue_wakeup_one(&ctx.queue));
+	coro_yield();
+	unit_check(ctx.pos == 3 && ctx.order[0] == 3 && ctx.order[1] == 0 &&
+		ctx.order[2] == 1, "wakeup all keeps the order and priorities");
+	for (int i = 0; i < 2; ++i)
+		unit_assert(coro_join(coros[i]) == NULL);
+	unit_assert(coro_join(coros[3]) == NULL);
+
+	coro_wait_queue_prepare(&ctx.queue);
+	unit_check(!coro_wait_queue_abort(&ctx.queue) &&
+		!coro_wait_queue_wakeup_one(&ctx.queue),
+		"abort leaves the queue");
+	coro_wait_queue_destroy(&ctx.queue);
+
+	unit_test_finish();
+}
+
+static void *
+test_debug_peer_f(void *arg)
+{
+	struct coro **peer = (struct coro **)arg;
+	coro_suspend_on("peer", *peer);
+	return NULL;
+}
+
+static void *
+test_debug_timed_f(void *arg)
+{
+	return (void *)coro_suspend_timeout_on(10, "timed", arg);
+}
+
+static void *
+test_debug_join_f(void *arg)
+{
+	return coro_join((struct coro *)arg);
+}
+
+static void
+test_debug(void)
+{
+	unit_test_start();
+
+	coro_sched_set_debug(true);
+	unit_check(coro_sched_dump_waits() == 0, "no waits");
+	/* The peers wait for each other, making a cycle. */
+	struct coro *peers[2];
+	peers[0] = coro_new(test_debug_peer_f, &peers[1]);
+	peers[1] = coro_new(test_debug_peer_f, &peers[0]);
+	struct coro *joiner = coro_new(test_debug_join_f, peers[0]);
+	struct coro_sem sem;
+	coro_sem_create(&sem, 0);
+	struct coro *waiter = coro_new(test_cancel_sem_f, &sem);
+	struct coro *timed = coro_new(test_debug_timed_f, &sem);
+	coro_yield();
+	unit_check(coro_sched_dump_waits() == 5, "suspended ones are dumped");
+
+	coro_wakeup(timed);
+	unit_check(coro_join(timed) == (void *)true, "timed wait is woken up");
+	coro_wakeup(peers[0]);
+	coro_wakeup(peers[1]);
+	coro_sem_post(&sem);
+	unit_assert(coro_join(joiner) == NULL);
+	unit_assert(coro_join(peers[1]) == NULL);
+	unit_assert(coro_join(waiter) == NULL);
+	coro_sem_destroy(&sem);
+	unit_check(coro_sched_dump_waits() == 0, "woken up ones are dropped");
+	coro_sched_set_debug(false);
+
+	unit_test_finish();
+}
+
+/** The scheduler reports the coroutines it left suspended. */
+static void
+test_debug_stop(void)
+{
+	unit_test_start();
+
+	coro_sched_set_debug(true);
+	struct coro *c = coro_new(test_debug_peer_f, &c);
+	coro_sched_run();
+	unit_check(coro_sched_dump_waits() == 1, "left suspended");
+	coro_wakeup(c);
+	coro_sched_run();
+	unit_check(coro_join(c) == NULL, "woken up from outside");
+	coro_sched_set_debug(false);
+
+	unit_test_finish();
+}
+
+static int test_key_destroy_count = 0;
+
+static void
+test_key_destructor(void *value)
+{
+	unit_assert(value != NULL);
+	++test_key_destroy_count;
+}
+
+struct test_key_ctx {
+	int *keys;
+	int key_count;
+	/** The values are set to the addresses of the id's. */
+	int id;
+};
+
+static void *
+test_key_f(void *arg)
+{
+	struct test_key_ctx *ctx = (decltype(ctx))arg;
+	for (int i = 0; i < ctx->key_count; ++i) {
+		unit_assert(coro_getspecific(ctx->keys[i]) == NULL);
+		coro_setspecific(ctx->keys[i], &ctx->id);
+	}
+	coro_yield();
+	for (int i = 0; i < ctx->key_count; ++i)
+		unit_assert(coro_getspecific(ctx->keys[i]) == &ctx->id);
+	return NULL;
+}
+
+static void
+test_keys(void)
+{
+	unit_test_start();
+
+	/* Enough for the values outside of the coroutine object. */
+	const int key_count = 20;
+	int keys[key_count];
+	for (int i = 0; i < key_count; ++i) {
+		keys[i] = coro_key_create(test_key_destructor);
+		unit_assert(keys[i] >= 0);
+	}
+	const int coro_count = 3;
+	struct test_key_ctx ctxs[coro_count];
+	struct coro *coros[coro_count];
+	for (int round = 0; round < 2; ++round) {
+		test_key_destroy_count = 0;
+		for (int i = 0; i < coro_count; ++i) {
+			ctxs[i].keys = keys;
+			ctxs[i].key_count = key_count;
+			ctxs[i].id = i;
+			coros[i] = coro_new(test_key_f, &ctxs[i]);
+		}
+		for (int i = 0; i < coro_count; ++i)
+			unit_assert(coro_join(coros[i]) == NULL);
+		unit_assert(test_key_destroy_count == coro_count * key_count);
+	}
+	/* The second round reuses the coroutines from the pool. */
+	unit_check(true, "each coroutine has own values");
+	unit_check(coro_getspecific(keys[0]) == NULL, "not inherited");
+
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void *
+test_engine_child_f(void *arg)
+{
+	++*(int *)arg;
+	return NULL;
+}
+
+static void *
+test_engine_f(void *arg)
+{
+	int *counter = (int *)arg;
+	/* Stays in the same engine. */
+	struct coro *c = coro_new(test_engine_child_f, counter);
+	coro_yield();
+	coro_sleep(0.01);
+	coro_join(c);
+	++*counter;
+	return NULL;
+}
+
+static void *
+test_engine_read_f(void *arg)
+{
+	int fd = *(int *)arg;
+	return (void *)(intptr_t)coro_wait_fd(fd, CORO_EVENT_READ, -1);
+}
+
+enum {
+	TEST_ENGINE_CORO_COUNT = 100,
+};
+
+static void *
+test_engine_yield_f(void *arg)
+{
+	for (int i = 0; i < 100; ++i)
+		coro_yield();
+	++*(int *)arg;
+	return NULL;
+}
+
+static void *
+test_engine_timed_f(void *arg)
+{
+	coro_suspend_timeout(0.001);
+	return arg;
+}
+
+static void *
+test_engine_suspend_f(void *arg)
+{
+	coro_suspend();
+	++*(int *)arg;
+	return NULL;
+}
+
+static void *
+test_engine_wakeup_thread_f(void *arg)
+{
+	struct coro **coros = (struct coro **)arg;
+	coro_wakeup(coros[0]);
+	coro_wakeup(coros[1]);
+	return NULL;
+}
+
+/** Each thread with its own engine. */
+static void *
+test_engine_thread_f(void *arg)
+{
+	int *counter = (int *)arg;
+	struct coro_engine *engine = coro_engine_new();
+	struct coro_attr attr;
+	coro_attr_create(&attr);
+	attr.engine = engine;
+	struct coro *coros[TEST_ENGINE_CORO_COUNT];
+	for (int i = 0; i < TEST_ENGINE_CORO_COUNT; ++i)
+		coros[i] = coro_new_ex(test_engine_yield_f, counter, &attr);
+	while (coro_engine_run_once(engine) >= 0) {
+	}
+	for (int i = 0; i < TEST_ENGINE_CORO_COUNT; ++i)
+		coro_join(coros[i]);
+	coro_engine_delete(engine);
+	return NULL;
+}
+
+static void
+test_engine(void)
+{
+	unit_test_start();
+
+	struct coro_engine *engine = coro_engine_new();
+	struct coro_attr attr;
+	coro_attr_create(&attr);
+	attr.engine = engine;
+	int counter = 0;
+	struct coro *c = coro_new_ex(test_engine_f, &counter, &attr);
+	unit_check(coro_engine_run_once(engine) == 0, "runnable after a pass");
+	unit_check(counter == 0, "one pass");
+	double timeout = coro_engine_run_once(engine);
+	unit_check(counter == 1 && timeout > 0 && timeout < 0.1,
+		"time until the timer");
+	unit_check(coro_engine_run_for(engine, -1) < 0, "nothing left");
+	unit_check(counter == 2, "all done");
+	unit_assert(coro_join(c) == NULL);
+
+	/* Woken up from outside. */
+	c = coro_new_ex(test_suspend_and_return_f, &counter, &attr);
+	unit_assert(coro_engine_run_once(engine) < 0);
+	coro_wakeup(c);
+	unit_assert(coro_engine_run_once(engine) < 0);
+	unit_check(coro_join(c) == &counter, "wakeup from outside");
+
+	/*
+	 * A wakeup from another thread comes after the coroutine is
+	 * woken up by its timeout and finished. It is still queued
+	 * when the coroutine is joined, and the wakeups queued before
+	 * it must survive the reuse of the object.
+	 */
+	static struct coro_storage storage;
+	for (int i = 0; i < 2; ++i) {
+		counter = 0;
+		struct coro_attr timed_attr = attr;
+		timed_attr.storage = i == 0 ? NULL : &storage;
+		struct coro *coros[2];
+		coros[0] = coro_new_ex(test_engine_suspend_f, &counter, &attr);
+		coros[1] = coro_new_ex(test_engine_timed_f, &counter,
+			&timed_attr);
+		unit_assert(coro_engine_run_once(engine) > 0);
+		usleep(10000);
+		unit_assert(coro_engine_run_once(engine) < 0);
+		pthread_t thread;
+		unit_assert(pthread_create(&thread, NULL,
+			test_engine_wakeup_thread_f, coros) == 0);
+		pthread_join(thread, NULL);
+		unit_assert(coro_join(coros[1]) == &counter);
+		memset(&storage, '#', sizeof(storage));
+		c = coro_new_ex(test_engine_child_f, &counter, &attr);
+		coro_engine_run_for(engine, -1);
+		unit_assert(coro_join(c) == NULL);
+		bool ok = counter == 2;
+		if (!ok) {
+			/* Not to hang in the join. */
+			coro_wakeup(coros[0]);
+			coro_engine_run_for(engine, -1);
+		}
+		unit_assert(coro_join(coros[0]) == NULL);
+		unit_check(ok, i == 0 ? "remote wakeup of a joined coroutine" :
+			"remote wakeup of a joined coroutine in user storage");
+	}
+
+	/* Stopped by the timeout. */
+	c = coro_new_ex(test_cancel_sleep_f, NULL, &attr);
+	double start = test_time();
+	timeout = coro_engine_run_for(engine, 0.01);
+	unit_check(test_time() - start < 1 && timeout > 1, "run for a time");
+	coro_cancel(c);
+	coro_engine_run_for(engine, -1);
+	unit_check(coro_join(c) == (void *)-1, "cancelled from outside");
+
+	/* Polled by a foreign loop. */
+	int fds[2];
+	test_pipe(fds);
+	c = coro_new_ex(test_engine_read_f, &fds[0], &attr);
+	unit_assert(coro_engine_run_once(engine) < 0);
+	unit_assert(write(fds[1], "x", 1) == 1);
+	struct pollfd pfd;
+	pfd.fd = coro_engine_fd(engine);
+	pfd.events = POLLIN;
+	unit_check(poll(&pfd, 1, 1000) == 1, "engine descriptor is readable");
+	unit_assert(coro_engine_run_once(engine) < 0);
+	unit_check(coro_join(c) == (void *)CORO_EVENT_READ, "descriptor wait");
+	close(fds[0]);
+	close(fds[1]);
+	coro_engine_delete(engine);
+
+	const int thread_count = 4;
+	pthread_t threads[thread_count];
+	int counters[thread_count];
+	for (int i = 0; i < thread_count; ++i) {
+		counters[i] = 0;
+		unit_assert(pthread_create(&threads[i], NULL,
+			test_engine_thread_f, &counters[i]) == 0);
+	}
+	bool ok = true;
+	for (int i = 0; i < thread_count; ++i) {
+		pthread_join(threads[i], NULL);
+		ok = ok && counters[i] == TEST_ENGINE_CORO_COUNT;
+	}
+	unit_check(ok, "engine per thread");
+
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void *
+test_mt_yield_f(void *arg)
+{
+	int *counter = (int *)arg;
+	for (int i = 0; i < 1000; ++i) {
+		__atomic_add_fetch(counter, 1, __ATOMIC_RELAXED);
+		coro_yield();
+	}
+	return NULL;
+}
+
+struct test_mt_pair_ctx {
+	int turn;
+	int step_count;
+	/** Hand the turn over with coro_switch_to(). */
+	bool is_direct;
+	struct coro *coros[2];
+};
+
+struct test_mt_side_ctx {
+	struct test_mt_pair_ctx *pair;
+	int id;
+};
+
+static void *
+test_mt_ping_pong_f(void *arg)
+{
+	struct test_mt_side_ctx *ctx = (decltype(ctx))arg;
+	struct test_mt_pair_ctx *pair = ctx->pair;
+	for (int i = 0; i < pair->step_count; ++i) {
+		while (__atomic_load_n(&pair->turn, __ATOMIC_ACQUIRE) != ctx->id)
+			coro_suspend();
+		__atomic_store_n(&pair->turn, 1 - ctx->id, __ATOMIC_RELEASE);
+		if (pair->is_direct)
+			coro_switch_to(pair->coros[1 - ctx->id]);
+		else
+			coro_wakeup(pair->coros[1 - ctx->id]);
+	}
+	return NULL;
+}
+
+static void *
+test_mt_spawn_f(void *arg)
+{
+	int *counter = (int *)arg;
+	const int coro_count = 100;
+	struct coro *coros[coro_count];
+	for (int i = 0; i < coro_count; ++i)
+		coros[i] = coro_new(test_mt_yield_f, counter);
+	for (int i = 0; i < coro_count; ++i)
+		unit_assert(coro_join(coros[i]) == NULL);
+	return NULL;
+}
+
+static void *
+test_mt_sleep_f(void *arg)
+{
+	int *counter = (int *)arg;
+	for (int i = 0; i < 5; ++i) {
+		coro_sleep(0.002);
+		__atomic_add_fetch(counter, 1, __ATOMIC_RELAXED);
+	}
+	return NULL;
+}
+
+struct test_mt_pipe_ctx {
+	int in;
+	int out;
+	int step_count;
+};
+
+/** Get a byte and pass it on, waiting for the descriptors. */
+static void *
+test_mt_pipe_f(void *arg)
+{
+	struct test_mt_pipe_ctx *ctx = (decltype(ctx))arg;
+	for (int i = 0; i < ctx->step_count; ++i) {
+		char c;
+		while (read(ctx->in, &c, 1) != 1) {
+			unit_assert(errno == EAGAIN);
+			unit_assert(coro_wait_fd(ctx->in, CORO_EVENT_READ,
+				-1) >= 0);
+		}
+		unit_assert(write(ctx->out, &c, 1) == 1);
+	}
+	return NULL;
+}
+
+static void *
+test_mt_wait_queue_f(void *arg)
+{
+	struct test_wait_queue_ctx *ctx = (decltype(ctx))arg;
+	for (int i = 0; i < ctx->wait_count; ++i)
+		coro_wait_queue_suspend(&ctx->queue);
+	__atomic_add_fetch(&ctx->done_count, 1, __ATOMIC_SEQ_CST);
+	return NULL;
+}
+
+/** A pair of coroutines passing the turn with single wakeups. */
+struct test_mt_turn_ctx {
+	struct coro_wait_queue queue;
+	int turn;
+	int step_count;
+};
+
+struct test_mt_turn_side {
+	struct test_mt_turn_ctx *ctx;
+	int id;
+};
+
+static void *
+test_mt_turn_f(void *arg)
+{
+	struct test_mt_turn_side *side = (decltype(side))arg;
+	struct test_mt_turn_ctx *ctx = side->ctx;
+	for (int i = 0; i < ctx->step_count; ++i) {
+		while (true) {
+			coro_wait_queue_prepare(&ctx->queue);
+			if (__atomic_load_n(&ctx->turn, __ATOMIC_ACQUIRE) ==
+			    side->id) {
+				coro_wait_queue_abort(&ctx->queue);
+				break;
+			}
+			coro_wait_queue_commit(&ctx->queue);
+		}
+		__atomic_store_n(&ctx->turn, 1 - side->id, __ATOMIC_RELEASE);
+		coro_wait_queue_wakeup_one(&ctx->queue);
+	}
+	return NULL;
+}
+
+/** Wake up the cond waiters when all of them are there. */
+static void *
+test_mt_cond_waker_f(void *arg)
+{
+	struct test_sync_ctx *ctx = (decltype(ctx))arg;
+	while (true) {
+		coro_mutex_lock(&ctx->mutex);
+		if (ctx->ready_count == ctx->waiter_count)
+			break;
+		coro_mutex_unlock(&ctx->mutex);
+		coro_yield();
+	}
+	ctx->is_ready = true;
+	coro_cond_broadcast(&ctx->cond);
+	coro_mutex_unlock(&ctx->mutex);
+	return NULL;
+}
+
+static void *
+test_mt_group_wait_f(void *arg)
+{
+	struct test_sync_ctx *ctx = (decltype(ctx))arg;
+	coro_wait_group_wait(&ctx->group);
+	return (void *)(intptr_t)__atomic_load_n(&ctx->counter,
+		__ATOMIC_RELAXED);
+}
+
+/** Keep waking up everyone until all the waits are done. */
+static void *
+test_mt_wait_queue_waker_f(void *arg)
+{
+	struct test_wait_queue_ctx *ctx = (decltype(ctx))arg;
+	int coro_count = ctx->pos;
+	while (__atomic_load_n(&ctx->done_count, __ATOMIC_SEQ_CST) !=
+	       coro_count) {
+		coro_wait_queue_wakeup_all(&ctx->queue);
+		coro_wait_queue_wakeup_one(&ctx->queue);
+		coro_yield();
+	}
+	return NULL;
+}
+
+static void
+test_mt(void)
+{
+	unit_test_start();
+
+	const int thread_count = 4;
+	const int coro_count = 64;
+	struct coro *coros[coro_count];
+	int counter = 0;
+	for (int i = 0; i < coro_count; ++i)
+		coros[i] = coro_new(test_mt_yield_f, &counter);
+	coro_sched_run_mt(thread_count);
+	for (int i = 0; i < coro_count; ++i)
+		unit_assert(coro_join(coros[i]) == NULL);
+	unit_check(counter == coro_count * 1000, "yields in many threads");
+
+	const int pair_count = 8;
+	struct test_mt_pair_ctx pairs[pair_count];
+	struct test_mt_side_ctx sides[pair_count][2];
+	for (int is_direct = 0; is_direct < 2; ++is_direct) {
+		for (int i = 0; i < pair_count; ++i) {
+			pairs[i].turn = 0;
+			pairs[i].step_count = 1000;
+			pairs[i].is_direct = is_direct;
+			for (int j = 0; j < 2; ++j) {
+				sides[i][j].pair = &pairs[i];
+				sides[i][j].id = j;
+				pairs[i].coros[j] = coro_new(
+					test_mt_ping_pong_f, &sides[i][j]);
+			}
+		}
+		coro_sched_run_mt(thread_count);
+		for (int i = 0; i < pair_count; ++i) {
+			for (int j = 0; j < 2; ++j) {
+				unit_assert(coro_join(pairs[i].coros[j]) ==
+					NULL);
+			}
+		}
+	}
+	unit_check(true, "cross-thread wakeups");
+
+	counter = 0;
+	for (int i = 0; i < coro_count; ++i)
+		coros[i] = coro_new(test_mt_spawn_f, &counter);
+	coro_sched_run_mt(thread_count);
+	for (int i = 0; i < coro_count; ++i)
+		unit_assert(coro_join(coros[i]) == NULL);
+	unit_check(counter == coro_count * 100 * 1000,
+		"spawn and join in many threads");
+
+	counter = 0;
+	for (int i = 0; i < coro_count; ++i)
+		coros[i] = coro_new(test_mt_sleep_f, &counter);
+	coro_sched_run_mt(thread_count);
+	for (int i = 0; i < coro_count; ++i)
+		unit_assert(coro_join(coros[i]) == NULL);
+	unit_check(counter == coro_count * 5, "sleeps in many threads");
+
+	/* A ring of coroutines passing a byte through pipes. */
+	const int ring_size = 8;
+	int pipes[ring_size][2];
+	struct test_mt_pipe_ctx ring[ring_size];
+	for (int i = 0; i < ring_size; ++i)
+		test_pipe(pipes[i]);
+	for (int i = 0; i < ring_size; ++i) {
+		ring[i].in = pipes[i][0];
+		ring[i].out = pipes[(i + 1) % ring_size][1];
+		ring[i].step_count = 200;
+		coros[i] = coro_new(test_mt_pipe_f, &ring[i]);
+	}
+	unit_fail_if(write(pipes[0][1], "x", 1) != 1);
+	coro_sched_run_mt(thread_count);
+	for (int i = 0; i < ring_size; ++i) {
+		unit_assert(coro_join(coros[i]) == NULL);
+		close(pipes[i][0]);
+		close(pipes[i][1]);
+	}
+	unit_check(true, "descriptor waits in many threads");
+
+	struct test_sync_ctx sync;
+	coro_mutex_create(&sync.mutex);
+	sync.in_section = 0;
+	sync.counter = 0;
+	for (int i = 0; i < coro_count; ++i)
+		coros[i] = coro_new(test_mutex_f, &sync);
+	coro_sched_run_mt(thread_count);
+	for (int i = 0; i < coro_count; ++i)
+		unit_assert(coro_join(coros[i]) == NULL);
+	unit_check(sync.counter == coro_count * 100, "mutex in many threads");
+
+	/* The last one broadcasts to all the others. */
+	coro_cond_create(&sync.cond);
+	sync.counter = 0;
+	sync.ready_count = 0;
+	sync.is_ready = false;
+	sync.waiter_count = coro_count - 1;
+	for (int i = 0; i < coro_count - 1; ++i)
+		coros[i] = coro_new(test_cond_f, &sync);
+	coros[coro_count - 1] = coro_new(test_mt_cond_waker_f, &sync);
+	coro_sched_run_mt(thread_count);
+	for (int i = 0; i < coro_count; ++i)
+		unit_assert(coro_join(coros[i]) == NULL);
+	coro_cond_destroy(&sync.cond);
+	coro_mutex_destroy(&sync.mutex);
+	unit_check(sync.counter == coro_count - 1,
+		"cond broadcast in many threads");
+
+	/* The last one waits for all the others. */
+	coro_sem_create(&sync.sem, 2);
+	coro_wait_group_create(&sync.group);
+	sync.counter = 0;
+	coro_wait_group_add(&sync.group, coro_count - 1);
+	for (int i = 0; i < coro_count - 1; ++i)
+		coros[i] = coro_new(test_sem_f, &sync);
+	coros[coro_count - 1] = coro_new(test_mt_group_wait_f, &sync);
+	coro_sched_run_mt(thread_count);
+	for (int i = 0; i < coro_count - 1; ++i)
+		unit_assert(coro_join(coros[i]) == NULL);
+	intptr_t counter_seen = (intptr_t)coro_join(coros[coro_count - 1]);
+	coro_wait_group_destroy(&sync.group);
+	coro_sem_destroy(&sync.sem);
+	unit_check(counter_seen == (coro_count - 1) * 10 &&
+		sync.counter == (coro_count - 1) * 10,
+		"semaphore and wait group in many threads");
+
+	struct test_wait_queue_ctx wait_ctx;
+	coro_wait_queue_create(&wait_ctx.queue);
+	wait_ctx.done_count = 0;
+	wait_ctx.wait_count = 100;
+	wait_ctx.pos = coro_count - 1;
+	for (int i = 0; i < coro_count - 1; ++i)
+		coros[i] = coro_new(test_mt_wait_queue_f, &wait_ctx);
+	coros[coro_count - 1] = coro_new(test_mt_wait_queue_waker_f,
+		&wait_ctx);
+	coro_sched_run_mt(thread_count);
+	for (int i = 0; i < coro_count; ++i)
+		unit_assert(coro_join(coros[i]) == NULL);
+	coro_wait_queue_destroy(&wait_ctx.queue);
+	unit_check(true, "wait queue in many threads");
+
+	/* A lost wakeup would hang a pair. */
+	const int turn_count = 8;
+	struct test_mt_turn_ctx turns[turn_count];
+	struct test_mt_turn_side turn_sides[turn_count][2];
+	struct coro *turn_coros[turn_count][2];
+	for (int i = 0; i < turn_count; ++i) {
+		coro_wait_queue_create(&turns[i].queue);
+		turns[i].turn = 0;
+		turns[i].step_count = 1000;
+		for (int j = 0; j < 2; ++j) {
+			turn_sides[i][j].ctx = &turns[i];
+			turn_sides[i][j].id = j;
+			turn_coros[i][j] = coro_new(test_mt_turn_f,
+				&turn_sides[i][j]);
+		}
+	}
+	coro_sched_run_mt(thread_count);
+	for (int i = 0; i < turn_count; ++i) {
+		for (int j = 0; j < 2; ++j)
+			unit_assert(coro_join(turn_coros[i][j]) == NULL);
+		coro_wait_queue_destroy(&turns[i].queue);
+	}
+	unit_check(true, "wait queue with single wakeups in many threads");
+
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
 static void *
 coro_main_f(void *arg)
 {
@@ -171,6 +1663,20 @@ coro_main_f(void *arg)
 	test_wakup_self();
 	test_join_of_join();
 	test_wakeup_of_finished();
+	test_stack_size();
+	test_user_memory();
+	test_stack_mode();
+	test_pool_limit();
+	test_timers();
+	test_wait_fd();
+	test_stats();
+	test_priority();
+	test_sync();
+	test_switch_to();
+	test_keys();
+	test_cancel();
+	test_wait_queue();
+	test_debug();
 	return NULL;
 }
 
@@ -182,6 +1688,9 @@ main(void)
 	coro_sched_run();
 	void *rc = coro_join(main_coro);
 	unit_check(rc == NULL, "main coro rc");
+	test_debug_stop();
+	test_engine();
+	test_mt();
 	coro_sched_destroy();
 	return 0;
 }